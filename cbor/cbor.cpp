@@ -1,3 +1,35 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <float.h>
+#include <math.h>
+#include <algorithm>
+#include <new>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+// GCC/Clang включают F16C только по -mf16c (-mavx2 его не включает), MSVC отдельного макроса не имеет
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#include <immintrin.h>
+#define CBOR_F16C
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CBOR_SSE2
+#endif
 #include "cbor.h"
 #include "utf8.h"
 
@@ -5,277 +37,360 @@
 // RFC 7049 (CBOR)
 
 //////////////////////////////////////////////////////////////
-// CBOR Writer
+// float 16-bit
 
-TRCBORWriter::TRCBORWriter() : 
-	blockmemsize(512),
-	fullsize(512),
-	usesize(0)
+bool cborfloattohalf(float value, uint16_t& half)
 {
-	pointer = malloc(fullsize);
-}
+	uint32_t bits;
+	memcpy(&bits, &value, 4);
 
-TRCBORWriter::~TRCBORWriter()
-{
-	free(pointer);
-	pointer = nullptr;
-}
+	uint16_t sign = (bits >> 16) & 0x8000;
+	int32_t exponent = (bits >> 23) & 0xff;
+	uint32_t mantissa = bits & 0x7fffff;
 
-void TRCBORWriter::needmemory(size_t needsize)
-{
-	if (usesize + needsize > fullsize)
+	if (exponent == 0xff) // бесконечность или NaN
+	{
+		half = mantissa == 0 ? sign | 0x7c00 : 0x7e00;
+		return true;
+	}
+
+	if (exponent == 0 && mantissa == 0) // +0 и -0
+	{
+		half = sign;
+		return true;
+	}
+
+	exponent = exponent - 127 + 15;
+	if (exponent >= 31) // слишком большое
+		return false;
+
+	if (exponent <= 0) // денормализованное число в 16 битах
 	{
-		fullsize = usesize + needsize + blockmemsize;
-		pointer = realloc(pointer, fullsize);
+		int32_t shift = 14 - exponent; // 13 бит разницы мантисс + сдвиг денормализации
+		if (shift > 24)
+			return false;
+
+		mantissa |= 0x800000;
+		if (mantissa & ((1 << shift) - 1))
+			return false;
+
+		half = sign | (uint16_t)(mantissa >> shift);
+		return true;
 	}
+
+	if (mantissa & 0x1fff) // младшие 13 бит мантиссы теряются
+		return false;
+
+	half = sign | (uint16_t)(exponent << 10) | (uint16_t)(mantissa >> 13);
+	return true;
 }
 
-void TRCBORWriter::Clear(void)
+float cborhalftofloat(uint16_t half)
 {
-	usesize = 0;
-	if (fullsize > 1024 * 10)
+#ifdef CBOR_F16C
+	return _cvtsh_ss(half);
+#else
+	uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+	uint32_t exponent = (half >> 10) & 0x1f;
+	uint32_t mantissa = half & 0x3ff;
+	uint32_t bits;
+
+	if (exponent == 0x1f) // бесконечность или NaN
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	else
+	if (exponent != 0)
+		bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+	else
+	if (mantissa == 0)
+		bits = sign;
+	else
 	{
-		fullsize = 1024 * 10;
-		pointer = realloc(pointer, fullsize);
+		// денормализованное 16-битное число - в 32 битах нормализованное
+		exponent = 127 - 15 + 1;
+		while ((mantissa & 0x400) == 0)
+		{
+			mantissa <<= 1;
+			exponent--;
+		}
+		bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
 	}
+
+	float value;
+	memcpy(&value, &bits, 4);
+	return value;
+#endif
 }
 
-size_t TRCBORWriter::Size(void)  const
+void cborhalftofloat(const uint16_t* in, float* out, size_t count)
 {
-	return usesize;
+	size_t i = 0;
+
+#ifdef CBOR_F16C
+	for (; i + 8 <= count; i += 8)
+		_mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(in + i))));
+#endif
+
+	for (; i < count; ++i)
+		out[i] = cborhalftofloat(in[i]);
 }
 
-void TRCBORWriter::SetSize(size_t size)
+//////////////////////////////////////////////////////////////
+// CBOR Writer
+
+static void* defaultrealloc(void* /*userdata*/, void* ptr, size_t size)
 {
-	usesize = size;
+	return realloc(ptr, size);
 }
 
-void* TRCBORWriter::GetCurrentPointer(void) const
+static void defaultfree(void* /*userdata*/, void* ptr)
 {
-	return (uint8_t*)pointer + usesize;
+	free(ptr);
 }
 
-void* TRCBORWriter::Pointer(void) const
+TRCBORWriter::TRCBORWriter() : 
+	fullsize(512),
+	usesize(0),
+	blockmemsize(512),
+	retainsize(1024 * 10),
+	shortestfloat(false)
 {
-	return pointer;
+	allocator.reallocfunc = defaultrealloc;
+	allocator.freefunc = defaultfree;
+	allocator.userdata = nullptr;
+
+	pointer = allocator.reallocfunc(allocator.userdata, nullptr, fullsize);
 }
 
-//   (  ,   ..)
-void TRCBORWriter::writeCBORSizeValue32(uint8_t majortype, uint32_t value)
+TRCBORWriter::TRCBORWriter(const TRCBORAllocator& allocator) :
+	fullsize(512),
+	usesize(0),
+	blockmemsize(512),
+	retainsize(1024 * 10),
+	shortestfloat(false),
+	allocator(allocator)
 {
-	uint8_t additionaltype;
+	pointer = this->allocator.reallocfunc(this->allocator.userdata, nullptr, fullsize);
+}
 
-	if (value == (value & 0xffff))
-	{
-		if (value == (value & 0xff))
-		{
-			additionaltype = 24; // uint8_t
-			Write8U((majortype << 5) | additionaltype);
-			Write8U(value);
-		}
-		else
-		{
-			additionaltype = 25; // uint16_t
-			Write8U((majortype << 5) | additionaltype);
-			Write16U(value);
-		}
-	}
-	else
-	{
-		additionaltype = 26; // uint32_t
-		Write8U((majortype << 5) | additionaltype);
-		Write32U(value);
-	}
+TRCBORWriter::~TRCBORWriter()
+{
+	allocator.freefunc(allocator.userdata, pointer);
+	pointer = nullptr;
 }
 
-void TRCBORWriter::WriteCBORValue(int32_t value)
+// геометрический рост буфера - при записи больших сообщений количество realloc растет логарифмически
+void TRCBORWriter::growmemory(size_t newsize)
 {
-	uint8_t majortype(HCBOR_POSITIVEINTEGER);
-	uint32_t resvalue;
+	size_t size = fullsize + fullsize / 2;
+	if (size < fullsize + blockmemsize)
+		size = fullsize + blockmemsize;
+	if (size < newsize)
+		size = newsize;
+
+	fullsize = size;
+	pointer = allocator.reallocfunc(allocator.userdata, pointer, fullsize);
+}
 
-	if (value < 0)
+void TRCBORWriter::Reserve(size_t size)
+{
+	if (size > fullsize)
 	{
-		majortype = HCBOR_NEGATIVEINTEGER;
-		resvalue = -value - 1;
+		fullsize = size;
+		pointer = allocator.reallocfunc(allocator.userdata, pointer, fullsize);
 	}
-	else
-		resvalue = value;
-
-	if (resvalue < 24)
-		Write8U((majortype << 5) | resvalue);
-	else	
-		writeCBORSizeValue32(majortype, resvalue);
 }
 
-void TRCBORWriter::WriteCBORValue(int64_t value)
+void* TRCBORWriter::Allocate(size_t size)
 {
-	int64_t resvalue;
-	uint8_t majortype(HCBOR_POSITIVEINTEGER);
-	uint8_t additionaltype;
+	needmemory(size + 8);
 
-	if (value < 0)
-	{
-		majortype = HCBOR_NEGATIVEINTEGER;
-		resvalue = -value - 1;
-	}
-	else
-		resvalue = value;
+	void* p = (uint8_t*)pointer + usesize;
+	usesize += size;
 
-	if (resvalue < 24)
-	{
-		Write8U((majortype << 5) | (uint8_t)resvalue);
-	}
-	else
-	{
-		if (resvalue == (resvalue & 0xffffffff))
-		{
-			writeCBORSizeValue32(majortype, (uint32_t)resvalue);
-		}
-		else
-		{
-			additionaltype = 27; // uint64_t
-			Write8U((majortype << 5) | additionaltype);
-			Write64I(resvalue);
-		}
-	}
+	return p;
 }
 
-void TRCBORWriter::WriteCBORByteArray(void* buffer, size_t sizebuffer)
+size_t TRCBORWriter::Capacity(void) const
 {
-	uint8_t majortype(HCBOR_BYTEARRAY);
-
-	if (sizebuffer < 24)
-		Write8U((majortype << 5) | (uint8_t)sizebuffer);
-	else
-		writeCBORSizeValue32(majortype, sizebuffer);
-	
-	WriteBuffer(buffer, sizebuffer);
+	return fullsize;
 }
 
-void TRCBORWriter::WriteCBORString(const std::string& str)
+void TRCBORWriter::SetRetainSize(size_t size)
 {
-	uint8_t majortype(HCBOR_STRING_UTF8);
-
-	if (str.size() < 24)
-		Write8U((majortype << 5) | (uint8_t)str.size());
-	else
-		writeCBORSizeValue32(majortype, (uint32_t)str.size());
-
-	WriteString(str);
+	retainsize = size;
 }
 
-void TRCBORWriter::WriteCBORString(const std::wstring& str)
+void TRCBORWriter::SetShortestFloat(bool enable)
 {
-	std::string utf8str;
-	utf8str = wstrTOutf8(str);
-	WriteCBORString(utf8str);
+	shortestfloat = enable;
 }
 
-void TRCBORWriter::WriteCBORItemsArrayMarker(uint32_t itemscount)
+void TRCBORWriter::Clear(void)
 {
-	uint8_t majortype(HCBOR_ITEMSARRAY);
-
-	if (itemscount == UINT32_MAX)
-	{
-		uint8_t additionaltype(31); //  
-		Write8U((majortype << 5) | additionaltype);
-	}
-	else
+	usesize = 0;
+	if (fullsize > retainsize && fullsize > blockmemsize)
 	{
-		if (itemscount < 24)
-			Write8U((majortype << 5) | itemscount);
-		else
-			writeCBORSizeValue32(majortype, itemscount);
+		fullsize = retainsize < blockmemsize ? blockmemsize : retainsize;
+		pointer = allocator.reallocfunc(allocator.userdata, pointer, fullsize);
 	}
 }
 
-void TRCBORWriter::WriteCBORPairsArrayMarker(uint32_t pairscount)
+size_t TRCBORWriter::Size(void)  const
 {
-	uint8_t majortype(HCBOR_PAIRSARRAY);
-
-	if (pairscount == UINT32_MAX)
-	{
-		uint8_t additionaltype(31); //  
-		Write8U((majortype << 5) | additionaltype);
-	}
-	else
-	{
-		if (pairscount < 24)
-			Write8U((majortype << 5) | pairscount);
-		else
-			writeCBORSizeValue32(majortype, pairscount);
-	}
+	return usesize;
 }
 
-void TRCBORWriter::WriteCBORFloat(float value)
+bool TRCBORWriter::IsContiguous(void) const
 {
-	uint8_t majortype(HCBOR_FLOATSIMPLE);
-	uint8_t additionaltype(26); // float 32-bit
+	return true;
+}
 
-	Write8U((majortype << 5) | additionaltype);
-	Write32F(value);
+void TRCBORWriter::SetSize(size_t size)
+{
+	usesize = size;
 }
 
-void TRCBORWriter::WriteCBORFloat(double value)
+void* TRCBORWriter::GetCurrentPointer(void) const
 {
-	uint8_t majortype(HCBOR_FLOATSIMPLE);
-	uint8_t additionaltype(27); // float 64-bit
+	return (uint8_t*)pointer + usesize;
+}
 
-	Write8U((majortype << 5) | additionaltype);
-	Write64F(value);
+void* TRCBORWriter::Pointer(void) const
+{
+	return pointer;
 }
 
-void TRCBORWriter::WriteCBORBool(bool value)
+void TRCBORWriter::writeCBORShortestFloat(double value)
 {
-	uint8_t majortype(HCBOR_FLOATSIMPLE);
-	uint8_t additionaltype;
+	uint8_t* p;
 
-	if (value == false)
-		additionaltype = 20; // false
-	else
-		additionaltype = 21; // true
+	// NaN пишется как float 16-bit (канонический NaN 0x7e00)
+	if (value != value || isinf(value) || fabs(value) <= FLT_MAX)
+	{
+		float value32 = (float)value;
+
+		if (value32 == value || value != value)
+		{
+			uint16_t half;
+			if (cborfloattohalf(value32, half) == true)
+			{
+				needmemory(3);
+				p = (uint8_t*)pointer + usesize;
+				p[0] = (HCBOR_FLOATSIMPLE << 5) | 25; // float 16-bit
+				cborstore16(p + 1, half);
+				usesize += 3;
+				return;
+			}
+
+			needmemory(5);
+			p = (uint8_t*)pointer + usesize;
+			p[0] = (HCBOR_FLOATSIMPLE << 5) | 26; // float 32-bit
+			cborstorefloat(p + 1, value32);
+			usesize += 5;
+			return;
+		}
+	}
+
+	needmemory(9);
+	p = (uint8_t*)pointer + usesize;
+	p[0] = (HCBOR_FLOATSIMPLE << 5) | 27; // float 64-bit
+	cborstoredouble(p + 1, value);
+	usesize += 9;
+}
 
-	Write8U((majortype << 5) | additionaltype);
+void TRCBORWriter::WriteCBORString(const std::wstring& str)
+{
+	std::string utf8str;
+	utf8str = wstrTOutf8(str);
+	WriteCBORString(utf8str);
 }
 
-void TRCBORWriter::WriteCBORNull(void)
+// массивы кодируются блоками - одна проверка памяти на блок (и память потокового писателя остается ограниченной)
+static const size_t bulkblockcount = 1024;
+
+void TRCBORWriter::WriteCBORArray(const int32_t* values, size_t count)
 {
-	uint8_t majortype(HCBOR_FLOATSIMPLE);
-	uint8_t additionaltype(22); // Null
+	writeCBORHead(HCBOR_ITEMSARRAY, count);
+
+	for (size_t i = 0; i < count; i += bulkblockcount)
+	{
+		size_t n = count - i < bulkblockcount ? count - i : bulkblockcount;
+		needmemory(n * 5 + 4); // cborencodehead пишет 9 байт
 
-	Write8U((majortype << 5) | additionaltype);
+		uint8_t* p = (uint8_t*)pointer + usesize;
+		for (size_t j = 0; j < n; ++j)
+		{
+			int32_t value = values[i + j];
+			uint32_t sign = (uint32_t)(value >> 31); // 0 или 0xffffffff
+			p = cborencodehead(p, (uint8_t)(sign & HCBOR_NEGATIVEINTEGER), (uint32_t)value ^ sign); // для отрицательных -value - 1
+		}
+		usesize = p - (uint8_t*)pointer;
+	}
 }
 
-void TRCBORWriter::WriteCBORUndefined(void)
+void TRCBORWriter::WriteCBORArray(const int64_t* values, size_t count)
 {
-	uint8_t majortype(HCBOR_FLOATSIMPLE);
-	uint8_t additionaltype(23); // Undefined
+	writeCBORHead(HCBOR_ITEMSARRAY, count);
 
-	Write8U((majortype << 5) | additionaltype);
+	for (size_t i = 0; i < count; i += bulkblockcount)
+	{
+		size_t n = count - i < bulkblockcount ? count - i : bulkblockcount;
+		needmemory(n * 9);
+
+		uint8_t* p = (uint8_t*)pointer + usesize;
+		for (size_t j = 0; j < n; ++j)
+		{
+			int64_t value = values[i + j];
+			uint64_t sign = (uint64_t)(value >> 63);
+			p = cborencodehead(p, (uint8_t)(sign & HCBOR_NEGATIVEINTEGER), (uint64_t)value ^ sign);
+		}
+		usesize = p - (uint8_t*)pointer;
+	}
 }
 
-void TRCBORWriter::WriteCBORStopArrayMarker(void)
+void TRCBORWriter::WriteCBORArray(const float* values, size_t count)
 {
-	uint8_t majortype(HCBOR_FLOATSIMPLE);
-	uint8_t additionaltype(31); //  
+	writeCBORHead(HCBOR_ITEMSARRAY, count);
+
+	for (size_t i = 0; i < count; i += bulkblockcount)
+	{
+		size_t n = count - i < bulkblockcount ? count - i : bulkblockcount;
+		needmemory(n * 5);
 
-	Write8U((majortype << 5) | additionaltype);
+		uint8_t* p = (uint8_t*)pointer + usesize;
+		for (size_t j = 0; j < n; ++j)
+		{
+			p[j * 5] = (HCBOR_FLOATSIMPLE << 5) | 26; // float 32-bit
+			cborstorefloat(p + j * 5 + 1, values[i + j]);
+		}
+		usesize += n * 5;
+	}
 }
 
-void TRCBORWriter::Write8U(uint8_t value)
+void TRCBORWriter::WriteCBORArray(const double* values, size_t count)
 {
-	needmemory(1);
+	writeCBORHead(HCBOR_ITEMSARRAY, count);
 
-	*((uint8_t*)pointer + usesize) = value;
+	for (size_t i = 0; i < count; i += bulkblockcount)
+	{
+		size_t n = count - i < bulkblockcount ? count - i : bulkblockcount;
+		needmemory(n * 9);
 
-	++usesize;
+		uint8_t* p = (uint8_t*)pointer + usesize;
+		for (size_t j = 0; j < n; ++j)
+		{
+			p[j * 9] = (HCBOR_FLOATSIMPLE << 5) | 27; // float 64-bit
+			cborstoredouble(p + j * 9 + 1, values[i + j]);
+		}
+		usesize += n * 9;
+	}
 }
 
 void TRCBORWriter::Write16U(uint16_t value)
 {
 	needmemory(2);
 
-	*((uint16_t*)((uint8_t*)pointer + usesize)) = value;
+	cborstore16((uint8_t*)pointer + usesize, value);
 
 	usesize += 2;
 }
@@ -284,7 +399,7 @@ void TRCBORWriter::Write32U(uint32_t value)
 {
 	needmemory(4);
 
-	*((uint32_t*)((uint8_t*)pointer + usesize)) = value;
+	cborstore32((uint8_t*)pointer + usesize, value);
 
 	usesize += 4;
 }
@@ -293,7 +408,7 @@ void TRCBORWriter::Write64U(uint64_t value)
 {
 	needmemory(8);
 
-	*((uint64_t*)((uint8_t*)pointer + usesize)) = value;
+	cborstore64((uint8_t*)pointer + usesize, value);
 
 	usesize += 8;
 }
@@ -311,7 +426,7 @@ void TRCBORWriter::Write16I(int16_t value)
 {
 	needmemory(2);
 
-	*((int16_t*)((uint8_t*)pointer + usesize)) = value;
+	cborstore16((uint8_t*)pointer + usesize, (uint16_t)value);
 
 	usesize += 2;
 }
@@ -320,7 +435,7 @@ void TRCBORWriter::Write32I(int32_t value)
 {
 	needmemory(4);
 
-	*((int32_t*)((uint8_t*)pointer + usesize)) = value;
+	cborstore32((uint8_t*)pointer + usesize, (uint32_t)value);
 
 	usesize += 4;
 }
@@ -329,7 +444,7 @@ void TRCBORWriter::Write64I(int64_t value)
 {
 	needmemory(8);
 
-	*((int64_t*)((uint8_t*)pointer + usesize)) = value;
+	cborstore64((uint8_t*)pointer + usesize, (uint64_t)value);
 
 	usesize += 8;
 }
@@ -338,7 +453,7 @@ void TRCBORWriter::Write32F(float value)
 {
 	needmemory(4);
 
-	*((float*)((uint8_t*)pointer + usesize)) = value;
+	cborstorefloat((uint8_t*)pointer + usesize, value);
 
 	usesize += 4;
 }
@@ -347,7 +462,7 @@ void TRCBORWriter::Write64F(double value)
 {
 	needmemory(8);
 
-	*((double*)((uint8_t*)pointer + usesize)) = value;
+	cborstoredouble((uint8_t*)pointer + usesize, value);
 
 	usesize += 8;
 }
@@ -371,564 +486,3697 @@ void TRCBORWriter::WriteBuffer(void* buffer, size_t sizebuffer)
 }
 
 //////////////////////////////////////////////////////////////
-// CBOR Reader
+// разбор закодированных данных (без TRCBORReader)
 
-TRCBORReader::TRCBORReader()
-{
+static const size_t maxnestingdepth = HCBOR_MAX_NESTING_DEPTH;
 
-}
+// проверка корректности (well-formed) без рекурсии и выделения памяти
+// по первому байту элемента таблица дает вид элемента (старшие 4 бита) и длину аргумента (младшие 4 бита)
 
-TRCBORReader::~TRCBORReader()
+enum
+{
+	CBORV_ATOM = 0x00,     // число, float, simple value - только аргумент
+	CBORV_STRING = 0x10,   // строка определенной длины
+	CBORV_ISTRING = 0x20,  // строка неопределенной длины (из кусков)
+	CBORV_ARRAY = 0x30,
+	CBORV_MAP = 0x40,
+	CBORV_IARRAY = 0x50,
+	CBORV_IMAP = 0x60,
+	CBORV_TAG = 0x70,
+	CBORV_SIMPLE8 = 0x80,  // 0xf8 - simple value в следующем байте (должно быть >= 32)
+	CBORV_BREAK = 0x90,
+	CBORV_INVALID = 0xa0
+};
+
+#define CBORV_X4(k) k, k, k, k
+#define CBORV_X24(k) CBORV_X4(k), CBORV_X4(k), CBORV_X4(k), CBORV_X4(k), CBORV_X4(k), CBORV_X4(k)
+#define CBORV_MAJOR(k, kindefinite) CBORV_X24(k), k | 1, k | 2, k | 4, k | 8, CBORV_INVALID, CBORV_INVALID, CBORV_INVALID, kindefinite
+
+static const uint8_t cborvalidatetable[256] =
 {
+	CBORV_MAJOR(CBORV_ATOM, CBORV_INVALID),     // положительное число
+	CBORV_MAJOR(CBORV_ATOM, CBORV_INVALID),     // отрицательное число
+	CBORV_MAJOR(CBORV_STRING, CBORV_ISTRING),   // массив байт
+	CBORV_MAJOR(CBORV_STRING, CBORV_ISTRING),   // строка UTF8
+	CBORV_MAJOR(CBORV_ARRAY, CBORV_IARRAY),
+	CBORV_MAJOR(CBORV_MAP, CBORV_IMAP),
+	CBORV_MAJOR(CBORV_TAG, CBORV_INVALID),
+	CBORV_X24(CBORV_ATOM), CBORV_SIMPLE8 | 1, CBORV_ATOM | 2, CBORV_ATOM | 4, CBORV_ATOM | 8, CBORV_INVALID, CBORV_INVALID, CBORV_INVALID, CBORV_BREAK
+};
+
+#undef CBORV_MAJOR
+#undef CBORV_X24
+#undef CBORV_X4
+
+static const uint64_t cborvalidateindefinite = UINT64_MAX; // остаток элементов контейнера неопределенной длины
+
+// offset - на входе начало, на выходе конец пройденных данных (или начало ошибочного элемента)
+// singleitem - пройти ровно один элемент (вместе с вложенными), иначе - все элементы до конца буфера
+// tape - если задан, в него добавляются записи структурного индекса, в tapechilds - индексы элементов массивов
+static TRHCBORError cborvalidate(const uint8_t* begin, const uint8_t* end, size_t& offset, bool singleitem,
+	std::vector<TRCBORTapeEntry>* tape, std::vector<size_t>* tapechilds)
+{
+	// стек открытых контейнеров: сколько элементов осталось, первый байт контейнера, четность элементов map неопределенной длины
+	uint64_t remaining[maxnestingdepth];
+	uint8_t heads[maxnestingdepth];
+	uint8_t oddcount[maxnestingdepth];
+	size_t tapeindex[maxnestingdepth]; // запись контейнера (только при tape != nullptr)
+	size_t depth = 0;
+
+	const uint8_t* start = begin + offset;
+	const uint8_t* p = start;
+	while (true)
+	{
+		// закрытие заполненных контейнеров определенной длины (и тегов)
+		while (depth > 0 && remaining[depth - 1] == 0)
+		{
+			depth--;
+			if (tape != nullptr)
+				(*tape)[tapeindex[depth]].next = tape->size();
+		}
 
-}
+		if (depth == 0 && singleitem && p > start)
+		{
+			offset = p - begin;
+			return HCBORERR_OK;
+		}
 
-uint32_t TRCBORReader::readCBORSizeValue32(uint8_t additionaltype)
-{
-	uint32_t result;
+		if (p >= end)
+		{
+			offset = end - begin;
+			return depth == 0 && singleitem == false ? HCBORERR_OK : HCBORERR_TRUNCATED;
+		}
 
-	if (additionaltype < 24)
-		result = additionaltype;
-	else
-	{
-		result = 0;
-		switch (additionaltype)
-		{			// TODO  big endian  
-		case 24:
-			result = ReadUInt8();
+		const uint8_t* head = p;
+		uint8_t entry = cborvalidatetable[*p];
+		uint8_t kind = entry & 0xf0;
+		size_t length = entry & 0x0f;
+		offset = head - begin;
+
+		if (kind == CBORV_INVALID)
+			return HCBORERR_INVALIDHEAD;
+
+		p++;
+		if ((size_t)(end - p) < length)
+			return HCBORERR_TRUNCATED;
+
+		uint64_t value;
+		switch (length)
+		{
+		case 0:
+			value = *head & 31;
 			break;
-		case 25:
-			result = ReadUInt16();
+		case 1:
+			value = *p;
 			break;
-		case 26:
-			result = ReadUInt32();
+		case 2:
+			value = cborload16(p);
 			break;
-		case 31:
-			result = UINT32_MAX;
+		case 4:
+			value = cborload32(p);
+			break;
+		default:
+			value = cborload64(p);
 			break;
 		}
-	}
+		p += length;
 
-	return result;
-}
+		if (kind == CBORV_BREAK)
+		{
+			if (depth == 0 || remaining[depth - 1] != cborvalidateindefinite || oddcount[depth - 1] != 0)
+				return HCBORERR_UNEXPECTEDBREAK;
+			depth--;
+			if (tape != nullptr)
+				(*tape)[tapeindex[depth]].next = tape->size();
+			continue;
+		}
 
-uint64_t TRCBORReader::readCBORSizeValue64(uint8_t additionaltype)
-{
-	uint64_t result;
+		if (tape != nullptr)
+		{
+			TRCBORTapeEntry entry;
+			entry.offset = head - begin;
+			entry.next = tape->size() + 1;
+			entry.value = value;
+			entry.childs = SIZE_MAX;
+			entry.majortype = *head >> 5;
+			entry.additionaltype = *head & 31;
+			tape->push_back(entry);
+		}
 
-	if (additionaltype < 24)
-		result = additionaltype;
-	else
-	{
-		result = 0;
-		switch (additionaltype)
-		{			// TODO  big endian  
-		case 24:
-			result = ReadUInt8();
-			break;
-		case 25:
-			result = ReadUInt16();
-			break;
-		case 26:
-			result = ReadUInt32();
+		if (depth > 0)
+		{
+			uint8_t parent = heads[depth - 1];
+			// внутри строки из кусков - только строки того же основного типа определенной длины
+			if (parent == 0x5f || parent == 0x7f)
+			{
+				if (kind != CBORV_STRING || (*head >> 5) != (parent >> 5))
+					return HCBORERR_INVALIDCHUNK;
+			}
+
+			if (remaining[depth - 1] == cborvalidateindefinite)
+			{
+				if (parent == 0xbf)
+					oddcount[depth - 1] ^= 1;
+			}
+			else
+			{
+				if (tape != nullptr)
+				{
+					TRCBORTapeEntry& parententry = (*tape)[tapeindex[depth - 1]];
+					if (parententry.childs != SIZE_MAX)
+						(*tapechilds)[parententry.childs + (size_t)(parententry.value - remaining[depth - 1])] = tape->size() - 1;
+				}
+				remaining[depth - 1]--;
+			}
+		}
+
+		switch (kind)
+		{
+		case CBORV_SIMPLE8:
+			if (value < 32)
+				return HCBORERR_INVALIDHEAD;
+			continue;
+		case CBORV_STRING:
+			if (value > (uint64_t)(end - p))
+				return HCBORERR_TRUNCATED;
+			p += value;
+			continue;
+		case CBORV_MAP:
+			if (value > UINT64_MAX / 2)
+				return HCBORERR_TRUNCATED;
+			value *= 2;
 			break;
-		case 27:
-			result = ReadUInt64();
+		case CBORV_TAG:
+			value = 1; // за тегом следует ровно один элемент
 			break;
-		case 31:
-			result = UINT32_MAX;
+		case CBORV_ISTRING:
+		case CBORV_IARRAY:
+		case CBORV_IMAP:
+			value = cborvalidateindefinite;
 			break;
 		}
-	}
 
-	return result;
+		if (kind < CBORV_ISTRING || kind > CBORV_TAG || value == 0) // не контейнер или пустой контейнер
+			continue;
+		if (value != cborvalidateindefinite && value > (uint64_t)(end - p)) // каждый элемент - минимум 1 байт
+			return HCBORERR_TRUNCATED;
+		if (depth == maxnestingdepth)
+			return HCBORERR_TOODEEP;
+
+		remaining[depth] = value;
+		heads[depth] = *head;
+		oddcount[depth] = 0;
+		if (tape != nullptr)
+		{
+			tapeindex[depth] = tape->size() - 1;
+			if (kind == CBORV_ARRAY)
+			{
+				tape->back().childs = tapechilds->size();
+				tapechilds->resize(tapechilds->size() + (size_t)value);
+			}
+		}
+		depth++;
+	}
 }
 
-void TRCBORReader::SetBuffer(void* ptr, size_t sizebuffer)
-{
-	this->ptr = ptr;
-	this->sizebuffer = sizebuffer;
-	position = 0;
-}
+//////////////////////////////////////////////////////////////
+// CBOR Deterministic encoding (RFC 8949 4.2)
 
-bool TRCBORReader::ParseCBOR(TRHCBOROutType& valuetype, void* outvalue, size_t& valuesize)
+struct TRCBORWriter::deterministicstate
 {
-	uint8_t cbortype, majortype, additionaltype;
-
-	if (position >= sizebuffer)
-		return false;
-
-	cbortype = ReadUInt8();
+	struct pairinfo
+	{
+		size_t keyoffset; // от начала пар map в выходном буфере
+		size_t keysize;
+		size_t valuesize;
+	};
+
+	const uint8_t* data;
+	std::vector<TRCBORTapeEntry> tape;
+	std::vector<size_t> tapechilds;
+	std::vector<pairinfo> pairs;  // пары открытых map - стек, вложенные map добавляют свои после внешних
+	std::vector<uint8_t> scratch; // копия пар при перестановке - одна на все map
+};
+
+// запись элемента tape[index] (с вложенными) в детерминированном виде. данные уже проверены cborvalidate,
+// поэтому глубина рекурсии ограничена HCBOR_MAX_NESTING_DEPTH. возвращает индекс записи за элементом,
+// SIZE_MAX - повторяющийся ключ
+size_t TRCBORWriter::writedeterministic(deterministicstate& state, size_t index)
+{
+	const TRCBORTapeEntry& entry = state.tape[index];
+	const uint8_t* p = state.data + entry.offset;
+	uint8_t majortype, additionaltype;
+	uint64_t value;
+	size_t next = entry.next;
+	size_t i;
 
-	majortype = cbortype >> 5;
-	additionaltype = cbortype & 31;
+	cbordecodehead(p, p + 9, majortype, additionaltype, value); // p - за заголовком
 
 	switch (majortype)
 	{
 	case HCBOR_POSITIVEINTEGER:
-		if (additionaltype == 27)
-		{
-			*(uint64_t*)outvalue = readCBORSizeValue64(additionaltype);
-			valuesize = 8;
-			valuetype = HCBOROUT_INT64;
-		}
-		else
-		{
-			*(uint32_t*)outvalue = readCBORSizeValue32(additionaltype);
-			valuesize = 4;
-			valuetype = HCBOROUT_INT;
-		}
-		break;
 	case HCBOR_NEGATIVEINTEGER:
-		if (additionaltype == 27)
+		writeCBORHead(majortype, value);
+		break;
+	case HCBOR_BYTEARRAY:
+	case HCBOR_STRING_UTF8:
+		if (additionaltype != 31)
 		{
-			*(int64_t*)outvalue = -((int64_t)readCBORSizeValue64(additionaltype) + 1);
-			valuesize = 8;
-			valuetype = HCBOROUT_INT64;
+			writeCBORHead(majortype, value);
+			WriteBuffer((void*)p, (size_t)value);
+			break;
 		}
-		else
+
+		// строка из кусков склеивается в одну: куски - вложенные записи
+		value = 0;
+		for (i = index + 1; i < next; ++i)
+			value += state.tape[i].value;
+		writeCBORHead(majortype, value);
+		for (i = index + 1; i < next; ++i)
 		{
-			*(int32_t*)outvalue = -((int32_t)readCBORSizeValue32(additionaltype) + 1);
-			valuesize = 4;
-			valuetype = HCBOROUT_INT;
+			const uint8_t* chunk = state.data + state.tape[i].offset;
+			uint64_t chunksize;
+			cbordecodehead(chunk, chunk + 9, majortype, additionaltype, chunksize);
+			WriteBuffer((void*)chunk, (size_t)chunksize);
 		}
 		break;
-	case HCBOR_BYTEARRAY:
-		valuetype = HCBOROUT_BYTEARRAY;
-		valuesize = readCBORSizeValue32(additionaltype);
-		*(uintptr_t*)outvalue = (uintptr_t)GetCurrentPointer();
-		position = position + valuesize;
-		break;
-	case HCBOR_STRING_UTF8:
-		valuesize = readCBORSizeValue32(additionaltype);
-		valuetype = HCBOROUT_STRING_UTF8;
-		*(uintptr_t*)outvalue = (uintptr_t)GetCurrentPointer();
-		position = position + valuesize;
-		break;
 	case HCBOR_ITEMSARRAY:
-		valuesize = readCBORSizeValue32(additionaltype);
-		valuetype = HCBOROUT_ITEMSARRAY_MARKER;
+		if (additionaltype == 31) // количество - по соседним записям
+			for (value = 0, i = index + 1; i < next; i = state.tape[i].next)
+				value++;
+
+		writeCBORHead(majortype, value);
+		for (i = index + 1; i < next; )
+			if ((i = writedeterministic(state, i)) == SIZE_MAX)
+				return SIZE_MAX;
 		break;
 	case HCBOR_PAIRSARRAY:
-		valuesize = readCBORSizeValue32(additionaltype);
-		valuetype = HCBOROUT_PAIRSARRAY_MARKER;
+		{
+			if (additionaltype == 31)
+			{
+				for (value = 0, i = index + 1; i < next; i = state.tape[i].next)
+					value++;
+				value /= 2; // четность проверена cborvalidate
+			}
+			writeCBORHead(majortype, value);
+
+			// пары кодируются сразу в выходной буфер, затем переставляются по порядку ключей
+			size_t pairsfirst = state.pairs.size();
+			size_t start = usesize;
+			for (i = index + 1; i < next; )
+			{
+				deterministicstate::pairinfo info;
+				info.keyoffset = usesize - start;
+				if ((i = writedeterministic(state, i)) == SIZE_MAX)
+					return SIZE_MAX;
+				info.keysize = usesize - start - info.keyoffset;
+				if ((i = writedeterministic(state, i)) == SIZE_MAX)
+					return SIZE_MAX;
+				info.valuesize = usesize - start - info.keyoffset - info.keysize;
+				state.pairs.push_back(info);
+			}
+
+			const uint8_t* base = (const uint8_t*)pointer + start;
+			auto keyless = [base](const deterministicstate::pairinfo& a, const deterministicstate::pairinfo& b) -> bool
+			{
+				int res = memcmp(base + a.keyoffset, base + b.keyoffset, a.keysize < b.keysize ? a.keysize : b.keysize);
+				return res < 0 || (res == 0 && a.keysize < b.keysize);
+			};
+			std::sort(state.pairs.begin() + pairsfirst, state.pairs.end(), keyless);
+			for (i = pairsfirst + 1; i < state.pairs.size(); ++i)
+				if (keyless(state.pairs[i - 1], state.pairs[i]) == false) // повторяющийся ключ
+					return SIZE_MAX;
+
+			state.scratch.assign(base, (const uint8_t*)pointer + usesize);
+			uint8_t* out = (uint8_t*)pointer + start;
+			for (i = pairsfirst; i < state.pairs.size(); ++i)
+			{
+				size_t size = state.pairs[i].keysize + state.pairs[i].valuesize;
+				memcpy(out, state.scratch.data() + state.pairs[i].keyoffset, size);
+				out += size;
+			}
+			state.pairs.resize(pairsfirst);
+		}
 		break;
 	case HCBOR_TAGVALUE:
-		break;
+		writeCBORHead(majortype, value);
+		return writedeterministic(state, index + 1);
 	case HCBOR_FLOATSIMPLE:
 		switch (additionaltype)
 		{
-		case 20:
-			valuesize = 0;
-			valuetype = HCBOROUT_FALSE;
-			break;
-		case 21:
-			valuesize = 0;
-			valuetype = HCBOROUT_TRUE;
-			break;
-		case 22:
-			valuesize = 0;
-			valuetype = HCBOROUT_NULL;
+		case 24: // простое значение в следующем байте (>= 32 - проверено)
+			WriteBuffer((void*)(state.data + entry.offset), 2);
 			break;
-		case 23:
-			valuesize = 0;
-			valuetype = HCBOROUT_UNDEFINED;
+		case 25:
+			writeCBORShortestFloat(cborhalftofloat((uint16_t)value));
 			break;
 		case 26:
-			*(float*)outvalue = ReadFloat32();
-			valuesize = 4;
-			valuetype = HCBOROUT_FLOAT32;
+			{
+				uint32_t value32 = (uint32_t)value;
+				float valuefloat;
+				memcpy(&valuefloat, &value32, 4);
+				writeCBORShortestFloat(valuefloat);
+			}
 			break;
 		case 27:
-			*(double*)outvalue = ReadFloat64();
-			valuesize = 8;
-			valuetype = HCBOROUT_FLOAT64;
+			{
+				double valuedouble;
+				memcpy(&valuedouble, &value, 8);
+				writeCBORShortestFloat(valuedouble);
+			}
 			break;
-		case 31:
-			valuesize = 0;
-			valuetype = HCBOROUT_ENDARRAY_MARKER;
+		default:
+			Write8U(state.data[entry.offset]);
 			break;
 		}
 		break;
 	}
 
-	return true;
+	return next;
 }
 
-uint32_t TRCBORReader::ReadUInt8(void)
-{
-	uint8_t* ptrpos;
-	ptrpos = (uint8_t*)ptr + position;
-	position++;
-	return *ptrpos;
-}
+//////////////////////////////////////////////////////////////
+// массивы с длиной, неизвестной заранее
 
-uint32_t TRCBORReader::ReadUInt16(void)
+size_t TRCBORWriter::BeginCBORItemsArray(void)
 {
-	uint16_t* ptrpos;
-	ptrpos = (uint16_t*)((uint8_t*)ptr + position);
-	position += 2;
-	return *ptrpos;
+	if (IsContiguous() == false) // заголовок может оказаться в сброшенном или закрытом блоке
+		return SIZE_MAX;
+
+	size_t position = usesize;
+
+	// резерв - заголовок с 8-байтовым количеством (0), по нему EndCBORArray проверяет позицию
+	needmemory(9);
+	*((uint8_t*)pointer + usesize) = (HCBOR_ITEMSARRAY << 5) | 27;
+	memset((uint8_t*)pointer + usesize + 1, 0, 8);
+	usesize += 9;
+
+	return position;
 }
 
-uint32_t TRCBORReader::ReadUInt32(void)
+size_t TRCBORWriter::BeginCBORPairsArray(void)
 {
-	uint32_t* ptrpos;
-	ptrpos = (uint32_t*)((uint8_t*)ptr + position);
-	position += 4;
-	return *ptrpos;
+	if (IsContiguous() == false)
+		return SIZE_MAX;
+
+	size_t position = usesize;
+
+	// резерв - заголовок с 8-байтовым количеством (0), по нему EndCBORArray проверяет позицию
+	needmemory(9);
+	*((uint8_t*)pointer + usesize) = (HCBOR_PAIRSARRAY << 5) | 27;
+	memset((uint8_t*)pointer + usesize + 1, 0, 8);
+	usesize += 9;
+
+	return position;
 }
 
-uint64_t TRCBORReader::ReadUInt64(void)
+bool TRCBORWriter::EndCBORArray(size_t position, uint64_t count)
 {
-//   (   )
-/*	uint64_t* ptrpos;
-	ptrpos = (uint64_t*)((uint8_t*)ptr + position);
-	position += 8;
-	return *ptrpos;*/
-//  ,   ARM    -   
+	if (IsContiguous() == false || position > usesize || usesize - position < 9)
+		return false;
+
+	uint8_t* head = (uint8_t*)pointer + position;
+	if (head[0] != ((HCBOR_ITEMSARRAY << 5) | 27) && head[0] != ((HCBOR_PAIRSARRAY << 5) | 27)) // не зарезервированный заголовок
+		return false;
+	uint8_t majortype = head[0] >> 5;
+	size_t headsize = cborheadsize(count);
+
+	if (headsize < 9)
+	{
+		memmove(head + headsize, head + 9, usesize - position - 9);
+		usesize -= 9 - headsize;
+	}
 
-	uint64_t p1 = ReadUInt32();
-	p1 = p1 << 32;
-	p1 = p1 | (uint64_t)ReadUInt32();
-	return p1;
+	// cborencodehead пишет 9 байт - заголовок собирается отдельно
+	uint8_t encoded[9];
+	cborencodehead(encoded, majortype, count);
+	memcpy(head, encoded, headsize);
+
+	return true;
 }
 
-float TRCBORReader::ReadFloat32(void)
+TRCBORArrayScope::TRCBORArrayScope(TRCBORWriter& writer, bool pairs) : writer(writer), count(0)
 {
-	float* ptrpos;
-	ptrpos = (float*)((uint8_t*)ptr + position);
-	position += 4;
-	return *ptrpos;
+	position = pairs ? writer.BeginCBORPairsArray() : writer.BeginCBORItemsArray();
 }
 
-double TRCBORReader::ReadFloat64(void)
+TRCBORArrayScope::~TRCBORArrayScope()
 {
-	double* ptrpos;
-	ptrpos = (double*)((uint8_t*)ptr + position);
-	position += 8;
-	return *ptrpos;
+	End();
 }
 
-void* TRCBORReader::GetCurrentPointer(void)
+bool TRCBORArrayScope::End(void)
 {
-	return (uint8_t*)ptr + position;
+	if (position == SIZE_MAX)
+		return false;
+
+	bool result = writer.EndCBORArray(position, count);
+	position = SIZE_MAX;
+
+	return result;
 }
 
-void* TRCBORReader::GetBuffer(size_t& sizebuffer)
+bool TRCBORWriter::WriteCBORDeterministic(const void* buffer, size_t sizebuffer)
 {
-	sizebuffer = this->sizebuffer;
-	return this->ptr;
+	// пары map переставляются прямо в выходном буфере - у наследников запись через непрерывный буфер
+	if (IsContiguous() == false)
+	{
+		TRCBORWriter result(allocator);
+		if (result.WriteCBORDeterministic(buffer, sizebuffer) == false)
+			return false;
+		WriteBuffer(result.pointer, result.usesize);
+		return true;
+	}
+
+	deterministicstate state;
+	state.data = (const uint8_t*)buffer;
+
+	size_t offset = 0;
+	if (cborvalidate(state.data, state.data + sizebuffer, offset, false, &state.tape, &state.tapechilds) != HCBORERR_OK)
+		return false;
+
+	size_t startsize = usesize;
+	for (size_t i = 0; i < state.tape.size(); )
+	{
+		if ((i = writedeterministic(state, i)) == SIZE_MAX)
+		{
+			usesize = startsize;
+			return false;
+		}
+	}
+
+	return true;
 }
 
+bool TRCBORWriter::MakeDeterministic(void)
+{
+	if (IsContiguous() == false) // записанное уже сброшено или разбито на блоки
+		return false;
+
+	TRCBORWriter result(allocator);
+	if (result.WriteCBORDeterministic(pointer, usesize) == false)
+		return false;
+
+	// буфер результата забирается себе, прежний освобождается вместе с result
+	std::swap(pointer, result.pointer);
+	std::swap(fullsize, result.fullsize);
+	usesize = result.usesize;
+
+	return true;
+}
 
 //////////////////////////////////////////////////////////////
-// CBOR Object Model
+// CBOR Segmented Writer
+
+#ifndef _WIN32
+static_assert(sizeof(TRCBORSegment) == sizeof(struct iovec) &&
+	offsetof(TRCBORSegment, data) == offsetof(struct iovec, iov_base) &&
+	offsetof(TRCBORSegment, size) == offsetof(struct iovec, iov_len), "TRCBORSegment must match struct iovec");
+#endif
+
+TRCBORSegmentedWriter::TRCBORSegmentedWriter(size_t chunksize, size_t copythreshold) :
+	chunksize(chunksize),
+	copythreshold(copythreshold),
+	segmentstart(0),
+	closedsize(0)
+{
+	retainsize = chunksize;
+	Reserve(chunksize);
+}
 
-TRCBORObject::TRCBORObject() : bytearray(nullptr), bytearraysize(0)
+TRCBORSegmentedWriter::~TRCBORSegmentedWriter()
 {
-	memset(buffervalue, 0, sizeof(buffervalue));
+	freechunks();
 }
 
-TRCBORObject::~TRCBORObject()
+void TRCBORSegmentedWriter::freechunks(void)
 {
-	for (auto& it : Childs)
-		delete it;
-	Childs.clear();
+	for (auto& it : chunks)
+		allocator.freefunc(allocator.userdata, it);
+	chunks.clear();
 }
 
-size_t TRCBORObject::GetChildsCount(void)
+// закрытие сегмента текущего блока (данные с segmentstart до usesize)
+void TRCBORSegmentedWriter::closesegment(void)
 {
-	return Childs.size();
+	if (usesize > segmentstart)
+	{
+		segmentinfo info = { nullptr, chunks.size(), segmentstart, usesize - segmentstart };
+		segmentsinfo.push_back(info);
+		closedsize += info.size;
+		segmentstart = usesize;
+	}
 }
 
-TRCBORObject* TRCBORObject::GetChild(size_t index)
+// вместо перевыделения памяти - новый блок. старые данные не копируются
+void TRCBORSegmentedWriter::growmemory(size_t newsize)
 {
-	if (index >= Childs.size())
-		return nullptr;
+	size_t needsize = newsize - usesize;
 
-	return Childs[index];
+	closesegment();
+	chunks.push_back(pointer);
+
+	fullsize = needsize > chunksize ? needsize : chunksize;
+	pointer = allocator.reallocfunc(allocator.userdata, nullptr, fullsize);
+	usesize = 0;
+	segmentstart = 0;
 }
 
-bool TRCBORObject::GetByteArray(void **ptr, size_t &size)
+void TRCBORSegmentedWriter::WriteBufferRef(const void* buffer, size_t sizebuffer)
 {
-	if (ObjectType != HOBJTYPE_BYTEARRAY)
-		return false;
+	if (sizebuffer < copythreshold)
+	{
+		WriteBuffer((void*)buffer, sizebuffer);
+		return;
+	}
 
-	*ptr = bytearray;
-	size = bytearraysize;
-	return true;
+	closesegment();
+
+	segmentinfo info = { buffer, 0, 0, sizebuffer };
+	segmentsinfo.push_back(info);
+	closedsize += sizebuffer;
 }
 
-std::string& TRCBORObject::AsString(void)
+void TRCBORSegmentedWriter::WriteCBORByteArrayRef(const void* buffer, size_t sizebuffer)
 {
-	return this->Utf8Value;
+	writeCBORHead(HCBOR_BYTEARRAY, sizebuffer);
+	WriteBufferRef(buffer, sizebuffer);
 }
 
-int32_t TRCBORObject::AsInt32(void)
+void TRCBORSegmentedWriter::Clear(void)
 {
-	switch (this->ObjectType)
-	{
-	case HOBJTYPE_INT:
-		return *(int32_t*)buffervalue;
-		break;
-	case HOBJTYPE_INT64:
-		return (int32_t)(*(int64_t*)buffervalue);
-		break;
-	case HOBJTYPE_FLOAT32:
-		return (int32_t)(*(float*)buffervalue);
-		break;
-	case HOBJTYPE_FLOAT64:
-		return (int32_t)(*(double*)buffervalue);
-		break;
-	case HOBJTYPE_BOOL:
-		return (int32_t)(*(uint64_t*)buffervalue);
-		break;
-	}
+	freechunks();
+	segmentsinfo.clear();
+	segments.clear();
+	segmentstart = 0;
+	closedsize = 0;
 
-	return 0;
+	TRCBORWriter::Clear();
 }
 
-int64_t TRCBORObject::AsInt64(void)
+size_t TRCBORSegmentedWriter::Size(void) const
 {
-	switch (this->ObjectType)
+	return closedsize + usesize - segmentstart;
+}
+
+bool TRCBORSegmentedWriter::IsContiguous(void) const
+{
+	return false;
+}
+
+const TRCBORSegment* TRCBORSegmentedWriter::GetSegments(size_t& count)
+{
+	closesegment();
+
+	segments.resize(segmentsinfo.size());
+	for (size_t i = 0; i < segmentsinfo.size(); ++i)
 	{
-	case HOBJTYPE_INT:
-		return (int64_t)(*(int32_t*)buffervalue);
-		break;
-	case HOBJTYPE_INT64:
-		return *(int64_t*)buffervalue;
-		break;
-	case HOBJTYPE_FLOAT32:
-		return (int64_t)(*(float*)buffervalue);
-		break;
-	case HOBJTYPE_FLOAT64:
-		return (int64_t)(*(double*)buffervalue);
-		break;
-	case HOBJTYPE_BOOL:
-		return *(uint64_t*)buffervalue;
-		break;
+		const segmentinfo& info = segmentsinfo[i];
+		if (info.external != nullptr)
+			segments[i].data = (void*)info.external;
+		else
+			segments[i].data = (uint8_t*)(info.chunkindex == chunks.size() ? pointer : chunks[info.chunkindex]) + info.offset;
+		segments[i].size = info.size;
 	}
 
-	return 0;
+	count = segments.size();
+	return count == 0 ? nullptr : segments.data();
 }
 
-float TRCBORObject::AsFloat(void)
+void TRCBORSegmentedWriter::CopyTo(void* buffer) const
 {
-	switch (this->ObjectType)
+	uint8_t* dst = (uint8_t*)buffer;
+
+	for (auto& info : segmentsinfo)
 	{
-	case HOBJTYPE_INT:
-		return (float)(*(int32_t*)buffervalue);
-		break;
-	case HOBJTYPE_INT64:
-		return (float)(*(int64_t*)buffervalue);
-		break;
-	case HOBJTYPE_FLOAT32:
-		return *(float*)buffervalue;
-		break;
-	case HOBJTYPE_FLOAT64:
-		return (float)(*(double*)buffervalue);
-		break;
-	case HOBJTYPE_BOOL:
-		return (float)(*(uint64_t*)buffervalue);
-		break;
+		const void* src;
+		if (info.external != nullptr)
+			src = info.external;
+		else
+			src = (uint8_t*)(info.chunkindex == chunks.size() ? pointer : chunks[info.chunkindex]) + info.offset;
+		memcpy(dst, src, info.size);
+		dst += info.size;
 	}
 
-	return 0;
+	memcpy(dst, (uint8_t*)pointer + segmentstart, usesize - segmentstart);
 }
 
-double TRCBORObject::AsDouble(void)
+//////////////////////////////////////////////////////////////
+// CBOR Stream Writer
+
+TRCBORStreamWriter::TRCBORStreamWriter(int fd, size_t highwatermark) :
+	fd(fd),
+	sinkfunc(nullptr),
+	userdata(nullptr),
+	highwatermark(highwatermark),
+	flushedsize(0),
+	error(false)
 {
-	switch (this->ObjectType)
+	retainsize = highwatermark;
+	Reserve(highwatermark);
+}
+
+TRCBORStreamWriter::TRCBORStreamWriter(TRCBORSinkFunc sinkfunc, void* userdata, size_t highwatermark) :
+	fd(-1),
+	sinkfunc(sinkfunc),
+	userdata(userdata),
+	highwatermark(highwatermark),
+	flushedsize(0),
+	error(false)
+{
+	retainsize = highwatermark;
+	Reserve(highwatermark);
+}
+
+TRCBORStreamWriter::~TRCBORStreamWriter()
+{
+	Flush();
+}
+
+bool TRCBORStreamWriter::writesink(const void* data, size_t size)
+{
+	if (sinkfunc != nullptr)
+		return sinkfunc(userdata, data, size);
+
+	const uint8_t* ptr = (const uint8_t*)data;
+	while (size > 0)
 	{
-	case HOBJTYPE_INT:
-		return (double)(*(int32_t*)buffervalue);
-		break;
-	case HOBJTYPE_INT64:
-		return (double)(*(int64_t*)buffervalue);
-		break;
-	case HOBJTYPE_FLOAT32:
-		return (double)(*(float*)buffervalue);
-		break;
-	case HOBJTYPE_FLOAT64:
-		return *(double*)buffervalue;
-		break;
-	case HOBJTYPE_BOOL:
-		return (double)(*(uint64_t*)buffervalue);
-		break;
+#ifdef _WIN32
+		int res = _write(fd, ptr, size > INT32_MAX ? INT32_MAX : (unsigned int)size);
+		if (res <= 0)
+			return false;
+#else
+		ssize_t res = write(fd, ptr, size);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return false;
+#endif
+		ptr += res;
+		size -= res;
 	}
 
-	return 0;
+	return true;
 }
 
-bool TRCBORObject::AsBool(void)
+// вместо роста буфера - сброс в приемник
+void TRCBORStreamWriter::growmemory(size_t newsize)
 {
-	switch (this->ObjectType)
+	size_t needsize = newsize - usesize;
+
+	Flush();
+
+	if (needsize > fullsize)
+		TRCBORWriter::growmemory(needsize);
+}
+
+bool TRCBORStreamWriter::Flush(void)
+{
+	if (usesize > 0)
 	{
-	case HOBJTYPE_INT:
-		return *(int32_t*)buffervalue != 0;
-		break;
-	case HOBJTYPE_INT64:
-		return *(int64_t*)buffervalue != 0;
-		break;
-	case HOBJTYPE_FLOAT32:
-		return *(float*)buffervalue != 0;
-		break;
-	case HOBJTYPE_FLOAT64:
-		return *(double*)buffervalue != 0;
-		break;
-	case HOBJTYPE_BOOL:
-		return *(uint64_t*)buffervalue != 0;
-		break;
+		if (error == false && writesink(pointer, usesize) == false)
+			error = true;
+
+		flushedsize += usesize;
+		usesize = 0;
 	}
 
-	return false;
+	// буфер мог вырасти под большую строку или байтовый массив - возвращаем к highwatermark
+	TRCBORWriter::Clear();
+
+	return error == false;
 }
 
-TRHCBORObjectType TRCBORObject::GetType(void)
+bool TRCBORStreamWriter::IsError(void) const
 {
-	return ObjectType;
+	return error;
 }
 
-TRCBORObjectModel::TRCBORObjectModel()
+void TRCBORStreamWriter::Clear(void)
 {
+	flushedsize = 0;
+	error = false;
 
+	TRCBORWriter::Clear();
 }
 
-TRCBORObjectModel::~TRCBORObjectModel()
+size_t TRCBORStreamWriter::Size(void) const
 {
-	for (auto& it : Childs)
-		delete it;
-	Childs.clear();
+	return flushedsize + usesize;
 }
 
-void TRCBORObjectModel::SetBuffer(void* ptr, size_t sizebuffer)
+bool TRCBORStreamWriter::IsContiguous(void) const
 {
-	reader.SetBuffer(ptr, sizebuffer);
+	return false;
 }
 
-size_t TRCBORObjectModel::GetChildsCount(void)
+//////////////////////////////////////////////////////////////
+// CBOR Reader
+
+TRCBORReader::TRCBORReader()
 {
-	return Childs.size();
+	ptr = nullptr;
+	sizebuffer = 0;
+	position = 0;
+	error = HCBORERR_OK;
+	erroroffset = 0;
+	tagdepth = 0;
 }
 
-TRCBORObject* TRCBORObjectModel::GetChild(size_t index)
+TRCBORReader::~TRCBORReader()
 {
-	if (index >= Childs.size())
-		return nullptr;
 
-	return Childs[index];
 }
 
-void TRCBORObjectModel::Parse(void)
+bool TRCBORReader::seterror(TRHCBORError error, size_t offset)
 {
-	Childs.clear();
-	Parse(Childs, 0);
+	this->error = error;
+	erroroffset = offset;
+	position = offset; // позиция остается на начале ошибочного элемента
+	return false;
 }
 
-void TRCBORObjectModel::Parse(std::vector<TRCBORObject*> &Childs, int32_t waitcount)
+// чтение заголовка с проверкой границ (position < sizebuffer). для неопределенной длины (additionaltype == 31) value = 0
+inline TRHCBORError TRCBORReader::readCBORHead(uint8_t& majortype, uint8_t& additionaltype, uint64_t& value)
 {
-	TRHCBOROutType valuetype;
-	uint8_t outvalue[8];
-	size_t valuesize;
+	const uint8_t* p = (const uint8_t*)ptr + position;
+	const uint8_t* end = (const uint8_t*)ptr + sizebuffer;
 
-	int elementindex = 0;
-	TRCBORObject* CurrentElement;
+	if (cbordecodehead(p, end, majortype, additionaltype, value) == false)
+		return additionaltype < 28 ? HCBORERR_TRUNCATED : HCBORERR_INVALIDHEAD;
+
+	position = p - (const uint8_t*)ptr;
+	return HCBORERR_OK;
+}
+
+void TRCBORReader::SetBuffer(void* ptr, size_t sizebuffer)
+{
+	this->ptr = ptr;
+	this->sizebuffer = sizebuffer;
+	position = 0;
+	error = HCBORERR_OK;
+	erroroffset = 0;
+}
+
+bool TRCBORReader::ParseCBOR(TRHCBOROutType& valuetype, void* outvalue, size_t& valuesize)
+{
+	uint8_t majortype, additionaltype;
+	uint64_t value64;
+	size_t headposition = position;
+	TRHCBORError headerror;
+
+	error = HCBORERR_OK;
 
-	while (reader.ParseCBOR(valuetype, outvalue, valuesize) == true)
+	if (position >= sizebuffer)
+		return false; // конец данных
+
+	headerror = readCBORHead(majortype, additionaltype, value64);
+	if (headerror != HCBORERR_OK)
+		return seterror(headerror, headposition);
+
+	switch (majortype)
 	{
-		switch (valuetype)
+	case HCBOR_POSITIVEINTEGER:
+		if (value64 > INT32_MAX) // не помещается в int32_t
 		{
-		case HCBOROUT_INT:
-			CurrentElement = new TRCBORObject;
-			Childs.push_back(CurrentElement);
-			CurrentElement->ObjectType = HOBJTYPE_INT;
-			*(int32_t*)CurrentElement->buffervalue = *(int32_t*)outvalue;
+			*(uint64_t*)outvalue = value64;
+			valuesize = 8;
+			valuetype = HCBOROUT_INT64;
+		}
+		else
+		{
+			*(uint32_t*)outvalue = (uint32_t)value64;
+			valuesize = 4;
+			valuetype = HCBOROUT_INT;
+		}
+		break;
+	case HCBOR_NEGATIVEINTEGER:
+		if (value64 > (uint64_t)INT64_MAX) // -2^64..-2^63-1 не помещается в int64_t
+			return seterror(HCBORERR_UNSUPPORTED, headposition);
+		if (value64 > INT32_MAX)
+		{
+			*(int64_t*)outvalue = -1 - (int64_t)value64;
+			valuesize = 8;
+			valuetype = HCBOROUT_INT64;
+		}
+		else
+		{
+			*(int32_t*)outvalue = -1 - (int32_t)value64;
+			valuesize = 4;
+			valuetype = HCBOROUT_INT;
+		}
+		break;
+	case HCBOR_BYTEARRAY:
+	case HCBOR_STRING_UTF8:
+		if (additionaltype == 31) // строка из кусков одним указателем не отдается
+			return seterror(HCBORERR_UNSUPPORTED, headposition);
+		if (value64 > sizebuffer - position)
+			return seterror(HCBORERR_TRUNCATED, headposition);
+		valuetype = majortype == HCBOR_BYTEARRAY ? HCBOROUT_BYTEARRAY : HCBOROUT_STRING_UTF8;
+		valuesize = (size_t)value64;
+		*(uintptr_t*)outvalue = (uintptr_t)GetCurrentPointer();
+		position += valuesize;
+		break;
+	case HCBOR_ITEMSARRAY:
+	case HCBOR_PAIRSARRAY:
+		if (additionaltype == 31)
+			valuesize = HCBOROUT_INDEFINITE_SIZE;
+		else
+		{
+			// каждый элемент - минимум 1 байт, каждая пара - минимум 2
+			if (value64 > (sizebuffer - position) / (majortype == HCBOR_PAIRSARRAY ? 2 : 1))
+				return seterror(HCBORERR_TRUNCATED, headposition);
+			valuesize = (size_t)value64;
+		}
+		valuetype = majortype == HCBOR_ITEMSARRAY ? HCBOROUT_ITEMSARRAY_MARKER : HCBOROUT_PAIRSARRAY_MARKER;
+		break;
+	case HCBOR_TAGVALUE:
+		if (position >= sizebuffer) // тег без элемента
+			return seterror(HCBORERR_TRUNCATED, headposition);
+		{
+			const TRCBORTagHandlerEntry* entry = findtaghandler(value64);
+			if (entry == nullptr)
+			{
+				*(uint64_t*)outvalue = value64;
+				valuesize = 8;
+				valuetype = HCBOROUT_TAG_MARKER;
+				break;
+			}
+
+			// обработчик читает помеченный элемент сам. вложенность ограничена (тег в теге в ...)
+			if (tagdepth >= maxnestingdepth)
+				return seterror(HCBORERR_TOODEEP, headposition);
+			tagdepth++;
+			bool result = entry->handler(*this, value64, valuetype, outvalue, valuesize, entry->userdata);
+			tagdepth--;
+			if (result == false)
+			{
+				if (error == HCBORERR_OK)
+					return seterror(HCBORERR_INVALIDTAG, headposition);
+				position = headposition; // ошибка внутри помеченного элемента - смещение остается
+				return false;
+			}
+		}
+		break;
+	case HCBOR_FLOATSIMPLE:
+		switch (additionaltype)
+		{
+		case 20:
+			valuesize = 0;
+			valuetype = HCBOROUT_FALSE;
 			break;
-		case HCBOROUT_INT64:
-			CurrentElement = new TRCBORObject;
-			Childs.push_back(CurrentElement);
-			CurrentElement->ObjectType = HOBJTYPE_INT64;
-			*(int64_t*)CurrentElement->buffervalue = *(int64_t*)outvalue;
+		case 21:
+			valuesize = 0;
+			valuetype = HCBOROUT_TRUE;
 			break;
-		case HCBOROUT_FLOAT32:
-			CurrentElement = new TRCBORObject;
-			Childs.push_back(CurrentElement);
-			CurrentElement->ObjectType = HOBJTYPE_FLOAT32;
-			*(float*)CurrentElement->buffervalue = *(float*)outvalue;
+		case 22:
+			valuesize = 0;
+			valuetype = HCBOROUT_NULL;
 			break;
-		case HCBOROUT_FLOAT64:
-			CurrentElement = new TRCBORObject;
-			Childs.push_back(CurrentElement);
-			CurrentElement->ObjectType = HOBJTYPE_FLOAT64;
-			*(double*)CurrentElement->buffervalue = *(double*)outvalue;
+		case 23:
+			valuesize = 0;
+			valuetype = HCBOROUT_UNDEFINED;
 			break;
-		case HCBOROUT_TRUE:
-			CurrentElement = new TRCBORObject;
-			Childs.push_back(CurrentElement);
-			CurrentElement->ObjectType = HOBJTYPE_BOOL;
-			*(uint64_t*)CurrentElement->buffervalue = 1;
+		case 24:
+			if (value64 < 32)
+				return seterror(HCBORERR_INVALIDHEAD, headposition);
+			return seterror(HCBORERR_UNSUPPORTED, headposition);
+		case 25:
+			*(float*)outvalue = cborhalftofloat((uint16_t)value64);
+			valuesize = 4;
+			valuetype = HCBOROUT_FLOAT32;
 			break;
-		case HCBOROUT_FALSE:
-			CurrentElement = new TRCBORObject;
-			Childs.push_back(CurrentElement);
-			CurrentElement->ObjectType = HOBJTYPE_BOOL;
-			*(uint64_t*)CurrentElement->buffervalue = 0;
+		case 26:
+			{
+				uint32_t bits = (uint32_t)value64;
+				memcpy(outvalue, &bits, 4);
+			}
+			valuesize = 4;
+			valuetype = HCBOROUT_FLOAT32;
 			break;
-		case HCBOROUT_NULL:
-			CurrentElement = new TRCBORObject;
-			Childs.push_back(CurrentElement);
-			CurrentElement->ObjectType = HOBJTYPE_NULL;
-			*(uint64_t*)CurrentElement->buffervalue = 0;
+		case 27:
+			memcpy(outvalue, &value64, 8);
+			valuesize = 8;
+			valuetype = HCBOROUT_FLOAT64;
 			break;
-		case HCBOROUT_UNDEFINED:
-			CurrentElement = new TRCBORObject;
-			Childs.push_back(CurrentElement);
-			CurrentElement->ObjectType = HOBJTYPE_UNDEFINED;
-			*(uint64_t*)CurrentElement->buffervalue = 0;
+		case 31:
+			valuesize = 0;
+			valuetype = HCBOROUT_ENDARRAY_MARKER;
 			break;
-		case HCBOROUT_BYTEARRAY:
-			CurrentElement = new TRCBORObject;
-			Childs.push_back(CurrentElement);
-			CurrentElement->ObjectType = HOBJTYPE_BYTEARRAY;
-			CurrentElement->bytearraysize = valuesize;
-			CurrentElement->bytearray = (void*)(*(uintptr_t*)outvalue);
+		default: // simple value 0..19
+			return seterror(HCBORERR_UNSUPPORTED, headposition);
+		}
+		break;
+	}
+
+	return true;
+}
+
+// теги < directtagscount - прямой индекс в taghandlers
+static const size_t directtagscount = 64;
+
+const TRCBORReader::TRCBORTagHandlerEntry* TRCBORReader::findtaghandler(uint64_t tag) const
+{
+	if (tag < directtagscount)
+	{
+		if (tag < taghandlers.size() && taghandlers[(size_t)tag].handler != nullptr)
+			return &taghandlers[(size_t)tag];
+		return nullptr;
+	}
+
+	for (size_t i = directtagscount; i < taghandlers.size(); ++i)
+	{
+		if (taghandlers[i].tag == tag)
+			return &taghandlers[i];
+	}
+	return nullptr;
+}
+
+void TRCBORReader::RegisterTagHandler(uint64_t tag, TRCBORTagHandler handler, void* userdata)
+{
+	TRCBORTagHandlerEntry entry;
+	entry.tag = tag;
+	entry.handler = handler;
+	entry.userdata = userdata;
+
+	if (taghandlers.size() < directtagscount)
+	{
+		TRCBORTagHandlerEntry empty = { 0, nullptr, nullptr };
+		taghandlers.resize(directtagscount, empty);
+	}
+
+	if (tag < directtagscount)
+	{
+		taghandlers[(size_t)tag] = entry;
+		return;
+	}
+
+	for (size_t i = directtagscount; i < taghandlers.size(); ++i)
+	{
+		if (taghandlers[i].tag == tag)
+		{
+			if (handler == nullptr)
+				taghandlers.erase(taghandlers.begin() + i);
+			else
+				taghandlers[i] = entry;
+			return;
+		}
+	}
+
+	if (handler != nullptr)
+		taghandlers.push_back(entry);
+}
+
+// количество дней от 1970-01-01 (пролептический григорианский календарь)
+static int64_t cbordaysfromcivil(int64_t year, unsigned int month, unsigned int day)
+{
+	year -= month <= 2;
+	int64_t era = (year >= 0 ? year : year - 399) / 400;
+	unsigned int yearofera = (unsigned int)(year - era * 400);
+	unsigned int dayofyear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	unsigned int dayofera = yearofera * 365 + yearofera / 4 - yearofera / 100 + dayofyear;
+	return era * 146097 + (int64_t)dayofera - 719468;
+}
+
+static bool cborparsedigits(const char*& p, const char* end, size_t count, unsigned int& value)
+{
+	value = 0;
+	if ((size_t)(end - p) < count)
+		return false;
+	for (size_t i = 0; i < count; ++i, ++p)
+	{
+		if (*p < '0' || *p > '9')
+			return false;
+		value = value * 10 + (*p - '0');
+	}
+	return true;
+}
+
+// RFC 3339: 2013-03-21T20:04:00Z, 2013-03-21T20:04:00.5+01:00
+static bool cborparsedatetime(const char* p, size_t size, double& seconds)
+{
+	const char* end = p + size;
+	unsigned int year, month, day, hour, minute, second;
+
+	if (cborparsedigits(p, end, 4, year) == false || p == end || *p++ != '-' ||
+		cborparsedigits(p, end, 2, month) == false || p == end || *p++ != '-' ||
+		cborparsedigits(p, end, 2, day) == false || p == end || (*p != 'T' && *p != 't' && *p != ' ') ||
+		cborparsedigits(++p, end, 2, hour) == false || p == end || *p++ != ':' ||
+		cborparsedigits(p, end, 2, minute) == false || p == end || *p++ != ':' ||
+		cborparsedigits(p, end, 2, second) == false)
+		return false;
+	static const uint8_t monthdays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	if (month < 1 || month > 12 || hour > 23 || minute > 59 || second > 60)
+		return false;
+	bool leapyear = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+	if (day < 1 || day > monthdays[month - 1] + (month == 2 && leapyear ? 1u : 0u))
+		return false;
+
+	double fraction = 0;
+	if (p < end && *p == '.')
+	{
+		double scale = 0.1;
+		if (++p == end || *p < '0' || *p > '9')
+			return false;
+		for (; p < end && *p >= '0' && *p <= '9'; ++p, scale /= 10)
+			fraction += (*p - '0') * scale;
+	}
+
+	int offsetminutes = 0;
+	if (p == end)
+		return false;
+	if (*p == 'Z' || *p == 'z')
+		p++;
+	else
+	if (*p == '+' || *p == '-')
+	{
+		int sign = *p++ == '-' ? -1 : 1;
+		unsigned int offsethour, offsetminute;
+		if (cborparsedigits(p, end, 2, offsethour) == false || p == end || *p++ != ':' ||
+			cborparsedigits(p, end, 2, offsetminute) == false || offsethour > 23 || offsetminute > 59)
+			return false;
+		offsetminutes = sign * (int)(offsethour * 60 + offsetminute);
+	}
+	else
+		return false;
+	if (p != end)
+		return false;
+
+	int64_t total = cbordaysfromcivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second - offsetminutes * 60;
+	seconds = (double)total + fraction;
+	return true;
+}
+
+// тег 0 - строка RFC 3339, тег 1 - число секунд от 1970-01-01
+static bool cbortagdatetime(TRCBORReader& reader, uint64_t tag, TRHCBOROutType& valuetype, void* outvalue, size_t& valuesize, void* /*userdata*/)
+{
+	TRHCBOROutType itemtype;
+	uint8_t item[8];
+	size_t itemsize;
+	double seconds;
+
+	// знак HCBOROUT_INT64 - по основному типу помеченного элемента
+	size_t sizebuffer;
+	bool negative = (((const uint8_t*)reader.GetBuffer(sizebuffer))[reader.GetPosition()] >> 5) == HCBOR_NEGATIVEINTEGER;
+
+	if (reader.ParseCBOR(itemtype, item, itemsize) == false)
+		return false;
+
+	if (tag == 0)
+	{
+		if (itemtype != HCBOROUT_STRING_UTF8 || cborparsedatetime((const char*)(*(uintptr_t*)item), itemsize, seconds) == false)
+			return false;
+	}
+	else
+	{
+		switch (itemtype)
+		{
+		case HCBOROUT_INT:
+			seconds = *(int32_t*)item;
 			break;
-		case HCBOROUT_STRING_UTF8:
-			CurrentElement = new TRCBORObject;
-			Childs.push_back(CurrentElement);
-			CurrentElement->ObjectType = HOBJTYPE_STRING_UTF8;
-			CurrentElement->Utf8Value = std::string((char*)(*(uintptr_t*)outvalue), valuesize);
+		case HCBOROUT_INT64:
+			seconds = negative ? (double)*(int64_t*)item : (double)*(uint64_t*)item;
 			break;
-		case HCBOROUT_ITEMSARRAY_MARKER:
-			CurrentElement = new TRCBORObject;
-			Childs.push_back(CurrentElement);
-			CurrentElement->ObjectType = HOBJTYPE_ITEMSARRAY;
-			if (valuesize == UINT32_MAX)
-				Parse(CurrentElement->Childs, -1);
-			else
-				Parse(CurrentElement->Childs, valuesize);
+		case HCBOROUT_FLOAT32:
+			seconds = *(float*)item;
 			break;
-		case HCBOROUT_PAIRSARRAY_MARKER:
-			CurrentElement = new TRCBORObject;
-			Childs.push_back(CurrentElement);
-			CurrentElement->ObjectType = HOBJTYPE_PAIRSARRAY;
-			if (valuesize == UINT32_MAX)
-				Parse(CurrentElement->Childs, -1);
-			else
-				Parse(CurrentElement->Childs, valuesize * 2);
+		case HCBOROUT_FLOAT64:
+			seconds = *(double*)item;
 			break;
-		case HCBOROUT_ENDARRAY_MARKER:
-			return;
+		default:
+			return false;
+		}
+	}
+
+	*(double*)outvalue = seconds;
+	valuesize = 8;
+	valuetype = HCBOROUT_DATETIME;
+	return true;
+}
+
+// теги 2, 3 - модуль в массиве байт
+static bool cbortagbignum(TRCBORReader& reader, uint64_t tag, TRHCBOROutType& valuetype, void* outvalue, size_t& valuesize, void* /*userdata*/)
+{
+	if (reader.ParseCBOR(valuetype, outvalue, valuesize) == false || valuetype != HCBOROUT_BYTEARRAY)
+		return false;
+
+	valuetype = tag == 2 ? HCBOROUT_BIGNUM : HCBOROUT_NEGATIVEBIGNUM;
+	return true;
+}
+
+// тег 24 - вложенный CBOR в массиве байт. разбирается потом отдельным читателем (лениво)
+static bool cbortagembedded(TRCBORReader& reader, uint64_t /*tag*/, TRHCBOROutType& valuetype, void* outvalue, size_t& valuesize, void* /*userdata*/)
+{
+	if (reader.ParseCBOR(valuetype, outvalue, valuesize) == false || valuetype != HCBOROUT_BYTEARRAY)
+		return false;
+
+	valuetype = HCBOROUT_EMBEDDED_CBOR;
+	return true;
+}
+
+void TRCBORReader::RegisterStandardTagHandlers(void)
+{
+	RegisterTagHandler(0, cbortagdatetime);
+	RegisterTagHandler(1, cbortagdatetime);
+	RegisterTagHandler(2, cbortagbignum);
+	RegisterTagHandler(3, cbortagbignum);
+	RegisterTagHandler(24, cbortagembedded);
+}
+
+size_t TRCBORReader::GetPosition(void) const
+{
+	return position;
+}
+
+void TRCBORReader::SetPosition(size_t position)
+{
+	this->position = position < sizebuffer ? position : sizebuffer;
+}
+
+TRHCBORError TRCBORReader::GetError(void) const
+{
+	return error;
+}
+
+size_t TRCBORReader::GetErrorOffset(void) const
+{
+	return erroroffset;
+}
+
+bool TRCBORReader::Validate(void)
+{
+	erroroffset = 0;
+	error = cborvalidate((const uint8_t*)ptr, (const uint8_t*)ptr + sizebuffer, erroroffset, false, nullptr, nullptr);
+	return error == HCBORERR_OK;
+}
+
+bool TRCBORReader::SkipValue(void)
+{
+	error = HCBORERR_OK;
+	if (position >= sizebuffer)
+		return false; // конец данных
+
+	// скаляр или строка определенной длины - одним заголовком, без обхода cborvalidate (и его стека контейнеров)
+	const uint8_t* begin = (const uint8_t*)ptr;
+	const uint8_t* p = begin + position;
+	uint8_t majortype, additionaltype;
+	uint64_t value;
+	if (cbordecodehead(p, begin + sizebuffer, majortype, additionaltype, value) == true && additionaltype != 31)
+	{
+		switch (majortype)
+		{
+		case HCBOR_POSITIVEINTEGER:
+		case HCBOR_NEGATIVEINTEGER:
+			position = (size_t)(p - begin);
+			return true;
+		case HCBOR_BYTEARRAY:
+		case HCBOR_STRING_UTF8:
+			if (value <= (uint64_t)(begin + sizebuffer - p))
+			{
+				position = (size_t)(p - begin) + (size_t)value;
+				return true;
+			}
+			break;
+		case HCBOR_FLOATSIMPLE:
+			if (additionaltype != 24 || value >= 32)
+			{
+				position = (size_t)(p - begin);
+				return true;
+			}
 			break;
 		}
+	}
+	// контейнеры, теги, строки из кусков и ошибки (смещение ошибки определяет обход)
+
+	size_t offset = position;
+	error = cborvalidate((const uint8_t*)ptr, (const uint8_t*)ptr + sizebuffer, offset, true, nullptr, nullptr);
+	if (error != HCBORERR_OK)
+	{
+		erroroffset = offset; // позиция остается на начале пропускаемого элемента
+		return false;
+	}
+
+	position = offset;
+	return true;
+}
+
+// поиск одного сегмента пути в элементе по смещению offset
+// found == true - offset на найденном элементе, иначе offset - смещение ошибки
+static TRHCBORError cborfindsegment(const uint8_t* begin, const uint8_t* end, size_t& offset,
+	const uint8_t* key, size_t keysize, const uint8_t* intkey, size_t intkeysize, uint64_t index, bool& found)
+{
+	const uint8_t* p = begin + offset;
+	const uint8_t* head;
+	uint8_t majortype, additionaltype;
+	uint64_t count;
+	TRHCBORError error;
+
+	found = false;
 
-		elementindex++;
-		if (waitcount > 0)
+	// теги пропускаются
+	do
+	{
+		head = p;
+		if (p >= end)
 		{
-			if (elementindex == waitcount)
-				return;
+			offset = head - begin;
+			return HCBORERR_TRUNCATED;
+		}
+		if (cbordecodehead(p, end, majortype, additionaltype, count) == false)
+		{
+			offset = head - begin;
+			return additionaltype < 28 ? HCBORERR_TRUNCATED : HCBORERR_INVALIDHEAD;
 		}
 	}
+	while (majortype == HCBOR_TAGVALUE);
+
+	bool indefinite = additionaltype == 31;
+	offset = p - begin;
+
+	if (majortype == HCBOR_ITEMSARRAY)
+	{
+		if (intkeysize == 0 || (indefinite == false && index >= count))
+			return HCBORERR_OK;
+
+		for (uint64_t i = 0; i < index; ++i)
+		{
+			if (indefinite && begin + offset < end && begin[offset] == 0xff)
+				return HCBORERR_OK;
+			error = cborvalidate(begin, end, offset, true, nullptr, nullptr);
+			if (error != HCBORERR_OK)
+				return error;
+		}
+	}
+	else
+	if (majortype == HCBOR_PAIRSARRAY)
+	{
+		bool matched = false;
+		for (uint64_t i = 0; (indefinite || i < count) && matched == false; ++i)
+		{
+			const uint8_t* item = begin + offset;
+			if (item >= end)
+				return HCBORERR_TRUNCATED;
+			if (indefinite && *item == 0xff)
+				return HCBORERR_OK;
+
+			size_t remainingsize = end - item;
+			if (remainingsize >= keysize && memcmp(item, key, keysize) == 0)
+			{
+				offset += keysize;
+				matched = true;
+			}
+			else
+			if (intkeysize != 0 && remainingsize >= intkeysize && memcmp(item, intkey, intkeysize) == 0)
+			{
+				offset += intkeysize;
+				matched = true;
+			}
+			else
+			{
+				// пропуск ключа и значения
+				error = cborvalidate(begin, end, offset, true, nullptr, nullptr);
+				if (error == HCBORERR_OK)
+					error = cborvalidate(begin, end, offset, true, nullptr, nullptr);
+				if (error != HCBORERR_OK)
+					return error;
+			}
+		}
+		if (matched == false)
+			return HCBORERR_OK;
+	}
+	else
+		return HCBORERR_OK; // не контейнер
+
+	if (begin + offset >= end)
+		return HCBORERR_TRUNCATED;
+	if (indefinite && begin[offset] == 0xff)
+		return HCBORERR_OK;
 
+	found = true;
+	return HCBORERR_OK;
+}
+
+bool TRCBORReader::Find(const TRCBORPath& path)
+{
+	error = HCBORERR_OK;
+	if (path.valid == false || position >= sizebuffer)
+		return false;
+
+	const uint8_t* begin = (const uint8_t*)ptr;
+	const uint8_t* keys = path.keys.data();
+	size_t offset = position;
+	bool found = true;
+
+	for (size_t i = 0; i < path.segments.size() && found == true; ++i)
+	{
+		const TRCBORPath::TRCBORPathSegment& segment = path.segments[i];
+		TRHCBORError finderror = cborfindsegment(begin, begin + sizebuffer, offset,
+			keys + segment.keyoffset, segment.keysize, keys + segment.intkeyoffset, segment.intkeysize, segment.index, found);
+		if (finderror != HCBORERR_OK)
+		{
+			error = finderror;
+			erroroffset = offset;
+			return false;
+		}
+	}
+
+	if (found == false)
+		return false;
+
+	position = offset;
+	return true;
+}
+
+bool TRCBORReader::Find(const char* path)
+{
+	TRCBORPath compiledpath(path);
+	return Find(compiledpath);
+}
+
+uint32_t TRCBORReader::ReadUInt8(void)
+{
+	uint8_t* ptrpos;
+	ptrpos = (uint8_t*)ptr + position;
+	position++;
+	return *ptrpos;
+}
+
+// многобайтовые значения - big endian. memcpy работает и на невыровненных данных (ARM)
+uint32_t TRCBORReader::ReadUInt16(void)
+{
+	uint32_t value = cborload16((uint8_t*)ptr + position);
+	position += 2;
+	return value;
+}
+
+uint32_t TRCBORReader::ReadUInt32(void)
+{
+	uint32_t value = cborload32((uint8_t*)ptr + position);
+	position += 4;
+	return value;
+}
+
+uint64_t TRCBORReader::ReadUInt64(void)
+{
+	uint64_t value = cborload64((uint8_t*)ptr + position);
+	position += 8;
+	return value;
+}
+
+void* TRCBORReader::GetCurrentPointer(void)
+{
+	return (uint8_t*)ptr + position;
+}
+
+void* TRCBORReader::GetBuffer(size_t& sizebuffer)
+{
+	sizebuffer = this->sizebuffer;
+	return this->ptr;
+}
+
+
+//////////////////////////////////////////////////////////////
+// CBOR Push Parser
+
+static const uint64_t pushindefinite = UINT64_MAX;
+
+TRCBORPushParser::TRCBORPushParser()
+{
+	Reset();
+}
+
+TRCBORPushParser::~TRCBORPushParser()
+{
+
+}
+
+void TRCBORPushParser::Reset(void)
+{
+	chunk = nullptr;
+	chunksize = 0;
+	chunkposition = 0;
+	consumed = 0;
+	headsize = 0;
+	headposition = 0;
+	stringremaining = 0;
+	stringtype = HCBOROUT_BYTEARRAY;
+	stack.clear();
+	itempending = false;
+	tagpending = false;
+	error = HCBORERR_OK;
+	erroroffset = 0;
+}
+
+bool TRCBORPushParser::Feed(const void* data, size_t size)
+{
+	if (chunkposition < chunksize)
+		return false;
+
+	consumed += chunksize;
+	chunk = (const uint8_t*)data;
+	chunksize = size;
+	chunkposition = 0;
+	return true;
+}
+
+TRHCBORPushStatus TRCBORPushParser::seterror(TRHCBORError error)
+{
+	this->error = error;
+	erroroffset = headposition;
+	return HCBORPUSH_ERROR;
+}
+
+// закрытие заполненных контейнеров определенной длины
+void TRCBORPushParser::closecontainers(void)
+{
+	while (stack.empty() == false && stack.back().remaining == 0)
+		stack.pop_back();
+}
+
+TRHCBORPushStatus TRCBORPushParser::Next(TRHCBOROutType& valuetype, void* outvalue, size_t& valuesize)
+{
+	if (error != HCBORERR_OK)
+		return HCBORPUSH_ERROR;
+
+	while (true)
+	{
+		// продолжение строки
+		if (stringremaining > 0)
+		{
+			size_t available = chunksize - chunkposition;
+			if (available == 0)
+				return HCBORPUSH_NEEDMOREDATA;
+
+			valuesize = stringremaining < available ? (size_t)stringremaining : available;
+			valuetype = stringtype;
+			*(uintptr_t*)outvalue = (uintptr_t)(chunk + chunkposition);
+			chunkposition += valuesize;
+			stringremaining -= valuesize;
+			if (stringremaining > 0)
+				return HCBORPUSH_PARTIAL;
+
+			itempending = false;
+			closecontainers();
+			return HCBORPUSH_VALUE;
+		}
+
+		// заголовок, возможно из нескольких кусков
+		if (headsize == 0)
+		{
+			if (chunkposition == chunksize)
+				return HCBORPUSH_NEEDMOREDATA;
+			if (itempending == false)
+				headposition = consumed + chunkposition;
+			head[headsize++] = chunk[chunkposition++];
+			itempending = true;
+		}
+
+		uint8_t additionaltype = head[0] & 31;
+		size_t needsize = 1;
+		if (additionaltype >= 24 && additionaltype < 28)
+			needsize += (size_t)1 << (additionaltype - 24);
+
+		size_t copysize = needsize - headsize;
+		if (copysize > chunksize - chunkposition)
+			copysize = chunksize - chunkposition;
+		memcpy(head + headsize, chunk + chunkposition, copysize);
+		headsize += copysize;
+		chunkposition += copysize;
+		if (headsize < needsize)
+			return HCBORPUSH_NEEDMOREDATA;
+
+		const uint8_t* p = head;
+		uint8_t majortype;
+		uint64_t value64;
+		headsize = 0;
+		if (cbordecodehead(p, head + needsize, majortype, additionaltype, value64) == false)
+			return seterror(HCBORERR_INVALIDHEAD);
+
+		if (majortype == HCBOR_TAGVALUE) // помеченный элемент следует за тегом (itempending остается)
+		{
+			tagpending = true;
+			*(uint64_t*)outvalue = value64;
+			valuesize = 8;
+			valuetype = HCBOROUT_TAG_MARKER;
+			return HCBORPUSH_VALUE;
+		}
+
+		if (majortype == HCBOR_FLOATSIMPLE && additionaltype == 31)
+		{
+			// break только на месте очередного элемента: не после тега и не между ключом и значением
+			if (stack.empty() == true || stack.back().remaining != pushindefinite || stack.back().keypending == true || tagpending == true)
+				return seterror(HCBORERR_UNEXPECTEDBREAK);
+			stack.pop_back();
+			valuesize = 0;
+			valuetype = HCBOROUT_ENDARRAY_MARKER;
+			itempending = false;
+			closecontainers();
+			return HCBORPUSH_VALUE;
+		}
+
+		tagpending = false;
+		if (stack.empty() == false)
+		{
+			if (stack.back().remaining != pushindefinite)
+				stack.back().remaining--;
+			else if (stack.back().pairs == true)
+				stack.back().keypending = !stack.back().keypending;
+		}
+
+		switch (majortype)
+		{
+		case HCBOR_POSITIVEINTEGER:
+			if (value64 > INT32_MAX)
+			{
+				*(uint64_t*)outvalue = value64;
+				valuesize = 8;
+				valuetype = HCBOROUT_INT64;
+			}
+			else
+			{
+				*(uint32_t*)outvalue = (uint32_t)value64;
+				valuesize = 4;
+				valuetype = HCBOROUT_INT;
+			}
+			break;
+		case HCBOR_NEGATIVEINTEGER:
+			if (value64 > (uint64_t)INT64_MAX) // -2^64..-2^63-1 не помещается в int64_t
+				return seterror(HCBORERR_UNSUPPORTED);
+			if (value64 > INT32_MAX)
+			{
+				*(int64_t*)outvalue = -1 - (int64_t)value64;
+				valuesize = 8;
+				valuetype = HCBOROUT_INT64;
+			}
+			else
+			{
+				*(int32_t*)outvalue = -1 - (int32_t)value64;
+				valuesize = 4;
+				valuetype = HCBOROUT_INT;
+			}
+			break;
+		case HCBOR_BYTEARRAY:
+		case HCBOR_STRING_UTF8:
+			if (additionaltype == 31)
+				return seterror(HCBORERR_UNSUPPORTED);
+			stringtype = majortype == HCBOR_BYTEARRAY ? HCBOROUT_BYTEARRAY : HCBOROUT_STRING_UTF8;
+			if (value64 > 0)
+			{
+				stringremaining = value64;
+				continue;
+			}
+			valuetype = stringtype;
+			valuesize = 0;
+			*(uintptr_t*)outvalue = (uintptr_t)(chunk + chunkposition);
+			break;
+		case HCBOR_ITEMSARRAY:
+		case HCBOR_PAIRSARRAY:
+			if (additionaltype == 31)
+				valuesize = HCBOROUT_INDEFINITE_SIZE;
+			else
+				valuesize = (size_t)value64;
+			valuetype = majortype == HCBOR_ITEMSARRAY ? HCBOROUT_ITEMSARRAY_MARKER : HCBOROUT_PAIRSARRAY_MARKER;
+
+			if (additionaltype != 31 && value64 >= pushindefinite / 2) // количество не помещается в счетчик стека
+				return seterror(HCBORERR_UNSUPPORTED);
+			if (additionaltype == 31 || value64 > 0)
+			{
+				if (stack.size() == maxnestingdepth)
+					return seterror(HCBORERR_TOODEEP);
+				level container;
+				container.remaining = additionaltype == 31 ? pushindefinite : (majortype == HCBOR_PAIRSARRAY ? value64 * 2 : value64);
+				container.pairs = majortype == HCBOR_PAIRSARRAY;
+				container.keypending = false;
+				stack.push_back(container);
+			}
+			break;
+		case HCBOR_FLOATSIMPLE:
+			switch (additionaltype)
+			{
+			case 20:
+				valuesize = 0;
+				valuetype = HCBOROUT_FALSE;
+				break;
+			case 21:
+				valuesize = 0;
+				valuetype = HCBOROUT_TRUE;
+				break;
+			case 22:
+				valuesize = 0;
+				valuetype = HCBOROUT_NULL;
+				break;
+			case 23:
+				valuesize = 0;
+				valuetype = HCBOROUT_UNDEFINED;
+				break;
+			case 24:
+				return seterror(value64 < 32 ? HCBORERR_INVALIDHEAD : HCBORERR_UNSUPPORTED);
+			case 25:
+				*(float*)outvalue = cborhalftofloat((uint16_t)value64);
+				valuesize = 4;
+				valuetype = HCBOROUT_FLOAT32;
+				break;
+			case 26:
+				{
+					uint32_t bits = (uint32_t)value64;
+					memcpy(outvalue, &bits, 4);
+				}
+				valuesize = 4;
+				valuetype = HCBOROUT_FLOAT32;
+				break;
+			case 27:
+				memcpy(outvalue, &value64, 8);
+				valuesize = 8;
+				valuetype = HCBOROUT_FLOAT64;
+				break;
+			default: // simple value 0..19
+				return seterror(HCBORERR_UNSUPPORTED);
+			}
+			break;
+		}
+
+		itempending = false;
+		closecontainers();
+		return HCBORPUSH_VALUE;
+	}
+}
+
+size_t TRCBORPushParser::GetDepth(void) const
+{
+	return stack.size();
+}
+
+bool TRCBORPushParser::IsComplete(void) const
+{
+	return stack.empty() == true && itempending == false;
+}
+
+uint64_t TRCBORPushParser::GetPartialRemaining(void) const
+{
+	return stringremaining;
+}
+
+TRHCBORError TRCBORPushParser::GetError(void) const
+{
+	return error;
+}
+
+size_t TRCBORPushParser::GetErrorOffset(void) const
+{
+	return erroroffset;
+}
+
+//////////////////////////////////////////////////////////////
+// CBOR Sequence Reader
+
+TRCBORSequenceReader::TRCBORSequenceReader() :
+	data(nullptr),
+	size(0),
+	position(0),
+	mapped(false),
+#ifdef _WIN32
+	filehandle(INVALID_HANDLE_VALUE),
+	mappinghandle(nullptr),
+#endif
+	error(HCBORERR_OK),
+	erroroffset(0)
+{
+}
+
+TRCBORSequenceReader::~TRCBORSequenceReader()
+{
+	Close();
+}
+
+bool TRCBORSequenceReader::Open(const char* filename)
+{
+	Close();
+
+#ifdef _WIN32
+	// FILE_FLAG_SEQUENTIAL_SCAN - аналог madvise(MADV_SEQUENTIAL) для кэша файла
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER filesize;
+	if (GetFileSizeEx(file, &filesize) == FALSE || (uint64_t)filesize.QuadPart > SIZE_MAX)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	filehandle = file;
+	if (filesize.QuadPart == 0) // пустой файл не отображается
+		return true;
+
+	mappinghandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mappinghandle == nullptr)
+	{
+		Close();
+		return false;
+	}
+
+	data = (const uint8_t*)MapViewOfFile(mappinghandle, FILE_MAP_READ, 0, 0, 0);
+	if (data == nullptr)
+	{
+		Close();
+		return false;
+	}
+	size = (size_t)filesize.QuadPart;
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (uint64_t)st.st_size > SIZE_MAX)
+	{
+		close(fd);
+		return false;
+	}
+
+	if (st.st_size == 0) // пустой файл не отображается
+	{
+		close(fd);
+		return true;
+	}
+
+	void* map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // отображение остается действительным
+	if (map == MAP_FAILED)
+		return false;
+
+	madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL); // агрессивное упреждающее чтение, прочитанные страницы освобождаются первыми
+	data = (const uint8_t*)map;
+	size = (size_t)st.st_size;
+#endif
+
+	mapped = true;
+	return true;
+}
+
+void TRCBORSequenceReader::SetBuffer(const void* data, size_t size)
+{
+	Close();
+
+	this->data = (const uint8_t*)data;
+	this->size = size;
+}
+
+void TRCBORSequenceReader::Close(void)
+{
+#ifdef _WIN32
+	if (mapped == true && data != nullptr)
+		UnmapViewOfFile(data);
+	if (mappinghandle != nullptr)
+		CloseHandle(mappinghandle);
+	if (filehandle != INVALID_HANDLE_VALUE)
+		CloseHandle(filehandle);
+	mappinghandle = nullptr;
+	filehandle = INVALID_HANDLE_VALUE;
+#else
+	if (mapped == true && data != nullptr)
+		munmap((void*)data, size);
+#endif
+
+	data = nullptr;
+	size = 0;
+	position = 0;
+	mapped = false;
+	error = HCBORERR_OK;
+	erroroffset = 0;
+}
+
+bool TRCBORSequenceReader::Next(TRCBORBytesView& item)
+{
+	if (error != HCBORERR_OK || position >= size)
+		return false; // конец данных или ошибка ранее
+
+	size_t offset = position;
+	error = cborvalidate(data, data + size, offset, true, nullptr, nullptr);
+	if (error != HCBORERR_OK)
+	{
+		erroroffset = offset;
+		return false;
+	}
+
+	item.data = data + position;
+	item.size = offset - position;
+	position = offset;
+	return true;
+}
+
+const uint8_t* TRCBORSequenceReader::GetData(void) const
+{
+	return data;
+}
+
+size_t TRCBORSequenceReader::GetSize(void) const
+{
+	return size;
+}
+
+size_t TRCBORSequenceReader::GetPosition(void) const
+{
+	return position;
+}
+
+void TRCBORSequenceReader::SetPosition(size_t position)
+{
+	this->position = position < size ? position : size;
+	error = HCBORERR_OK;
+	erroroffset = 0;
+}
+
+TRHCBORError TRCBORSequenceReader::GetError(void) const
+{
+	return error;
+}
+
+size_t TRCBORSequenceReader::GetErrorOffset(void) const
+{
+	return erroroffset;
+}
+
+bool TRCBORSequenceReader::Split(size_t chunksize, std::vector<size_t>& boundaries)
+{
+	size_t offset = position;
+	size_t chunkend = offset + chunksize;
+
+	boundaries.clear();
+	boundaries.push_back(offset);
+
+	error = HCBORERR_OK;
+	while (offset < size)
+	{
+		size_t itemend = offset;
+		error = cborvalidate(data, data + size, itemend, true, nullptr, nullptr);
+		if (error != HCBORERR_OK)
+		{
+			erroroffset = itemend;
+			break;
+		}
+
+		offset = itemend;
+		if (offset >= chunkend)
+		{
+			boundaries.push_back(offset);
+			chunkend = offset + chunksize;
+		}
+	}
+
+	if (boundaries.back() != offset)
+		boundaries.push_back(offset);
+
+	return error == HCBORERR_OK;
+}
+
+//////////////////////////////////////////////////////////////
+// CBOR Parallel Processor
+
+TRCBORParallelProcessor::TRCBORParallelProcessor(size_t threadscount) :
+	threadscount(threadscount),
+	data(nullptr),
+	error(HCBORERR_OK),
+	erroroffset(0)
+{
+	if (this->threadscount == 0)
+		this->threadscount = std::max(1u, std::thread::hardware_concurrency());
+}
+
+TRCBORParallelProcessor::~TRCBORParallelProcessor()
+{
+}
+
+bool TRCBORParallelProcessor::Prepare(TRCBORSequenceReader& sequence, size_t chunksize)
+{
+	// последовательный обход структуры всех элементов - его время не делится между потоками
+	data = sequence.GetData();
+	bool result = sequence.Split(chunksize, boundaries);
+	error = sequence.GetError();
+	erroroffset = sequence.GetErrorOffset();
+
+	return result;
+}
+
+size_t TRCBORParallelProcessor::GetChunksCount(void) const
+{
+	return boundaries.empty() ? 0 : boundaries.size() - 1;
+}
+
+bool TRCBORParallelProcessor::Process(TRCBORItemFunc func, void* userdata, TRCBORChunkFunc reduce)
+{
+	size_t chunkscount = GetChunksCount();
+	std::atomic<size_t> nextchunk(0);
+	std::atomic<bool> stopped(false);
+
+	std::vector<uint8_t> finished(reduce != nullptr ? chunkscount : 0); // все элементы куска обработаны
+	size_t nextreduce = 0;
+	std::mutex reducelock;
+
+	// потоки берут следующий свободный кусок, пока они не кончатся
+	auto worker = [&]()
+	{
+		TRCBORSequenceReader chunk;
+		TRCBORBytesView item;
+		size_t chunkindex;
+
+		while (stopped == false && (chunkindex = nextchunk++) < chunkscount)
+		{
+			chunk.SetBuffer(data + boundaries[chunkindex], boundaries[chunkindex + 1] - boundaries[chunkindex]);
+			while (chunk.Next(item) == true)
+			{
+				if (func(userdata, chunkindex, item) == false)
+				{
+					stopped = true;
+					break;
+				}
+			}
+			if (stopped == true || reduce == nullptr)
+				continue;
+
+			// поток, завершивший кусок, объединяет все готовые подряд от nextreduce
+			std::lock_guard<std::mutex> lock(reducelock);
+			finished[chunkindex] = 1;
+			while (stopped == false && nextreduce < chunkscount && finished[nextreduce] != 0)
+			{
+				if (reduce(userdata, nextreduce++) == false)
+					stopped = true;
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	size_t workerscount = std::min(threadscount, chunkscount);
+	for (size_t i = 1; i < workerscount; ++i)
+		threads.push_back(std::thread(worker));
+	worker(); // текущий поток тоже работает
+	for (auto& it : threads)
+		it.join();
+
+	if (stopped == true)
+	{
+		error = HCBORERR_STOPPED;
+		erroroffset = 0;
+		return false;
+	}
+
+	return true;
+}
+
+TRHCBORError TRCBORParallelProcessor::GetError(void) const
+{
+	return error;
+}
+
+size_t TRCBORParallelProcessor::GetErrorOffset(void) const
+{
+	return erroroffset;
+}
+
+//////////////////////////////////////////////////////////////
+// CBOR Path
+
+TRCBORPath::TRCBORPath()
+{
+	valid = false;
+}
+
+TRCBORPath::TRCBORPath(const char* path)
+{
+	Compile(path);
+}
+
+bool TRCBORPath::Compile(const char* path)
+{
+	keys.clear();
+	segments.clear();
+	valid = false;
+
+	if (path == nullptr || (*path != 0 && *path != '/'))
+		return false;
+
+	std::string key;
+	while (*path == '/')
+	{
+		path++;
+		key.clear();
+		while (*path != 0 && *path != '/')
+		{
+			if (*path == '~')
+			{
+				if (path[1] == '0')
+					key += '~';
+				else
+				if (path[1] == '1')
+					key += '/';
+				else
+					return false;
+				path += 2;
+			}
+			else
+				key += *path++;
+		}
+
+		TRCBORPathSegment segment;
+
+		// строковый ключ - заголовок + байты строки
+		segment.keyoffset = keys.size();
+		keys.resize(segment.keyoffset + 9 + key.size()); // cborencodehead пишет 9 байт
+		uint8_t* keyend = cborencodehead(&keys[segment.keyoffset], HCBOR_STRING_UTF8, key.size());
+		memcpy(keyend, key.data(), key.size());
+		segment.keysize = keyend - &keys[segment.keyoffset] + key.size();
+		keys.resize(segment.keyoffset + segment.keysize);
+
+		// число без ведущих нулей - индекс массива и целый ключ map
+		segment.intkeyoffset = 0;
+		segment.intkeysize = 0;
+		segment.index = 0;
+		bool isnumber = key.empty() == false && key.size() <= 19 && (key[0] != '0' || key.size() == 1);
+		for (size_t i = 0; i < key.size() && isnumber == true; ++i)
+		{
+			isnumber = key[i] >= '0' && key[i] <= '9';
+			segment.index = segment.index * 10 + (key[i] - '0');
+		}
+		if (isnumber == true)
+		{
+			segment.intkeyoffset = keys.size();
+			keys.resize(segment.intkeyoffset + 9);
+			segment.intkeysize = cborencodehead(&keys[segment.intkeyoffset], HCBOR_POSITIVEINTEGER, segment.index) - &keys[segment.intkeyoffset];
+			keys.resize(segment.intkeyoffset + segment.intkeysize);
+		}
+		else
+			segment.index = 0;
+
+		segments.push_back(segment);
+	}
+
+	valid = true;
+	return true;
+}
+
+bool TRCBORPath::IsValid(void) const
+{
+	return valid;
+}
+
+size_t TRCBORPath::GetCount(void) const
+{
+	return segments.size();
+}
+
+//////////////////////////////////////////////////////////////
+// CBOR Tape
+
+// количество вложенных элементов по заголовку. SIZE_MAX - неопределенная длина
+static size_t cbortapechildscount(const TRCBORTapeEntry& entry)
+{
+	switch (entry.majortype)
+	{
+	case HCBOR_BYTEARRAY:
+	case HCBOR_STRING_UTF8:
+		return entry.additionaltype == 31 ? SIZE_MAX : 0;
+	case HCBOR_ITEMSARRAY:
+		return entry.additionaltype == 31 ? SIZE_MAX : (size_t)entry.value;
+	case HCBOR_PAIRSARRAY:
+		return entry.additionaltype == 31 ? SIZE_MAX : (size_t)entry.value * 2;
+	case HCBOR_TAGVALUE:
+		return 1;
+	}
+	return 0;
+}
+
+TRCBORTape::TRCBORTape()
+{
+	buffer = nullptr;
+	sizebuffer = 0;
+	error = HCBORERR_OK;
+	erroroffset = 0;
+}
+
+TRCBORTape::~TRCBORTape()
+{
+
+}
+
+bool TRCBORTape::Build(const void* ptr, size_t sizebuffer)
+{
+	buffer = (const uint8_t*)ptr;
+	this->sizebuffer = sizebuffer;
+
+	// память остается
+	entries.clear();
+	childs.clear();
+	erroroffset = 0;
+	error = cborvalidate(buffer, buffer + sizebuffer, erroroffset, false, &entries, &childs);
+	if (error != HCBORERR_OK)
+	{
+		entries.clear();
+		childs.clear();
+		return false;
+	}
+
+	return true;
+}
+
+TRHCBORError TRCBORTape::GetError(void) const
+{
+	return error;
+}
+
+size_t TRCBORTape::GetErrorOffset(void) const
+{
+	return erroroffset;
+}
+
+size_t TRCBORTape::GetCount(void) const
+{
+	return entries.size();
+}
+
+const TRCBORTapeEntry& TRCBORTape::GetEntry(size_t index) const
+{
+	return entries[index];
+}
+
+const void* TRCBORTape::GetValuePointer(size_t index) const
+{
+	const TRCBORTapeEntry& entry = entries[index];
+	size_t headsize = 1;
+	if (entry.additionaltype >= 24 && entry.additionaltype < 28)
+		headsize += (size_t)1 << (entry.additionaltype - 24);
+
+	return buffer + entry.offset + headsize;
+}
+
+size_t TRCBORTape::GetChildsCount(size_t index) const
+{
+	if (index >= entries.size())
+		return 0;
+
+	size_t count = cbortapechildscount(entries[index]);
+	if (count != SIZE_MAX)
+		return count;
+
+	count = 0;
+	for (size_t child = index + 1; child < entries[index].next; child = entries[child].next)
+		count++;
+	return count;
+}
+
+size_t TRCBORTape::GetChild(size_t index, size_t childindex) const
+{
+	if (index >= entries.size())
+		return SIZE_MAX;
+
+	const TRCBORTapeEntry& entry = entries[index];
+
+	if (entry.childs != SIZE_MAX)
+		return childindex < entry.value ? childs[entry.childs + childindex] : SIZE_MAX;
+
+	// все вложенные - скаляры (записи идут подряд) - прямой доступ
+	size_t count = cbortapechildscount(entry);
+	if (count != SIZE_MAX && entry.next - index - 1 == count)
+		return childindex < count ? index + 1 + childindex : SIZE_MAX;
+
+	size_t child = index + 1;
+	for (size_t i = 0; child < entry.next; ++i)
+	{
+		if (i == childindex)
+			return child;
+		child = entries[child].next;
+	}
+
+	return SIZE_MAX;
+}
+
+size_t TRCBORTape::Find(const TRCBORPath& path, size_t index) const
+{
+	if (path.valid == false || index >= entries.size())
+		return SIZE_MAX;
+
+	const uint8_t* keys = path.keys.data();
+	for (auto& segment : path.segments)
+	{
+		// теги пропускаются (помеченный элемент - следующая запись)
+		while (entries[index].majortype == HCBOR_TAGVALUE)
+			index++;
+
+		const TRCBORTapeEntry& entry = entries[index];
+		if (entry.majortype == HCBOR_ITEMSARRAY)
+		{
+			if (segment.intkeysize == 0)
+				return SIZE_MAX;
+			index = GetChild(index, (size_t)segment.index);
+		}
+		else
+		if (entry.majortype == HCBOR_PAIRSARRAY)
+		{
+			size_t found = SIZE_MAX;
+			for (size_t key = index + 1; key < entry.next && found == SIZE_MAX; key = entries[entries[key].next].next)
+			{
+				const uint8_t* keypointer = buffer + entries[key].offset;
+				size_t remainingsize = sizebuffer - entries[key].offset;
+				if ((remainingsize >= segment.keysize && memcmp(keypointer, keys + segment.keyoffset, segment.keysize) == 0) ||
+					(segment.intkeysize != 0 && remainingsize >= segment.intkeysize && memcmp(keypointer, keys + segment.intkeyoffset, segment.intkeysize) == 0))
+					found = entries[key].next; // значение
+			}
+			index = found;
+		}
+		else
+			return SIZE_MAX;
+
+		if (index == SIZE_MAX)
+			return SIZE_MAX;
+	}
+
+	return index;
+}
+
+//////////////////////////////////////////////////////////////
+// CBOR Arena
+
+TRCBORArena::TRCBORArena(size_t blocksize) :
+	blocksize(blocksize),
+	blockindex(0),
+	pointer(nullptr),
+	blockend(nullptr),
+	cleanups(nullptr)
+{
+	allocator.reallocfunc = defaultrealloc;
+	allocator.freefunc = defaultfree;
+	allocator.userdata = nullptr;
+}
+
+TRCBORArena::TRCBORArena(const TRCBORAllocator& allocator, size_t blocksize) :
+	allocator(allocator),
+	blocksize(blocksize),
+	blockindex(0),
+	pointer(nullptr),
+	blockend(nullptr),
+	cleanups(nullptr)
+{
+}
+
+TRCBORArena::~TRCBORArena()
+{
+	Clear();
+}
+
+void* TRCBORArena::allocateslow(size_t size)
+{
+	// большой размер - отдельный блок, чтобы не терять остаток текущего
+	if (size > blocksize / 4)
+	{
+		void* block = allocator.reallocfunc(allocator.userdata, nullptr, size);
+		if (block == nullptr)
+			throw std::bad_alloc(); // вызывающие (модели) не проверяют результат
+		largeblocks.push_back(block);
+		return block;
+	}
+
+	size_t nextindex = pointer != nullptr ? blockindex + 1 : blockindex; // pointer == nullptr - блоков еще не было или после Reset
+	if (nextindex == blocks.size())
+	{
+		void* block = allocator.reallocfunc(allocator.userdata, nullptr, blocksize);
+		if (block == nullptr)
+			throw std::bad_alloc(); // состояние не меняется - арена остается рабочей
+		blocks.push_back(block);
+	}
+
+	blockindex = nextindex;
+	pointer = (uint8_t*)blocks[blockindex];
+	blockend = pointer + blocksize;
+
+	void* result = pointer;
+	pointer += size;
+	return result;
+}
+
+void TRCBORArena::AddCleanup(TRCBORArenaCleanup func, void* ptr)
+{
+	cleanupentry* entry = (cleanupentry*)Allocate(sizeof(cleanupentry));
+	entry->func = func;
+	entry->ptr = ptr;
+	entry->next = cleanups;
+	cleanups = entry;
+}
+
+void TRCBORArena::runcleanups(void)
+{
+	for (cleanupentry* entry = cleanups; entry != nullptr; entry = entry->next)
+		entry->func(entry->ptr);
+	cleanups = nullptr;
+}
+
+void TRCBORArena::Reset(void)
+{
+	runcleanups();
+
+	for (auto& it : largeblocks)
+		allocator.freefunc(allocator.userdata, it);
+	largeblocks.clear();
+
+	blockindex = 0;
+	pointer = nullptr;
+	blockend = nullptr;
+}
+
+void TRCBORArena::Clear(void)
+{
+	Reset();
+
+	for (auto& it : blocks)
+		allocator.freefunc(allocator.userdata, it);
+	blocks.clear();
+}
+
+size_t TRCBORArena::GetBlocksSize(void) const
+{
+	return blocks.size() * blocksize;
+}
+
+//////////////////////////////////////////////////////////////
+// CBOR Object Model
+
+TRCBORObject::TRCBORObject() :
+	Childs(nullptr),
+	ChildsCount(0),
+	ObjectType(HOBJTYPE_NULL),
+	largeunsigned(false),
+	bytearray(nullptr),
+	bytearraysize(0),
+	Utf8Value(nullptr),
+	arena(nullptr)
+{
+	memset(buffervalue, 0, sizeof(buffervalue));
+}
+
+// вложенные объекты и строка в арене освобождаются вместе с ней
+TRCBORObject::~TRCBORObject()
+{
+	if (arena == nullptr)
+		delete Utf8Value;
+}
+
+size_t TRCBORObject::GetChildsCount(void)
+{
+	return ChildsCount;
+}
+
+TRCBORObject* TRCBORObject::GetChild(size_t index)
+{
+	if (index >= ChildsCount)
+		return nullptr;
+
+	return Childs[index];
+}
+
+bool TRCBORObject::GetByteArray(void **ptr, size_t &size)
+{
+	if (ObjectType != HOBJTYPE_BYTEARRAY)
+		return false;
+
+	*ptr = bytearray;
+	size = bytearraysize;
+	return true;
+}
+
+static void cbordestroystring(void* ptr)
+{
+	((std::string*)ptr)->~basic_string();
+}
+
+std::string& TRCBORObject::AsString(void)
+{
+	if (Utf8Value == nullptr)
+	{
+		const char* data = ObjectType == HOBJTYPE_STRING_UTF8 ? (const char*)bytearray : "";
+		size_t size = ObjectType == HOBJTYPE_STRING_UTF8 ? bytearraysize : 0;
+
+		if (arena == nullptr)
+			Utf8Value = new std::string(data, size);
+		else
+		{
+			Utf8Value = new (arena->Allocate(sizeof(std::string))) std::string(data, size);
+			arena->AddCleanup(cbordestroystring, Utf8Value);
+		}
+	}
+
+	return *Utf8Value;
+}
+
+TRCBORStringView TRCBORObject::AsStringView(void)
+{
+	TRCBORStringView view = { "", 0 };
+
+	if (Utf8Value != nullptr)
+	{
+		view.data = Utf8Value->data();
+		view.size = Utf8Value->size();
+	}
+	else
+	if (ObjectType == HOBJTYPE_STRING_UTF8)
+	{
+		view.data = (const char*)bytearray;
+		view.size = bytearraysize;
+	}
+
+	return view;
+}
+
+int32_t TRCBORObject::AsInt32(void)
+{
+	switch (this->ObjectType)
+	{
+	case HOBJTYPE_INT:
+		return *(int32_t*)buffervalue;
+		break;
+	case HOBJTYPE_INT64:
+		return (int32_t)(*(int64_t*)buffervalue);
+		break;
+	case HOBJTYPE_FLOAT32:
+		return (int32_t)(*(float*)buffervalue);
+		break;
+	case HOBJTYPE_FLOAT64:
+		return (int32_t)(*(double*)buffervalue);
+		break;
+	case HOBJTYPE_BOOL:
+		return (int32_t)(*(uint64_t*)buffervalue);
+		break;
+	}
+
+	return 0;
+}
+
+int64_t TRCBORObject::AsInt64(void)
+{
+	switch (this->ObjectType)
+	{
+	case HOBJTYPE_INT:
+		return (int64_t)(*(int32_t*)buffervalue);
+		break;
+	case HOBJTYPE_INT64:
+		return *(int64_t*)buffervalue;
+		break;
+	case HOBJTYPE_FLOAT32:
+		return (int64_t)(*(float*)buffervalue);
+		break;
+	case HOBJTYPE_FLOAT64:
+		return (int64_t)(*(double*)buffervalue);
+		break;
+	case HOBJTYPE_BOOL:
+		return *(uint64_t*)buffervalue;
+		break;
+	}
+
+	return 0;
+}
+
+float TRCBORObject::AsFloat(void)
+{
+	switch (this->ObjectType)
+	{
+	case HOBJTYPE_INT:
+		return (float)(*(int32_t*)buffervalue);
+		break;
+	case HOBJTYPE_INT64:
+		return (float)(*(int64_t*)buffervalue);
+		break;
+	case HOBJTYPE_FLOAT32:
+		return *(float*)buffervalue;
+		break;
+	case HOBJTYPE_FLOAT64:
+		return (float)(*(double*)buffervalue);
+		break;
+	case HOBJTYPE_BOOL:
+		return (float)(*(uint64_t*)buffervalue);
+		break;
+	}
+
+	return 0;
+}
+
+double TRCBORObject::AsDouble(void)
+{
+	switch (this->ObjectType)
+	{
+	case HOBJTYPE_INT:
+		return (double)(*(int32_t*)buffervalue);
+		break;
+	case HOBJTYPE_INT64:
+		return (double)(*(int64_t*)buffervalue);
+		break;
+	case HOBJTYPE_FLOAT32:
+		return (double)(*(float*)buffervalue);
+		break;
+	case HOBJTYPE_FLOAT64:
+		return *(double*)buffervalue;
+		break;
+	case HOBJTYPE_BOOL:
+		return (double)(*(uint64_t*)buffervalue);
+		break;
+	}
+
+	return 0;
+}
+
+bool TRCBORObject::AsBool(void)
+{
+	switch (this->ObjectType)
+	{
+	case HOBJTYPE_INT:
+		return *(int32_t*)buffervalue != 0;
+		break;
+	case HOBJTYPE_INT64:
+		return *(int64_t*)buffervalue != 0;
+		break;
+	case HOBJTYPE_FLOAT32:
+		return *(float*)buffervalue != 0;
+		break;
+	case HOBJTYPE_FLOAT64:
+		return *(double*)buffervalue != 0;
+		break;
+	case HOBJTYPE_BOOL:
+		return *(uint64_t*)buffervalue != 0;
+		break;
+	}
+
+	return false;
+}
+
+TRHCBORObjectType TRCBORObject::GetType(void)
+{
+	return ObjectType;
+}
+
+static const size_t memberhashthreshold = 16; // map больше - таблица открытой адресации, меньше - перебор хэшей
+
+static inline uint32_t cborhashbytes(const void* data, size_t size)
+{
+	// FNV-1a
+	const uint8_t* p = (const uint8_t*)data;
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static inline uint32_t cborhashint(int64_t value)
+{
+	// финализатор MurmurHash3
+	uint64_t x = (uint64_t)value;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return (uint32_t)x;
+}
+
+// ключи других типов GetMember не ищет - хэш любой, совпадение проверяется сравнением
+static uint32_t cborhashkey(TRCBORObject* key)
+{
+	switch (key->GetType())
+	{
+	case HOBJTYPE_STRING_UTF8:
+		{
+			TRCBORStringView view = key->AsStringView();
+			return cborhashbytes(view.data, view.size);
+		}
+	case HOBJTYPE_INT:
+	case HOBJTYPE_INT64:
+		return cborhashint(key->AsInt64());
+	default: // ключ не хэшируется
+		return 0;
+	}
+}
+
+TRCBORObject::TRCBORMemberIndex* TRCBORObject::buildmemberindex(void)
+{
+	size_t pairscount = ChildsCount / 2;
+
+	TRCBORMemberIndex* index = (TRCBORMemberIndex*)arena->Allocate(sizeof(TRCBORMemberIndex));
+	index->hashes = (uint32_t*)arena->Allocate(pairscount * sizeof(uint32_t));
+	index->slots = nullptr;
+	index->mask = 0;
+
+	for (size_t i = 0; i < pairscount; ++i)
+		index->hashes[i] = cborhashkey(Childs[i * 2]);
+
+	if (pairscount > memberhashthreshold)
+	{
+		size_t capacity = 1;
+		while (capacity < pairscount * 2) // заполнение не больше половины
+			capacity <<= 1;
+
+		index->slots = (uint32_t*)arena->Allocate(capacity * sizeof(uint32_t));
+		index->mask = (uint32_t)(capacity - 1);
+		memset(index->slots, 0, capacity * sizeof(uint32_t));
+
+		// при повторяющихся ключах первый по порядку стоит раньше в цепочке - как при переборе
+		for (size_t i = 0; i < pairscount; ++i)
+		{
+			uint32_t slot = index->hashes[i] & index->mask;
+			while (index->slots[slot] != 0)
+				slot = (slot + 1) & index->mask;
+			index->slots[slot] = (uint32_t)i + 1;
+		}
+	}
+
+	return index;
+}
+
+inline bool TRCBORObject::matchkey(size_t pairindex, const char* key, size_t keysize, int64_t intkey)
+{
+	TRCBORObject* keyobject = Childs[pairindex * 2];
+
+	if (key != nullptr)
+	{
+		if (keyobject->ObjectType != HOBJTYPE_STRING_UTF8)
+			return false;
+		TRCBORStringView view = keyobject->AsStringView();
+		return view.size == keysize && memcmp(view.data, key, keysize) == 0;
+	}
+
+	return (keyobject->ObjectType == HOBJTYPE_INT || keyobject->ObjectType == HOBJTYPE_INT64) && keyobject->AsInt64() == intkey;
+}
+
+TRCBORObject* TRCBORObject::findmember(uint32_t hash, const char* key, size_t keysize, int64_t intkey)
+{
+	if (ObjectType != HOBJTYPE_PAIRSARRAY)
+		return nullptr;
+
+	size_t pairscount = ChildsCount / 2;
+	if (arena == nullptr) // объект вне модели - без индекса
+	{
+		for (size_t i = 0; i < pairscount; ++i)
+			if (matchkey(i, key, keysize, intkey))
+				return Childs[i * 2 + 1];
+		return nullptr;
+	}
+
+	if (memberindex == nullptr)
+		memberindex = buildmemberindex();
+
+	const uint32_t* hashes = memberindex->hashes;
+	if (memberindex->slots != nullptr)
+	{
+		for (uint32_t slot = hash & memberindex->mask; memberindex->slots[slot] != 0; slot = (slot + 1) & memberindex->mask)
+		{
+			size_t i = memberindex->slots[slot] - 1;
+			if (hashes[i] == hash && matchkey(i, key, keysize, intkey))
+				return Childs[i * 2 + 1];
+		}
+		return nullptr;
+	}
+
+	// маленький map - перебор хэшей подряд (по 4 за сравнение)
+	size_t i = 0;
+#ifdef CBOR_SSE2
+	__m128i needle = _mm_set1_epi32((int)hash);
+	for (; i + 4 <= pairscount; i += 4)
+	{
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(hashes + i)), needle)));
+		for (size_t j = 0; mask != 0; ++j, mask >>= 1)
+			if ((mask & 1) != 0 && matchkey(i + j, key, keysize, intkey))
+				return Childs[(i + j) * 2 + 1];
+	}
+#endif
+	for (; i < pairscount; ++i)
+		if (hashes[i] == hash && matchkey(i, key, keysize, intkey))
+			return Childs[i * 2 + 1];
+
+	return nullptr;
+}
+
+TRCBORObject* TRCBORObject::GetMember(const char* key)
+{
+	return GetMember(key, strlen(key));
+}
+
+TRCBORObject* TRCBORObject::GetMember(const char* key, size_t keysize)
+{
+	return findmember(cborhashbytes(key, keysize), key, keysize, 0);
+}
+
+TRCBORObject* TRCBORObject::GetMember(int64_t key)
+{
+	return findmember(cborhashint(key), nullptr, 0, key);
+}
+
+TRCBORObject* TRCBORObject::GetMember(int32_t key)
+{
+	return GetMember((int64_t)key);
+}
+
+size_t TRCBORObject::GetCBORSize(void)
+{
+	size_t size = 0;
+	int64_t value;
+
+	switch (ObjectType)
+	{
+	case HOBJTYPE_INT:
+	case HOBJTYPE_INT64:
+		if (largeunsigned)
+			return 9;
+		value = AsInt64();
+		return cborheadsize((uint64_t)value ^ (uint64_t)(value >> 63));
+	case HOBJTYPE_FLOAT32:
+		return 5;
+	case HOBJTYPE_FLOAT64:
+		return 9;
+	case HOBJTYPE_BOOL:
+	case HOBJTYPE_NULL:
+	case HOBJTYPE_UNDEFINED:
+		return 1;
+	case HOBJTYPE_BYTEARRAY:
+		return cborheadsize(bytearraysize) + bytearraysize;
+	case HOBJTYPE_STRING_UTF8:
+		size = AsStringView().size;
+		return cborheadsize(size) + size;
+	case HOBJTYPE_ITEMSARRAY:
+		size = cborheadsize(ChildsCount);
+		break;
+	case HOBJTYPE_PAIRSARRAY:
+		size = cborheadsize(ChildsCount / 2);
+		break;
+	}
+
+	for (size_t i = 0; i < ChildsCount; ++i)
+		size += Childs[i]->GetCBORSize();
+
+	return size;
+}
+
+uint8_t* TRCBORObject::encodeCBOR(uint8_t* p)
+{
+	int64_t value;
+	uint64_t sign;
+
+	switch (ObjectType)
+	{
+	case HOBJTYPE_INT:
+	case HOBJTYPE_INT64:
+		value = AsInt64();
+		sign = largeunsigned ? 0 : (uint64_t)(value >> 63);
+		return cborencodehead(p, (uint8_t)(sign & HCBOR_NEGATIVEINTEGER), (uint64_t)value ^ sign);
+	case HOBJTYPE_FLOAT32:
+		p[0] = (HCBOR_FLOATSIMPLE << 5) | 26;
+		cborstorefloat(p + 1, AsFloat());
+		return p + 5;
+	case HOBJTYPE_FLOAT64:
+		p[0] = (HCBOR_FLOATSIMPLE << 5) | 27;
+		cborstoredouble(p + 1, AsDouble());
+		return p + 9;
+	case HOBJTYPE_BOOL:
+		p[0] = (HCBOR_FLOATSIMPLE << 5) | (AsBool() ? 21 : 20);
+		return p + 1;
+	case HOBJTYPE_NULL:
+		p[0] = (HCBOR_FLOATSIMPLE << 5) | 22;
+		return p + 1;
+	case HOBJTYPE_UNDEFINED:
+		p[0] = (HCBOR_FLOATSIMPLE << 5) | 23;
+		return p + 1;
+	case HOBJTYPE_BYTEARRAY:
+		p = cborencodehead(p, HCBOR_BYTEARRAY, bytearraysize);
+		memcpy(p, bytearray, bytearraysize);
+		return p + bytearraysize;
+	case HOBJTYPE_STRING_UTF8:
+		{
+			TRCBORStringView view = AsStringView();
+			p = cborencodehead(p, HCBOR_STRING_UTF8, view.size);
+			memcpy(p, view.data, view.size);
+			return p + view.size;
+		}
+	case HOBJTYPE_ITEMSARRAY: // массивы неопределенной длины записываются с длиной
+		p = cborencodehead(p, HCBOR_ITEMSARRAY, ChildsCount);
+		break;
+	case HOBJTYPE_PAIRSARRAY:
+		p = cborencodehead(p, HCBOR_PAIRSARRAY, ChildsCount / 2);
+		break;
+	}
+
+	for (size_t i = 0; i < ChildsCount; ++i)
+		p = Childs[i]->encodeCBOR(p);
+
+	return p;
+}
+
+void TRCBORObject::Serialize(TRCBORWriter& writer)
+{
+	encodeCBOR((uint8_t*)writer.Allocate(GetCBORSize()));
+}
+
+TRCBORObjectModel::TRCBORObjectModel() :
+	zerocopy(false),
+	error(HCBORERR_OK),
+	erroroffset(0)
+{
+}
+
+TRCBORObjectModel::~TRCBORObjectModel()
+{
+}
+
+void TRCBORObjectModel::SetBuffer(void* ptr, size_t sizebuffer, bool zerocopy)
+{
+	reader.SetBuffer(ptr, sizebuffer);
+	bufferhandle.reset();
+	this->zerocopy = zerocopy;
+}
+
+void TRCBORObjectModel::SetBuffer(const std::shared_ptr<const void>& buffer, size_t sizebuffer)
+{
+	reader.SetBuffer((void*)buffer.get(), sizebuffer);
+	bufferhandle = buffer;
+	zerocopy = true;
+}
+
+std::shared_ptr<const void> TRCBORObjectModel::GetBufferHandle(void) const
+{
+	return bufferhandle;
+}
+
+size_t TRCBORObjectModel::GetChildsCount(void)
+{
+	return Childs.size();
+}
+
+TRCBORObject* TRCBORObjectModel::GetChild(size_t index)
+{
+	if (index >= Childs.size())
+		return nullptr;
+
+	return Childs[index];
+}
+
+bool TRCBORObjectModel::Parse(void)
+{
+	arena.Reset(); // все объекты предыдущего разбора разом
+	Childs.clear();
+	parsestack.clear();
+	error = HCBORERR_OK;
+	erroroffset = 0;
+
+	TRCBORObject** childs;
+	size_t childscount;
+	return Parse(childs, childscount, SIZE_MAX, 0, false);
+}
+
+bool TRCBORObjectModel::fail(TRHCBORError error, size_t offset)
+{
+	if (this->error == HCBORERR_OK)
+	{
+		this->error = error;
+		erroroffset = offset;
+	}
+
+	return false;
+}
+
+TRCBORObject* TRCBORObjectModel::newobject(TRHCBORObjectType objecttype)
+{
+	TRCBORObject* object = new (arena.Allocate(sizeof(TRCBORObject))) TRCBORObject;
+	object->ObjectType = objecttype;
+	object->arena = &arena;
+	parsestack.push_back(object);
+	return object;
+}
+
+// разбор вложенных объектов до waitcount штук или до конца массива неопределенной длины (waitcount == SIZE_MAX)
+// depth - количество открытых массивов (0 - верхний уровень, до конца данных), pairs - map неопределенной длины
+// объекты собираются в parsestack и в конце копируются в арену одним списком
+// верхний уровень копируется в Childs модели. false - ошибка в данных (GetError), объекты до нее остаются
+bool TRCBORObjectModel::Parse(TRCBORObject** &childs, size_t &childscount, size_t waitcount, size_t depth, bool pairs)
+{
+	TRHCBOROutType valuetype;
+	uint8_t outvalue[8];
+	size_t valuesize;
+	bool result = true;
+	bool tagged = false; // прочитан тег, помеченный элемент еще не начат
+
+	size_t first = parsestack.size();
+	TRCBORObject* CurrentElement;
+
+	size_t sizebuffer;
+	const uint8_t* buffer = (const uint8_t*)reader.GetBuffer(sizebuffer);
+
+	while (result == true && parsestack.size() - first < waitcount)
+	{
+		size_t itemposition = reader.GetPosition();
+		if (reader.ParseCBOR(valuetype, outvalue, valuesize) == false)
+		{
+			if (reader.GetError() != HCBORERR_OK)
+				result = fail(reader.GetError(), reader.GetErrorOffset());
+			else if (depth > 0) // конец данных внутри массива
+				result = fail(HCBORERR_TRUNCATED, itemposition);
+			break;
+		}
+
+		switch (valuetype)
+		{
+		case HCBOROUT_INT:
+			CurrentElement = newobject(HOBJTYPE_INT);
+			*(int32_t*)CurrentElement->buffervalue = *(int32_t*)outvalue;
+			break;
+		case HCBOROUT_INT64:
+			CurrentElement = newobject(HOBJTYPE_INT64);
+			*(int64_t*)CurrentElement->buffervalue = *(int64_t*)outvalue;
+			// положительное больше INT64_MAX приходит теми же битами, что и отрицательное - знак по заголовку
+			CurrentElement->largeunsigned = *(int64_t*)outvalue < 0 && (buffer[itemposition] >> 5) == HCBOR_POSITIVEINTEGER;
+			break;
+		case HCBOROUT_FLOAT32:
+			CurrentElement = newobject(HOBJTYPE_FLOAT32);
+			*(float*)CurrentElement->buffervalue = *(float*)outvalue;
+			break;
+		case HCBOROUT_FLOAT64:
+			CurrentElement = newobject(HOBJTYPE_FLOAT64);
+			*(double*)CurrentElement->buffervalue = *(double*)outvalue;
+			break;
+		case HCBOROUT_TRUE:
+			CurrentElement = newobject(HOBJTYPE_BOOL);
+			*(uint64_t*)CurrentElement->buffervalue = 1;
+			break;
+		case HCBOROUT_FALSE:
+			newobject(HOBJTYPE_BOOL);
+			break;
+		case HCBOROUT_NULL:
+			newobject(HOBJTYPE_NULL);
+			break;
+		case HCBOROUT_UNDEFINED:
+			newobject(HOBJTYPE_UNDEFINED);
+			break;
+		case HCBOROUT_BYTEARRAY:
+			CurrentElement = newobject(HOBJTYPE_BYTEARRAY);
+			CurrentElement->bytearraysize = valuesize;
+			CurrentElement->bytearray = (void*)(*(uintptr_t*)outvalue);
+			break;
+		case HCBOROUT_STRING_UTF8:
+			CurrentElement = newobject(HOBJTYPE_STRING_UTF8);
+			CurrentElement->bytearraysize = valuesize;
+			if (zerocopy)
+				CurrentElement->bytearray = (void*)(*(uintptr_t*)outvalue);
+			else
+			{
+				CurrentElement->bytearray = arena.Allocate(valuesize);
+				memcpy(CurrentElement->bytearray, (void*)(*(uintptr_t*)outvalue), valuesize);
+			}
+			break;
+		case HCBOROUT_ITEMSARRAY_MARKER:
+		case HCBOROUT_PAIRSARRAY_MARKER:
+			if (depth == maxnestingdepth)
+			{
+				result = fail(HCBORERR_TOODEEP, itemposition);
+				break;
+			}
+			if (valuetype == HCBOROUT_ITEMSARRAY_MARKER)
+			{
+				CurrentElement = newobject(HOBJTYPE_ITEMSARRAY);
+				result = Parse(CurrentElement->Childs, CurrentElement->ChildsCount, valuesize, depth + 1, false);
+			}
+			else
+			{
+				CurrentElement = newobject(HOBJTYPE_PAIRSARRAY);
+				result = Parse(CurrentElement->Childs, CurrentElement->ChildsCount, valuesize == HCBOROUT_INDEFINITE_SIZE ? valuesize : valuesize * 2, depth + 1, valuesize == HCBOROUT_INDEFINITE_SIZE);
+			}
+			break;
+		case HCBOROUT_ENDARRAY_MARKER:
+			// break только в массиве неопределенной длины, не после тега и не между ключом и значением
+			if (waitcount != SIZE_MAX || depth == 0 || tagged == true || (pairs == true && (parsestack.size() - first) % 2 != 0))
+				result = fail(HCBORERR_UNEXPECTEDBREAK, itemposition);
+			waitcount = 0; // конец массива неопределенной длины
+			break;
+		case HCBOROUT_TAG_MARKER: // тег не элемент - помеченный элемент следует за ним
+			tagged = true;
+			continue;
+		default: // HCBOROUT_DATETIME и др. - только от обработчиков тегов, у читателя модели их нет
+			break;
+		}
+		tagged = false;
+	}
+
+	childscount = parsestack.size() - first;
+	if (first == 0) // верхний уровень (вложенные объекты всегда в стеке после своего массива)
+		Childs.assign(parsestack.begin(), parsestack.end());
+	else
+	{
+		childs = (TRCBORObject**)arena.Allocate(childscount * sizeof(TRCBORObject*));
+		if (childscount > 0)
+			memcpy(childs, &parsestack[first], childscount * sizeof(TRCBORObject*));
+	}
+	parsestack.resize(first);
+
+	return result;
+}
+
+size_t TRCBORObjectModel::GetCBORSize(void)
+{
+	size_t size = 0;
+
+	for (auto& it : Childs)
+		size += it->GetCBORSize();
+
+	return size;
+}
+
+void TRCBORObjectModel::Serialize(TRCBORWriter& writer)
+{
+	uint8_t* p = (uint8_t*)writer.Allocate(GetCBORSize());
+
+	for (auto& it : Childs)
+		p = it->encodeCBOR(p);
+}
+
+TRHCBORError TRCBORObjectModel::GetError(void) const
+{
+	return error;
+}
+
+size_t TRCBORObjectModel::GetErrorOffset(void) const
+{
+	return erroroffset;
+}
+
+//////////////////////////////////////////////////////////////
+// CBOR Flat Model
+
+static_assert(sizeof(TRCBORFlatObject) == 16, "TRCBORFlatObject must be 16 bytes");
+
+size_t TRCBORFlatObject::GetChildsCount(void) const
+{
+	return type == HOBJTYPE_ITEMSARRAY || type == HOBJTYPE_PAIRSARRAY ? size : 0;
+}
+
+const TRCBORFlatObject* TRCBORFlatObject::GetChild(size_t index) const
+{
+	if (index >= GetChildsCount())
+		return nullptr;
+
+	return this + (int64_t)value + index;
+}
+
+std::string TRCBORFlatObject::AsString(void) const
+{
+	TRCBORStringView view = AsStringView();
+	return std::string(view.data, view.size);
+}
+
+TRCBORStringView TRCBORFlatObject::AsStringView(void) const
+{
+	TRCBORStringView view = { "", 0 };
+
+	if (type == HOBJTYPE_STRING_UTF8)
+	{
+		view.data = (const char*)(uintptr_t)value;
+		view.size = size;
+	}
+
+	return view;
+}
+
+int32_t TRCBORFlatObject::AsInt32(void) const
+{
+	return (int32_t)AsInt64();
+}
+
+int64_t TRCBORFlatObject::AsInt64(void) const
+{
+	switch (type)
+	{
+	case HOBJTYPE_INT:
+	case HOBJTYPE_INT64:
+	case HOBJTYPE_BOOL:
+		return (int64_t)value;
+	case HOBJTYPE_FLOAT32:
+		return (int64_t)AsFloat();
+	case HOBJTYPE_FLOAT64:
+		return (int64_t)AsDouble();
+	}
+
+	return 0;
+}
+
+float TRCBORFlatObject::AsFloat(void) const
+{
+	if (type == HOBJTYPE_FLOAT32)
+	{
+		uint32_t bits = (uint32_t)value;
+		float result;
+		memcpy(&result, &bits, sizeof(result));
+		return result;
+	}
+
+	return (float)AsDouble();
+}
+
+double TRCBORFlatObject::AsDouble(void) const
+{
+	double result;
+
+	switch (type)
+	{
+	case HOBJTYPE_INT:
+	case HOBJTYPE_INT64:
+	case HOBJTYPE_BOOL:
+		return (double)(int64_t)value;
+	case HOBJTYPE_FLOAT32:
+		return AsFloat();
+	case HOBJTYPE_FLOAT64:
+		memcpy(&result, &value, sizeof(result));
+		return result;
+	}
+
+	return 0;
+}
+
+bool TRCBORFlatObject::AsBool(void) const
+{
+	switch (type)
+	{
+	case HOBJTYPE_INT:
+	case HOBJTYPE_INT64:
+	case HOBJTYPE_BOOL:
+		return value != 0;
+	case HOBJTYPE_FLOAT32:
+	case HOBJTYPE_FLOAT64:
+		return AsDouble() != 0;
+	}
+
+	return false;
+}
+
+bool TRCBORFlatObject::GetByteArray(const void** ptr, size_t& size) const
+{
+	if (type != HOBJTYPE_BYTEARRAY)
+		return false;
+
+	*ptr = (const void*)(uintptr_t)value;
+	size = this->size;
+	return true;
+}
+
+TRHCBORObjectType TRCBORFlatObject::GetType(void) const
+{
+	return (TRHCBORObjectType)type;
+}
+
+bool TRCBORFlatObject::setvalue(TRHCBOROutType valuetype, uint64_t outvalue, size_t valuesize)
+{
+	// ParseCBOR пишет int32, float и указатель в начало буфера значения
+	int32_t value32;
+	uint32_t bits32;
+	uintptr_t pointer;
+	memcpy(&value32, &outvalue, sizeof(value32));
+	memcpy(&bits32, &outvalue, sizeof(bits32));
+	memcpy(&pointer, &outvalue, sizeof(pointer));
+
+	value = 0;
+	size = 0;
+
+	switch (valuetype)
+	{
+	case HCBOROUT_INT:
+		type = HOBJTYPE_INT;
+		value = (uint64_t)(int64_t)value32;
+		break;
+	case HCBOROUT_INT64:
+		type = HOBJTYPE_INT64;
+		value = outvalue;
+		break;
+	case HCBOROUT_FLOAT32:
+		type = HOBJTYPE_FLOAT32;
+		value = bits32;
+		break;
+	case HCBOROUT_FLOAT64:
+		type = HOBJTYPE_FLOAT64;
+		value = outvalue;
+		break;
+	case HCBOROUT_TRUE:
+	case HCBOROUT_FALSE:
+		type = HOBJTYPE_BOOL;
+		value = valuetype == HCBOROUT_TRUE;
+		break;
+	case HCBOROUT_NULL:
+		type = HOBJTYPE_NULL;
+		break;
+	case HCBOROUT_UNDEFINED:
+		type = HOBJTYPE_UNDEFINED;
+		break;
+	case HCBOROUT_BYTEARRAY:
+	case HCBOROUT_STRING_UTF8:
+		if (valuesize > UINT32_MAX)
+			return false;
+		type = valuetype == HCBOROUT_BYTEARRAY ? HOBJTYPE_BYTEARRAY : HOBJTYPE_STRING_UTF8;
+		value = pointer;
+		size = (uint32_t)valuesize;
+		break;
+	default: // контейнеры и маркеры разбирает модель
+		return false;
+	}
+
+	return true;
+}
+
+TRCBORFlatModel::TRCBORFlatModel() :
+	rootindex(0),
+	rootcount(0),
+	error(HCBORERR_OK),
+	erroroffset(0)
+{
+}
+
+TRCBORFlatModel::~TRCBORFlatModel()
+{
+}
+
+void TRCBORFlatModel::SetBuffer(void* ptr, size_t sizebuffer)
+{
+	reader.SetBuffer(ptr, sizebuffer);
+	bufferhandle.reset();
+}
+
+void TRCBORFlatModel::SetBuffer(const std::shared_ptr<const void>& buffer, size_t sizebuffer)
+{
+	reader.SetBuffer((void*)buffer.get(), sizebuffer);
+	bufferhandle = buffer;
+}
+
+std::shared_ptr<const void> TRCBORFlatModel::GetBufferHandle(void) const
+{
+	return bufferhandle;
+}
+
+bool TRCBORFlatModel::Parse(void)
+{
+	nodes.clear(); // память массива остается для следующего документа
+	parsestack.clear();
+	error = HCBORERR_OK;
+	erroroffset = 0;
+
+	return Parse(SIZE_MAX, 0, false, rootindex, rootcount);
+}
+
+bool TRCBORFlatModel::fail(TRHCBORError error, size_t offset)
+{
+	if (this->error == HCBORERR_OK)
+	{
+		this->error = error;
+		erroroffset = offset;
+	}
+
+	return false;
+}
+
+// разбор вложенных узлов до waitcount штук или до конца массива неопределенной длины (waitcount == SIZE_MAX)
+// depth - количество открытых контейнеров (0 - верхний уровень, до конца данных), pairs - map неопределенной длины
+// узлы собираются в parsestack и при закрытии контейнера переносятся в nodes одним блоком:
+// first - индекс блока, count - количество. false - ошибка в данных (GetError), узлы до нее остаются
+bool TRCBORFlatModel::Parse(size_t waitcount, size_t depth, bool pairs, size_t& first, size_t& count)
+{
+	TRHCBOROutType valuetype;
+	uint64_t outvalue;
+	size_t valuesize;
+	bool result = true;
+	bool tagged = false; // прочитан тег, помеченный элемент еще не начат
+
+	size_t stackfirst = parsestack.size();
+	TRCBORFlatObject node;
+	memset(&node, 0, sizeof(node));
+
+	while (parsestack.size() - stackfirst < waitcount)
+	{
+		size_t itemposition = reader.GetPosition();
+		if (reader.ParseCBOR(valuetype, &outvalue, valuesize) == false)
+		{
+			if (reader.GetError() != HCBORERR_OK)
+				result = fail(reader.GetError(), reader.GetErrorOffset());
+			else if (depth > 0) // конец данных внутри контейнера
+				result = fail(HCBORERR_TRUNCATED, itemposition);
+			break;
+		}
+
+		if (valuetype == HCBOROUT_TAG_MARKER) // тег не элемент - помеченный элемент следует за ним
+		{
+			tagged = true;
+			continue;
+		}
+
+		node.value = 0;
+		node.size = 0;
+
+		switch (valuetype)
+		{
+		case HCBOROUT_ITEMSARRAY_MARKER:
+		case HCBOROUT_PAIRSARRAY_MARKER:
+			{
+				if (depth == maxnestingdepth)
+				{
+					result = fail(HCBORERR_TOODEEP, itemposition);
+					break;
+				}
+
+				size_t childsfirst, childscount;
+				size_t index = parsestack.size();
+
+				node.type = valuetype == HCBOROUT_ITEMSARRAY_MARKER ? HOBJTYPE_ITEMSARRAY : HOBJTYPE_PAIRSARRAY;
+				parsestack.push_back(node);
+				bool indefinitepairs = valuetype == HCBOROUT_PAIRSARRAY_MARKER && valuesize == HCBOROUT_INDEFINITE_SIZE;
+				if (valuetype == HCBOROUT_PAIRSARRAY_MARKER && valuesize != HCBOROUT_INDEFINITE_SIZE)
+					valuesize *= 2;
+				result = Parse(valuesize, depth + 1, indefinitepairs, childsfirst, childscount);
+				if (result == true && childscount > UINT32_MAX)
+					result = fail(HCBORERR_UNSUPPORTED, itemposition);
+
+				// пока узел в стеке - абсолютный индекс, при переносе в nodes станет смещением
+				parsestack[index].value = childsfirst;
+				parsestack[index].size = (uint32_t)childscount;
+			}
+			break;
+		case HCBOROUT_ENDARRAY_MARKER:
+			// break только в массиве неопределенной длины, не после тега и не между ключом и значением
+			if (waitcount != SIZE_MAX || depth == 0 || tagged == true || (pairs == true && (parsestack.size() - stackfirst) % 2 != 0))
+				result = fail(HCBORERR_UNEXPECTEDBREAK, itemposition);
+			waitcount = 0; // конец массива неопределенной длины
+			break;
+		default:
+			if (node.setvalue(valuetype, outvalue, valuesize) == false) // строка больше 4 Гб
+				result = fail(HCBORERR_UNSUPPORTED, itemposition);
+			break;
+		}
+
+		if (result == false)
+			break;
+		if (valuetype != HCBOROUT_ITEMSARRAY_MARKER && valuetype != HCBOROUT_PAIRSARRAY_MARKER && valuetype != HCBOROUT_ENDARRAY_MARKER)
+			parsestack.push_back(node);
+		tagged = false;
+	}
+
+	first = nodes.size();
+	count = parsestack.size() - stackfirst;
+	nodes.insert(nodes.end(), parsestack.begin() + stackfirst, parsestack.end());
+	parsestack.resize(stackfirst);
+
+	for (size_t i = first; i < first + count; ++i)
+		if (nodes[i].type == HOBJTYPE_ITEMSARRAY || nodes[i].type == HOBJTYPE_PAIRSARRAY)
+			nodes[i].value = (uint64_t)((int64_t)nodes[i].value - (int64_t)i);
+
+	return result;
+}
+
+size_t TRCBORFlatModel::GetChildsCount(void) const
+{
+	return rootcount;
+}
+
+const TRCBORFlatObject* TRCBORFlatModel::GetChild(size_t index) const
+{
+	if (index >= rootcount)
+		return nullptr;
+
+	return &nodes[rootindex + index];
+}
+
+size_t TRCBORFlatModel::GetNodesCount(void) const
+{
+	return nodes.size();
+}
+
+TRHCBORError TRCBORFlatModel::GetError(void) const
+{
+	return error;
+}
+
+size_t TRCBORFlatModel::GetErrorOffset(void) const
+{
+	return erroroffset;
+}
+
+//-----------------------------------------------------------------------------------------
+// CBOR Lazy Model
+
+size_t TRCBORLazyObject::GetChildsCount(void)
+{
+	if (ChildsCount == HCBOROUT_INDEFINITE_SIZE)
+		while (model->parsechild(this)); // до break или конца данных
+
+	return ChildsCount;
+}
+
+TRCBORLazyObject* TRCBORLazyObject::GetChild(size_t index)
+{
+	if (index >= ChildsCount)
+		return nullptr;
+
+	while (parsedcount <= index)
+		if (model->parsechild(this) == false)
+			return nullptr;
+
+	return Childs[index];
+}
+
+bool TRCBORLazyObject::IsComplete(void) const
+{
+	return complete;
+}
+
+std::string TRCBORLazyObject::AsString(void) const
+{
+	return scalar.AsString();
+}
+
+TRCBORStringView TRCBORLazyObject::AsStringView(void) const
+{
+	return scalar.AsStringView();
+}
+
+int32_t TRCBORLazyObject::AsInt32(void) const
+{
+	return scalar.AsInt32();
+}
+
+int64_t TRCBORLazyObject::AsInt64(void) const
+{
+	return scalar.AsInt64();
+}
+
+float TRCBORLazyObject::AsFloat(void) const
+{
+	return scalar.AsFloat();
+}
+
+double TRCBORLazyObject::AsDouble(void) const
+{
+	return scalar.AsDouble();
+}
+
+bool TRCBORLazyObject::AsBool(void) const
+{
+	return scalar.AsBool();
+}
+
+bool TRCBORLazyObject::GetByteArray(const void** ptr, size_t& size) const
+{
+	return scalar.GetByteArray(ptr, size);
+}
+
+TRHCBORObjectType TRCBORLazyObject::GetType(void) const
+{
+	return scalar.GetType();
+}
+
+TRCBORLazyModel::TRCBORLazyModel() :
+	nodescount(0),
+	error(HCBORERR_OK),
+	erroroffset(0)
+{
+	Parse();
+}
+
+TRCBORLazyModel::~TRCBORLazyModel()
+{
+}
+
+void TRCBORLazyModel::SetBuffer(void* ptr, size_t sizebuffer)
+{
+	reader.SetBuffer(ptr, sizebuffer);
+	bufferhandle.reset();
+}
+
+void TRCBORLazyModel::SetBuffer(const std::shared_ptr<const void>& buffer, size_t sizebuffer)
+{
+	reader.SetBuffer((void*)buffer.get(), sizebuffer);
+	bufferhandle = buffer;
+}
+
+std::shared_ptr<const void> TRCBORLazyModel::GetBufferHandle(void) const
+{
+	return bufferhandle;
+}
+
+void TRCBORLazyModel::Parse(void)
+{
+	arena.Reset();
+	nodescount = 0;
+	error = HCBORERR_OK;
+	erroroffset = 0;
+
+	// верхний уровень - как массив неопределенной длины до конца буфера
+	memset(&root, 0, sizeof(root));
+	root.scalar.type = HOBJTYPE_ITEMSARRAY;
+	root.model = this;
+	root.ChildsCount = HCBOROUT_INDEFINITE_SIZE;
+}
+
+bool TRCBORLazyModel::fail(TRCBORLazyObject* object, TRHCBORError error, size_t offset)
+{
+	if (this->error == HCBORERR_OK)
+	{
+		this->error = error;
+		erroroffset = offset;
+	}
+
+	object->ChildsCount = object->parsedcount;
+	object->skippending = false;
+	object->failed = true;
+	return false;
+}
+
+// разбор следующего вложенного элемента контейнера. вложенный контейнер только начинается - его конец ищется
+// при разборе следующего за ним (если он сам не разобран до конца - пропуском). false - вложенных больше нет
+bool TRCBORLazyModel::parsechild(TRCBORLazyObject* object)
+{
+	TRHCBOROutType valuetype;
+	uint64_t outvalue;
+	size_t valuesize;
+
+	if (object->complete || object->failed)
+		return false;
+
+	if (object->skippending)
+	{
+		TRCBORLazyObject* last = object->Childs[object->parsedcount - 1];
+		if (last->complete)
+			object->position = last->position;
+		else
+		{
+			reader.SetPosition(object->position);
+			if (reader.SkipValue() == false)
+				return fail(object, reader.GetError() != HCBORERR_OK ? reader.GetError() : HCBORERR_TRUNCATED, reader.GetErrorOffset());
+			object->position = reader.GetPosition();
+		}
+		object->skippending = false;
+	}
+
+	if (object->parsedcount == object->ChildsCount)
+	{
+		object->complete = true;
+		return false;
+	}
+
+	size_t itemposition;
+	bool tagged = false; // прочитан тег, помеченный элемент еще не начат
+	reader.SetPosition(object->position);
+	while (true)
+	{
+		itemposition = reader.GetPosition();
+		if (reader.ParseCBOR(valuetype, &outvalue, valuesize) == false)
+		{
+			if (reader.GetError() != HCBORERR_OK)
+				return fail(object, reader.GetError(), reader.GetErrorOffset());
+			if (object != &root || tagged == true) // конец данных внутри контейнера или после тега
+				return fail(object, HCBORERR_TRUNCATED, itemposition);
+
+			object->ChildsCount = object->parsedcount;
+			object->position = itemposition;
+			object->complete = true;
+			return false;
+		}
+
+		if (valuetype != HCBOROUT_TAG_MARKER)
+			break;
+		tagged = true; // тег не элемент - помеченный элемент следует за ним
+	}
+
+	if (valuetype == HCBOROUT_ENDARRAY_MARKER)
+	{
+		if (object->ChildsCount != HCBOROUT_INDEFINITE_SIZE || object == &root || tagged == true ||
+			(object->scalar.type == HOBJTYPE_PAIRSARRAY && object->parsedcount % 2 != 0))
+			return fail(object, HCBORERR_UNEXPECTEDBREAK, itemposition);
+
+		object->ChildsCount = object->parsedcount;
+		object->position = reader.GetPosition();
+		object->complete = true;
+		return false;
+	}
+
+	TRCBORLazyObject* node = (TRCBORLazyObject*)arena.Allocate(sizeof(TRCBORLazyObject)); // нет памяти - std::bad_alloc
+	memset(node, 0, sizeof(TRCBORLazyObject));
+	node->model = this;
+
+	if (valuetype == HCBOROUT_ITEMSARRAY_MARKER || valuetype == HCBOROUT_PAIRSARRAY_MARKER)
+	{
+		node->scalar.type = valuetype == HCBOROUT_ITEMSARRAY_MARKER ? HOBJTYPE_ITEMSARRAY : HOBJTYPE_PAIRSARRAY;
+		node->ChildsCount = valuetype == HCBOROUT_PAIRSARRAY_MARKER && valuesize != HCBOROUT_INDEFINITE_SIZE ? valuesize * 2 : valuesize;
+		node->position = reader.GetPosition();
+		node->complete = node->ChildsCount == 0;
+
+		object->position = itemposition;
+		object->skippending = true;
+	}
+	else
+	{
+		if (node->scalar.setvalue(valuetype, outvalue, valuesize) == false) // строка больше 4 Гб
+			return fail(object, HCBORERR_UNSUPPORTED, itemposition);
+		node->complete = true;
+
+		object->position = reader.GetPosition();
+	}
+
+	if (object->parsedcount == object->capacity)
+	{
+		size_t capacity = object->capacity < 8 ? 8 : object->capacity * 2;
+		if (capacity > object->ChildsCount)
+			capacity = object->ChildsCount;
+
+		// прежний массив остается в арене до Parse
+		TRCBORLazyObject** childs = (TRCBORLazyObject**)arena.Allocate(capacity * sizeof(TRCBORLazyObject*));
+		if (object->parsedcount != 0)
+			memcpy(childs, object->Childs, object->parsedcount * sizeof(TRCBORLazyObject*));
+		object->Childs = childs;
+		object->capacity = capacity;
+	}
+
+	object->Childs[object->parsedcount++] = node;
+	nodescount++;
+	return true;
+}
+
+size_t TRCBORLazyModel::GetChildsCount(void)
+{
+	return root.GetChildsCount();
+}
+
+TRCBORLazyObject* TRCBORLazyModel::GetChild(size_t index)
+{
+	return root.GetChild(index);
+}
+
+size_t TRCBORLazyModel::GetNodesCount(void) const
+{
+	return nodescount;
+}
+
+TRHCBORError TRCBORLazyModel::GetError(void) const
+{
+	return error;
+}
+
+size_t TRCBORLazyModel::GetErrorOffset(void) const
+{
+	return erroroffset;
 }
@@ -2,11 +2,14 @@
 #define __H_CBOR_H_
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <vector>
 #include <string>
+#include <memory>
 
 // RFC7049 (CBOR)
-// 3   -  
+// 3 старших бита - основной тип
 enum TRHCBORMajorType
 {
 	HCBOR_POSITIVEINTEGER = 0,
@@ -33,26 +36,78 @@ enum TRHCBOROutType
 	HCBOROUT_STRING_UTF8,
 	HCBOROUT_ITEMSARRAY_MARKER,
 	HCBOROUT_PAIRSARRAY_MARKER,
-	HCBOROUT_ENDARRAY_MARKER
+	HCBOROUT_ENDARRAY_MARKER,
+	HCBOROUT_TAG_MARKER,      // номер тега (uint64_t). следующий элемент - помеченный
+	// результаты стандартных обработчиков тегов (TRCBORReader::RegisterStandardTagHandlers)
+	HCBOROUT_DATETIME,        // теги 0 и 1 - секунды от 1970-01-01 UTC (double)
+	HCBOROUT_BIGNUM,          // тег 2 - указатель на модуль (big endian), valuesize - длина
+	HCBOROUT_NEGATIVEBIGNUM,  // тег 3 - значение = -1 - модуль
+	HCBOROUT_EMBEDDED_CBOR    // тег 24 - указатель на вложенный CBOR (не разбирается), valuesize - длина
+};
+
+// valuesize для массива неопределенной длины (до HCBOROUT_ENDARRAY_MARKER)
+const size_t HCBOROUT_INDEFINITE_SIZE = SIZE_MAX;
+
+// защита стека от слишком глубокой вложенности
+const size_t HCBOR_MAX_NESTING_DEPTH = 1024;
+
+// ошибки разбора (TRCBORReader::GetError)
+enum TRHCBORError
+{
+	HCBORERR_OK = 0,
+	HCBORERR_TRUNCATED,       // элемент выходит за конец буфера
+	HCBORERR_INVALIDHEAD,     // зарезервированный additional type (28-30), неопределенная длина у числа/тега, simple value < 32 в двух байтах
+	HCBORERR_INVALIDCHUNK,    // кусок строки неопределенной длины другого типа или сам неопределенной длины
+	HCBORERR_UNEXPECTEDBREAK, // break вне контейнера неопределенной длины или посреди пары
+	HCBORERR_TOODEEP,         // превышена максимальная вложенность
+	HCBORERR_UNSUPPORTED,     // корректный элемент, который ParseCBOR не возвращает (строка из кусков, simple value)
+	HCBORERR_INVALIDTAG,      // содержимое тега не подходит обработчику
+	HCBORERR_STOPPED,         // разбор остановлен обработчиком (TRCBORReader::Parse)
+	HCBORERR_TYPEMISMATCH     // элемент другого типа или значение не помещается в запрошенный (TRCBORReader::ReadCBOR...)
+};
+
+class TRCBORReader;
+
+// обработчик тега: читает помеченный элемент из reader (ParseCBOR и т.д.) и возвращает преобразованное значение
+// параметры valuetype/outvalue/valuesize - как в ParseCBOR. false - содержимое не подходит (HCBORERR_INVALIDTAG)
+typedef bool (*TRCBORTagHandler)(TRCBORReader& reader, uint64_t tag, TRHCBOROutType& valuetype, void* outvalue, size_t& valuesize, void* userdata);
+
+// пользовательский распределитель памяти (замена malloc/realloc/free)
+struct TRCBORAllocator
+{
+	void* (*reallocfunc)(void* userdata, void* ptr, size_t size); // ptr == nullptr - выделение нового блока
+	void (*freefunc)(void* userdata, void* ptr);
+	void* userdata;
 };
 
 class TRCBORWriter
 {
-private:
+protected:
 	void* pointer;
-	size_t fullsize; //    
-	size_t usesize;  //   
+	size_t fullsize; // полный размер выделенной памяти
+	size_t usesize;  // размер используемой памяти
 
-	const size_t blockmemsize; //    
+	const size_t blockmemsize; // размер блока выделяемой памяти
+	size_t retainsize; // размер памяти, который остается после Clear()
 
-	void needmemory(size_t needsize);
+	bool shortestfloat; // float пишется в самом коротком виде без потери точности (16, 32 или 64 бит)
 
-	void writeCBORSizeValue32(uint8_t majortype, uint32_t value); //   (  ,   ..)
+	TRCBORAllocator allocator;
+
+	inline void needmemory(size_t needsize);
+	virtual void growmemory(size_t newsize); // вызывается, когда в текущем буфере не хватает места. newsize = usesize + нужный размер
+
+	inline void writeCBORHead(uint8_t majortype, uint64_t value); // запись заголовка - тип + значение (или размер строки, буфера и т.д.)
+	void writeCBORShortestFloat(double value);
+
+	struct deterministicstate; // проверенные данные, их структурный индекс и общий буфер сортировки пар (cbor.cpp)
+	size_t writedeterministic(deterministicstate& state, size_t index);
 public:
 	TRCBORWriter();
+	TRCBORWriter(const TRCBORAllocator& allocator);
 	virtual ~TRCBORWriter();
 
-	void Write8U(uint8_t value);
+	inline void Write8U(uint8_t value);
 	void Write16U(uint16_t value);
 	void Write32U(uint32_t value);
 	void Write64U(uint64_t value);
@@ -69,28 +124,56 @@ public:
 
 	void WriteBuffer(void* buffer, size_t sizebuffer);
 
-	//     RFC7049 (CBOR)
+	// запись информации в виде RFC7049 (CBOR)
 	
-	//  64-    ,   ..   ..   
-	// float 16-bit   
-	//      
-
-	void WriteCBORValue(int32_t value);
-	void WriteCBORValue(int64_t value);
-	void WriteCBORByteArray(void* buffer, size_t sizebuffer);
-	void WriteCBORString(const std::string& str);
+	// float 16-bit пишется только в режиме SetShortestFloat(true)
+	// строки неопределенной длины тож не реализованы
+
+	// часто используемые функции - inline (реализация ниже в этом файле)
+	inline void WriteCBORValue(int32_t value);
+	inline void WriteCBORValue(int64_t value);
+	inline void WriteCBORByteArray(void* buffer, size_t sizebuffer);
+	inline void WriteCBORString(const std::string& str);
 	void WriteCBORString(const std::wstring& str);
-	void WriteCBORItemsArrayMarker(uint32_t itemscount = UINT32_MAX); //    !
-	void WriteCBORPairsArrayMarker(uint32_t pairscount = UINT32_MAX); //     !
-	void WriteCBORFloat(float value);
-	void WriteCBORFloat(double value);
-	void WriteCBORBool(bool value);
-	void WriteCBORNull(void);
-	void WriteCBORUndefined(void);
-	void WriteCBORStopArrayMarker(void); //      
-
-	void Clear(void);
-	size_t Size(void) const;
+	inline void WriteCBORItemsArrayMarker(void); // неопределенная длина - до WriteCBORStopArrayMarker
+	inline void WriteCBORItemsArrayMarker(uint64_t itemscount); // иерархию массивов поддерживать руками!
+	inline void WriteCBORPairsArrayMarker(void); // неопределенная длина - до WriteCBORStopArrayMarker
+	inline void WriteCBORPairsArrayMarker(uint64_t pairscount); // корректное количество пар поддерживать руками!
+	inline void WriteCBORFloat(float value);
+	inline void WriteCBORFloat(double value);
+	inline void WriteCBORBool(bool value);
+	inline void WriteCBORNull(void);
+	inline void WriteCBORUndefined(void);
+	inline void WriteCBORStopArrayMarker(void); // признак конца массива элементов или пар
+	inline void WriteCBORTag(uint64_t tag); // семантический тег. следующий записанный элемент - помеченный
+
+	// запись массива однотипных значений целиком (маркер массива + элементы)
+	void WriteCBORArray(const int32_t* values, size_t count);
+	void WriteCBORArray(const int64_t* values, size_t count);
+	void WriteCBORArray(const float* values, size_t count);
+	void WriteCBORArray(const double* values, size_t count);
+
+	// массив элементов или пар с длиной, неизвестной заранее. место под заголовок резервируется,
+	// при завершении в него записывается реальное количество, данные сдвигаются, если заголовок короче
+	// только для непрерывного буфера (IsContiguous), вложенные массивы завершаются в обратном порядке
+	size_t BeginCBORItemsArray(void); // возвращает позицию заголовка для EndCBORArray, SIZE_MAX - буфер не непрерывный (ничего не записано)
+	size_t BeginCBORPairsArray(void);
+	bool EndCBORArray(size_t position, uint64_t count); // count - количество элементов (или пар). false - по позиции нет зарезервированного заголовка
+
+	// детерминированное кодирование (RFC 8949 4.2): заголовки и float минимальной длины, без неопределенных длин,
+	// ключи пар отсортированы побайтно по их кодированию
+	bool WriteCBORDeterministic(const void* buffer, size_t sizebuffer); // запись готового CBOR в детерминированном виде. false - ошибка в данных или повторяющиеся ключи
+	bool MakeDeterministic(void); // преобразование всего записанного. false, если буфер не непрерывный (IsContiguous)
+
+	virtual void Clear(void);
+	virtual size_t Size(void) const;
+	virtual bool IsContiguous(void) const; // все записанное - один буфер Pointer()..Size(): можно менять уже записанные данные
+
+	void Reserve(size_t size); // выделение памяти под size байт сразу (размер всего буфера)
+	void* Allocate(size_t size); // добавление size байт для записи напрямую. после них в буфере есть еще 8 байт резерва (для cborencodehead)
+	size_t Capacity(void) const;
+	void SetRetainSize(size_t size); // сколько памяти оставлять после Clear(). SIZE_MAX - не освобождать память
+	void SetShortestFloat(bool enable); // WriteCBORFloat пишет float 16, 32 или 64 бит - самый короткий, в котором значение точно представимо
 
 	void* GetCurrentPointer(void) const;
 
@@ -99,22 +182,512 @@ public:
 	void SetSize(size_t size);
 };
 
+//////////////////////////////////////////////////////////////
+// inline реализация записи CBOR
+// каждая функция проверяет память один раз (по максимальному размеру) и пишет прямо в буфер
+
+//////////////////////////////////////////////////////////////
+// порядок байт. в CBOR все многобайтовые значения - big endian (сетевой порядок)
+// загрузка/запись через memcpy + bswap - работает на невыровненных данных и компилируется в одну инструкцию (movbe/bswap, rev на ARM)
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define CBOR_BIG_ENDIAN_HOST
+#endif
+
+inline uint16_t cborbigendian16(uint16_t value)
+{
+#if defined(CBOR_BIG_ENDIAN_HOST)
+	return value;
+#elif defined(_MSC_VER)
+	return _byteswap_ushort(value);
+#else
+	return __builtin_bswap16(value);
+#endif
+}
+
+inline uint32_t cborbigendian32(uint32_t value)
+{
+#if defined(CBOR_BIG_ENDIAN_HOST)
+	return value;
+#elif defined(_MSC_VER)
+	return _byteswap_ulong(value);
+#else
+	return __builtin_bswap32(value);
+#endif
+}
+
+inline uint64_t cborbigendian64(uint64_t value)
+{
+#if defined(CBOR_BIG_ENDIAN_HOST)
+	return value;
+#elif defined(_MSC_VER)
+	return _byteswap_uint64(value);
+#else
+	return __builtin_bswap64(value);
+#endif
+}
+
+inline uint16_t cborload16(const void* p)
+{
+	uint16_t value;
+	memcpy(&value, p, 2);
+	return cborbigendian16(value);
+}
+
+inline uint32_t cborload32(const void* p)
+{
+	uint32_t value;
+	memcpy(&value, p, 4);
+	return cborbigendian32(value);
+}
+
+inline uint64_t cborload64(const void* p)
+{
+	uint64_t value;
+	memcpy(&value, p, 8);
+	return cborbigendian64(value);
+}
+
+inline void cborstore16(void* p, uint16_t value)
+{
+	value = cborbigendian16(value);
+	memcpy(p, &value, 2);
+}
+
+inline void cborstore32(void* p, uint32_t value)
+{
+	value = cborbigendian32(value);
+	memcpy(p, &value, 4);
+}
+
+inline void cborstore64(void* p, uint64_t value)
+{
+	value = cborbigendian64(value);
+	memcpy(p, &value, 8);
+}
+
+inline void cborstorefloat(void* p, float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, 4);
+	cborstore32(p, bits);
+}
+
+inline void cborstoredouble(void* p, double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, 8);
+	cborstore64(p, bits);
+}
+
+// преобразования float 32-bit <-> float 16-bit (IEEE 754 half precision)
+bool cborfloattohalf(float value, uint16_t& half); // false - значение не представимо в 16 битах точно
+float cborhalftofloat(uint16_t half);
+void cborhalftofloat(const uint16_t* in, float* out, size_t count); // массовое преобразование (F16C, если доступно)
+
+// кодирование заголовка (тип + значение) прямо в память. место должно быть выделено заранее - 9 байт всегда,
+// т.к. значение пишется целиком 8 байтами, а указатель сдвигается только на нужную длину
+inline uint8_t* cborencodehead(uint8_t* p, uint8_t majortype, uint64_t value)
+{
+	static const uint8_t lengths[5] = { 0, 1, 2, 4, 8 };
+	static const uint8_t shifts[5] = { 0, 56, 48, 32, 0 };
+
+	// 0 - значение в самом заголовке, 1..4 - uint8_t, uint16_t, uint32_t, uint64_t
+	unsigned int sizeclass = (value > 23) + (value > 0xff) + (value > 0xffff) + (value > 0xffffffff);
+
+	p[0] = (uint8_t)(majortype << 5) | (uint8_t)(sizeclass == 0 ? value : 23 + sizeclass);
+	cborstore64(p + 1, value << shifts[sizeclass]); // значащие байты сдвигаются в начало (big endian)
+
+	return p + 1 + lengths[sizeclass];
+}
+
+// размер заголовка (тип + значение), который запишет cborencodehead
+inline size_t cborheadsize(uint64_t value)
+{
+	return value < 24 ? 1 : value <= 0xff ? 2 : value <= 0xffff ? 3 : value <= 0xffffffff ? 5 : 9;
+}
+
+// разбор заголовка элемента. false - данные закончились или заголовок некорректен
+// для неопределенной длины (additionaltype == 31) value = 0
+inline bool cbordecodehead(const uint8_t*& p, const uint8_t* end, uint8_t& majortype, uint8_t& additionaltype, uint64_t& value)
+{
+	if (p >= end)
+		return false;
+
+	majortype = *p >> 5;
+	additionaltype = *p & 31;
+	p++;
+
+	if (additionaltype < 24)
+	{
+		value = additionaltype;
+		return true;
+	}
+
+	value = 0;
+	if (additionaltype > 27) // 28-30 зарезервированы. 31 - неопределенная длина (или break для типа 7)
+		return additionaltype == 31 && majortype >= HCBOR_BYTEARRAY && majortype != HCBOR_TAGVALUE;
+
+	size_t length = (size_t)1 << (additionaltype - 24);
+	if ((size_t)(end - p) < length)
+		return false;
+
+	switch (length)
+	{
+	case 1:
+		value = *p;
+		break;
+	case 2:
+		value = cborload16(p);
+		break;
+	case 4:
+		value = cborload32(p);
+		break;
+	case 8:
+		value = cborload64(p);
+		break;
+	}
+	p += length;
+
+	return true;
+}
+
+inline void TRCBORWriter::needmemory(size_t needsize)
+{
+	if (usesize + needsize > fullsize)
+		growmemory(usesize + needsize);
+}
+
+inline void TRCBORWriter::Write8U(uint8_t value)
+{
+	needmemory(1);
+
+	*((uint8_t*)pointer + usesize) = value;
+
+	++usesize;
+}
+
+inline void TRCBORWriter::writeCBORHead(uint8_t majortype, uint64_t value)
+{
+	needmemory(9);
+	usesize = cborencodehead((uint8_t*)pointer + usesize, majortype, value) - (uint8_t*)pointer;
+}
+
+inline void TRCBORWriter::WriteCBORValue(int32_t value)
+{
+	uint32_t sign = (uint32_t)(value >> 31); // 0 или 0xffffffff
+
+	writeCBORHead((uint8_t)(sign & HCBOR_NEGATIVEINTEGER), (uint32_t)value ^ sign); // для отрицательных -value - 1
+}
+
+inline void TRCBORWriter::WriteCBORValue(int64_t value)
+{
+	uint64_t sign = (uint64_t)(value >> 63);
+
+	writeCBORHead((uint8_t)(sign & HCBOR_NEGATIVEINTEGER), (uint64_t)value ^ sign);
+}
+
+inline void TRCBORWriter::WriteCBORByteArray(void* buffer, size_t sizebuffer)
+{
+	needmemory(9 + sizebuffer);
+
+	uint8_t* p = cborencodehead((uint8_t*)pointer + usesize, HCBOR_BYTEARRAY, sizebuffer);
+	memcpy(p, buffer, sizebuffer);
+	usesize = p + sizebuffer - (uint8_t*)pointer;
+}
+
+inline void TRCBORWriter::WriteCBORString(const std::string& str)
+{
+	needmemory(9 + str.size());
+
+	uint8_t* p = cborencodehead((uint8_t*)pointer + usesize, HCBOR_STRING_UTF8, str.size());
+	memcpy(p, str.data(), str.size());
+	usesize = p + str.size() - (uint8_t*)pointer;
+}
+
+inline void TRCBORWriter::WriteCBORItemsArrayMarker(void)
+{
+	Write8U((HCBOR_ITEMSARRAY << 5) | 31);
+}
+
+inline void TRCBORWriter::WriteCBORItemsArrayMarker(uint64_t itemscount)
+{
+	writeCBORHead(HCBOR_ITEMSARRAY, itemscount);
+}
+
+inline void TRCBORWriter::WriteCBORPairsArrayMarker(void)
+{
+	Write8U((HCBOR_PAIRSARRAY << 5) | 31);
+}
+
+inline void TRCBORWriter::WriteCBORPairsArrayMarker(uint64_t pairscount)
+{
+	writeCBORHead(HCBOR_PAIRSARRAY, pairscount);
+}
+
+inline void TRCBORWriter::WriteCBORFloat(float value)
+{
+	if (shortestfloat)
+	{
+		writeCBORShortestFloat(value);
+		return;
+	}
+
+	needmemory(5);
+
+	uint8_t* p = (uint8_t*)pointer + usesize;
+	p[0] = (HCBOR_FLOATSIMPLE << 5) | 26; // float 32-bit
+	cborstorefloat(p + 1, value);
+	usesize += 5;
+}
+
+inline void TRCBORWriter::WriteCBORFloat(double value)
+{
+	if (shortestfloat)
+	{
+		writeCBORShortestFloat(value);
+		return;
+	}
+
+	needmemory(9);
+
+	uint8_t* p = (uint8_t*)pointer + usesize;
+	p[0] = (HCBOR_FLOATSIMPLE << 5) | 27; // float 64-bit
+	cborstoredouble(p + 1, value);
+	usesize += 9;
+}
+
+inline void TRCBORWriter::WriteCBORBool(bool value)
+{
+	Write8U((HCBOR_FLOATSIMPLE << 5) | (value ? 21 : 20)); // true : false
+}
+
+inline void TRCBORWriter::WriteCBORNull(void)
+{
+	Write8U((HCBOR_FLOATSIMPLE << 5) | 22);
+}
+
+inline void TRCBORWriter::WriteCBORUndefined(void)
+{
+	Write8U((HCBOR_FLOATSIMPLE << 5) | 23);
+}
+
+inline void TRCBORWriter::WriteCBORTag(uint64_t tag)
+{
+	writeCBORHead(HCBOR_TAGVALUE, tag);
+}
+
+inline void TRCBORWriter::WriteCBORStopArrayMarker(void)
+{
+	Write8U((HCBOR_FLOATSIMPLE << 5) | 31); // конец массива
+}
+
+// массив с длиной, неизвестной заранее, в пределах области видимости
+// {
+//	TRCBORArrayScope array(writer);
+//	writer.WriteCBORValue(1);
+//	array.Add();
+//	...
+// } // здесь в заголовок записывается количество элементов
+// записанное не разбирается: количество - только сумма Add. пропущенный Add дает неверное количество без ошибки
+// вложенные области закрываются в обратном порядке (как в блоках кода)
+class TRCBORArrayScope
+{
+private:
+	TRCBORWriter& writer;
+	size_t position;
+	uint64_t count;
+public:
+	TRCBORArrayScope(TRCBORWriter& writer, bool pairs = false);
+	~TRCBORArrayScope();
+
+	void Add(uint64_t added = 1) { count += added; } // записаны элементы (для пар - пары)
+	uint64_t GetCount(void) const { return count; }
+	bool End(void); // завершение до конца области видимости. false - писатель не непрерывный или уже завершено
+};
+
+// сегмент выходных данных. по расположению полей совпадает со struct iovec (POSIX),
+// поэтому массив сегментов можно напрямую передавать в writev/sendmsg
+struct TRCBORSegment
+{
+	void* data;
+	size_t size;
+};
+
+// писатель в цепочку блоков фиксированного размера (без перевыделения и копирования при росте)
+// байтовые массивы, записанные через ...Ref, не копируются - в цепочку добавляется ссылка на буфер вызывающего
+// буферы вызывающего должны быть живы до окончания использования сегментов!
+// Pointer() и GetCurrentPointer() указывают только на текущий блок
+class TRCBORSegmentedWriter : public TRCBORWriter
+{
+private:
+	struct segmentinfo
+	{
+		const void* external; // nullptr - сегмент внутри блока chunkindex
+		size_t chunkindex;
+		size_t offset;
+		size_t size;
+	};
+
+	std::vector<void*> chunks; // заполненные блоки (текущий блок - pointer)
+	std::vector<segmentinfo> segmentsinfo;
+	std::vector<TRCBORSegment> segments;
+
+	const size_t chunksize;
+	const size_t copythreshold; // буферы меньше этого размера копируются, а не добавляются ссылкой
+	size_t segmentstart; // начало незакрытого сегмента в текущем блоке
+	size_t closedsize;   // размер закрытых сегментов
+
+	void closesegment(void);
+	void freechunks(void);
+protected:
+	virtual void growmemory(size_t newsize);
+public:
+	TRCBORSegmentedWriter(size_t chunksize = 64 * 1024, size_t copythreshold = 256);
+	virtual ~TRCBORSegmentedWriter();
+
+	void WriteBufferRef(const void* buffer, size_t sizebuffer);
+	void WriteCBORByteArrayRef(const void* buffer, size_t sizebuffer);
+
+	virtual void Clear(void);
+	virtual size_t Size(void) const; // полный размер всех сегментов
+	virtual bool IsContiguous(void) const;
+
+	const TRCBORSegment* GetSegments(size_t& count); // указатели действительны до следующей записи или Clear()
+	void CopyTo(void* buffer) const; // сборка всех сегментов в один непрерывный буфер размером Size()
+};
+
+// приемник данных потокового писателя. возвращает false при ошибке записи
+typedef bool (*TRCBORSinkFunc)(void* userdata, const void* data, size_t size);
+
+// потоковый писатель - при заполнении буфера (highwatermark) данные сбрасываются в файловый дескриптор или callback
+// память ограничена highwatermark (или размером самой большой строки/байтового массива, если он больше)
+// удобно вместе с массивами неопределенной длины - WriteCBORItemsArrayMarker() ... WriteCBORStopArrayMarker()
+// Pointer() и GetCurrentPointer() указывают на еще не сброшенные данные
+class TRCBORStreamWriter : public TRCBORWriter
+{
+private:
+	int fd;
+	TRCBORSinkFunc sinkfunc;
+	void* userdata;
+
+	const size_t highwatermark;
+	size_t flushedsize; // сколько уже сброшено в приемник
+	bool error;
+
+	bool writesink(const void* data, size_t size);
+protected:
+	virtual void growmemory(size_t newsize);
+public:
+	TRCBORStreamWriter(int fd, size_t highwatermark = 64 * 1024);
+	TRCBORStreamWriter(TRCBORSinkFunc sinkfunc, void* userdata, size_t highwatermark = 64 * 1024);
+	virtual ~TRCBORStreamWriter(); // несброшенные данные сбрасываются
+
+	bool Flush(void); // false - ошибка записи в приемник (последующие данные отбрасываются)
+	bool IsError(void) const;
+
+	virtual void Clear(void); // несброшенные данные отбрасываются
+	virtual size_t Size(void) const; // полный размер записанного (сброшенного и несброшенного)
+	virtual bool IsContiguous(void) const;
+};
+
+// скомпилированный путь для TRCBORReader::Find. переиспользуется для любого количества сообщений
+// синтаксис - JSON Pointer (RFC 6901): "/device/readings/3/value", ~1 - '/', ~0 - '~'
+// число - индекс массива или ключ map (строковый или целый)
+// ключи заранее закодированы в CBOR и сравниваются memcmp (ключи в данных должны быть в кратчайшей форме)
+class TRCBORPath
+{
+	friend class TRCBORReader;
+	friend class TRCBORTape;
+private:
+	struct TRCBORPathSegment
+	{
+		size_t keyoffset;    // закодированный строковый ключ в keys
+		size_t keysize;
+		size_t intkeyoffset; // закодированный целый ключ в keys (intkeysize == 0 - сегмент не число)
+		size_t intkeysize;
+		uint64_t index;
+	};
+
+	std::vector<uint8_t> keys;
+	std::vector<TRCBORPathSegment> segments;
+	bool valid;
+public:
+	TRCBORPath();
+	TRCBORPath(const char* path);
+
+	bool Compile(const char* path); // false - некорректный синтаксис
+	bool IsValid(void) const;
+	size_t GetCount(void) const; // количество сегментов
+};
+
+// ссылка на строку внутри буфера разбора (без копирования). действительна, пока жив буфер
+struct TRCBORStringView
+{
+	const char* data;
+	size_t size;
+
+	std::string ToString(void) const { return std::string(data, size); }
+	bool Equals(const char* str) const { return strlen(str) == size && memcmp(data, str, size) == 0; }
+};
+
+// ссылка на массив байт внутри буфера разбора (без копирования)
+struct TRCBORBytesView
+{
+	const uint8_t* data;
+	size_t size;
+};
+
+// обработчик для TRCBORReader::Parse. методы вызываются напрямую (без virtual), поэтому встраиваются компилятором
+// достаточно наследоваться и переопределить нужные. false - остановить разбор (HCBORERR_STOPPED)
+struct TRCBORVisitor
+{
+	bool OnUInt64(uint64_t /*value*/) { return true; }
+	bool OnInt64(int64_t /*value*/) { return true; }      // только отрицательные
+	bool OnFloat(float /*value*/) { return true; }        // float 16/32-bit
+	bool OnDouble(double /*value*/) { return true; }
+	bool OnBool(bool /*value*/) { return true; }
+	bool OnNull(void) { return true; }
+	bool OnUndefined(void) { return true; }
+	bool OnString(const TRCBORStringView& /*value*/) { return true; }
+	bool OnBytes(const TRCBORBytesView& /*value*/) { return true; }
+	bool OnArrayBegin(size_t /*count*/) { return true; }  // HCBOROUT_INDEFINITE_SIZE - неопределенная длина
+	bool OnArrayEnd(void) { return true; }                // для любых массивов, в т.ч. определенной длины
+	bool OnMapBegin(size_t /*count*/) { return true; }    // количество пар
+	bool OnMapEnd(void) { return true; }
+	bool OnTag(uint64_t /*tag*/) { return true; }         // следующий вызов - помеченный элемент
+};
+
 class TRCBORReader
 {
 private:
 	void* ptr;
-	uint32_t sizebuffer;
-	uint32_t position;
+	size_t sizebuffer;
+	size_t position;
+
+	TRHCBORError error;
+	size_t erroroffset;
 
-	uint32_t readCBORSizeValue32(uint8_t additionaltype);
-	uint64_t readCBORSizeValue64(uint8_t additionaltype);
+	// обработчики тегов: теги < 64 - прямой индекс, остальные - список после них
+	struct TRCBORTagHandlerEntry
+	{
+		uint64_t tag;
+		TRCBORTagHandler handler;
+		void* userdata;
+	};
+	std::vector<TRCBORTagHandlerEntry> taghandlers;
+	size_t tagdepth; // вложенность вызовов обработчиков
+
+	const TRCBORTagHandlerEntry* findtaghandler(uint64_t tag) const;
+	TRHCBORError readCBORHead(uint8_t& majortype, uint8_t& additionaltype, uint64_t& value);
+	bool seterror(TRHCBORError error, size_t offset);
+	bool failat(TRHCBORError error, size_t offset); // как seterror, но позиция не меняется
+	bool readtypedhead(const uint8_t*& p, uint8_t& majortype, uint8_t& additionaltype, uint64_t& value);
 
 	uint32_t ReadUInt8(void);
 	uint32_t ReadUInt16(void);
 	uint32_t ReadUInt32(void);
 	uint64_t ReadUInt64(void);
-	float ReadFloat32(void);
-	double ReadFloat64(void);
 
 	void* GetCurrentPointer(void);
 public:
@@ -123,7 +696,594 @@ public:
 
 	void SetBuffer(void* ptr, size_t sizebuffer);
 	void* GetBuffer(size_t& sizebuffer);
-	bool ParseCBOR(TRHCBOROutType& valuetype, void* outvalue, size_t& valuesize); //   .  valueptr - 8 
+	bool ParseCBOR(TRHCBOROutType& valuetype, void* outvalue, size_t& valuesize); // все параметры выходные. буфер valueptr - 8 байт
+	size_t GetPosition(void) const;
+	void SetPosition(size_t position); // продолжение разбора с другого элемента (смещение начала элемента)
+
+	// false при конце данных (GetError() == HCBORERR_OK) или ошибке. позиция остается на начале ошибочного элемента
+	TRHCBORError GetError(void) const;
+	size_t GetErrorOffset(void) const;
+
+	// проверка корректности всего буфера (последовательность элементов, RFC 8742) без разбора значений. позиция не меняется
+	bool Validate(void);
+
+	// пропуск одного элемента целиком (с вложенными массивами, map, тегами и строками из кусков) без разбора значений
+	// break (HCBOROUT_ENDARRAY_MARKER) - не элемент, его читает ParseCBOR
+	bool SkipValue(void);
+
+	// поиск по пути внутри элемента в текущей позиции, без построения объектной модели
+	// true - позиция на найденном элементе (дальше ParseCBOR/SkipValue/Find)
+	// false - не найден (GetError() == HCBORERR_OK) или ошибка в данных. позиция не меняется
+	bool Find(const TRCBORPath& path);
+	bool Find(const char* path);
+
+	// теги без обработчика возвращаются как HCBOROUT_TAG_MARKER перед помеченным элементом
+	void RegisterTagHandler(uint64_t tag, TRCBORTagHandler handler, void* userdata = nullptr); // handler == nullptr - удаление
+	void RegisterStandardTagHandlers(void); // 0, 1 - дата/время, 2, 3 - bignum, 24 - вложенный CBOR
+
+	// разбор одного элемента целиком (с вложенными) с вызовом методов visitor (см. TRCBORVisitor)
+	// типы visitor известны при компиляции - без промежуточного TRHCBOROutType и буфера значения
+	// строки из кусков и simple value не поддерживаются (HCBORERR_UNSUPPORTED), теги не обрабатываются (OnTag)
+	// true - позиция за элементом. false - конец данных, ошибка или остановка, позиция не меняется
+	template <class Visitor> bool Parse(Visitor& visitor);
+
+	// чтение значения известного типа (схема известна заранее) - одна проверка первого байта на поле
+	// false - конец данных (HCBORERR_OK), другой тип (HCBORERR_TYPEMISMATCH) или ошибка. позиция не меняется
+	// теги не пропускаются - помеченный элемент тоже HCBORERR_TYPEMISMATCH
+	inline bool ReadCBORInt64(int64_t& value);
+	inline bool ReadCBORUInt64(uint64_t& value); // только неотрицательные, весь диапазон uint64_t
+	inline bool ReadCBORDouble(double& value);   // float 16/32/64-bit
+	inline bool ReadCBORBool(bool& value);
+	inline bool ReadCBORString(TRCBORStringView& value);   // строка из кусков - HCBORERR_UNSUPPORTED
+	inline bool ReadCBORByteArray(TRCBORBytesView& value); // ссылка внутрь буфера
+	inline bool EnterCBORArray(size_t& count); // HCBOROUT_INDEFINITE_SIZE - до ReadCBORStopArrayMarker
+	inline bool EnterCBORMap(size_t& count);   // количество пар
+	inline bool ReadCBORStopArrayMarker(void); // true - конец массива неопределенной длины. false - не break (без ошибки)
+};
+
+inline bool TRCBORReader::failat(TRHCBORError error, size_t offset)
+{
+	this->error = error;
+	erroroffset = offset;
+	return false;
+}
+
+// заголовок элемента в позиции для ReadCBOR... p - за заголовком, позиция не меняется
+inline bool TRCBORReader::readtypedhead(const uint8_t*& p, uint8_t& majortype, uint8_t& additionaltype, uint64_t& value)
+{
+	const uint8_t* end = (const uint8_t*)ptr + sizebuffer;
+
+	error = HCBORERR_OK;
+	p = (const uint8_t*)ptr + position;
+	if (p >= end)
+		return false; // конец данных
+
+	if (cbordecodehead(p, end, majortype, additionaltype, value) == false)
+		return failat(additionaltype < 28 ? HCBORERR_TRUNCATED : HCBORERR_INVALIDHEAD, position);
+	return true;
+}
+
+inline bool TRCBORReader::ReadCBORInt64(int64_t& value)
+{
+	const uint8_t* p = (const uint8_t*)ptr + position;
+	if (position < sizebuffer && *p < 24) // быстрый путь: 0..23
+	{
+		error = HCBORERR_OK;
+		value = *p;
+		position++;
+		return true;
+	}
+
+	uint8_t majortype, additionaltype;
+	uint64_t raw;
+	if (readtypedhead(p, majortype, additionaltype, raw) == false)
+		return false;
+	if (majortype > HCBOR_NEGATIVEINTEGER || raw > (uint64_t)INT64_MAX)
+		return failat(HCBORERR_TYPEMISMATCH, position);
+
+	value = majortype == HCBOR_POSITIVEINTEGER ? (int64_t)raw : -1 - (int64_t)raw;
+	position = p - (const uint8_t*)ptr;
+	return true;
+}
+
+inline bool TRCBORReader::ReadCBORUInt64(uint64_t& value)
+{
+	const uint8_t* p = (const uint8_t*)ptr + position;
+	if (position < sizebuffer && *p < 24) // быстрый путь: 0..23
+	{
+		error = HCBORERR_OK;
+		value = *p;
+		position++;
+		return true;
+	}
+
+	uint8_t majortype, additionaltype;
+	if (readtypedhead(p, majortype, additionaltype, value) == false)
+		return false;
+	if (majortype != HCBOR_POSITIVEINTEGER)
+		return failat(HCBORERR_TYPEMISMATCH, position);
+
+	position = p - (const uint8_t*)ptr;
+	return true;
+}
+
+inline bool TRCBORReader::ReadCBORDouble(double& value)
+{
+	const uint8_t* p = (const uint8_t*)ptr + position;
+	if (sizebuffer - position > 8 && *p == 0xfb) // быстрый путь: double целиком в буфере
+	{
+		error = HCBORERR_OK;
+		uint64_t bits = cborload64(p + 1);
+		memcpy(&value, &bits, sizeof(value));
+		position += 9;
+		return true;
+	}
+
+	uint8_t majortype, additionaltype;
+	uint64_t bits;
+	if (readtypedhead(p, majortype, additionaltype, bits) == false)
+		return false;
+	if (majortype != HCBOR_FLOATSIMPLE || additionaltype < 25 || additionaltype > 27)
+		return failat(HCBORERR_TYPEMISMATCH, position);
+
+	if (additionaltype == 27)
+		memcpy(&value, &bits, sizeof(value));
+	else
+	{
+		float f;
+		if (additionaltype == 25)
+			f = cborhalftofloat((uint16_t)bits);
+		else
+		{
+			uint32_t bits32 = (uint32_t)bits;
+			memcpy(&f, &bits32, sizeof(f));
+		}
+		value = f;
+	}
+	position = p - (const uint8_t*)ptr;
+	return true;
+}
+
+inline bool TRCBORReader::ReadCBORBool(bool& value)
+{
+	error = HCBORERR_OK;
+	if (position >= sizebuffer)
+		return false;
+
+	uint8_t byte = ((const uint8_t*)ptr)[position];
+	if (byte != 0xf4 && byte != 0xf5)
+		return failat(HCBORERR_TYPEMISMATCH, position);
+
+	value = byte == 0xf5;
+	position++;
+	return true;
+}
+
+inline bool TRCBORReader::ReadCBORString(TRCBORStringView& value)
+{
+	const uint8_t* p;
+	uint8_t majortype, additionaltype;
+	uint64_t size;
+	if (readtypedhead(p, majortype, additionaltype, size) == false)
+		return false;
+	if (majortype != HCBOR_STRING_UTF8)
+		return failat(HCBORERR_TYPEMISMATCH, position);
+	if (additionaltype == 31)
+		return failat(HCBORERR_UNSUPPORTED, position);
+	if (size > (uint64_t)((const uint8_t*)ptr + sizebuffer - p))
+		return failat(HCBORERR_TRUNCATED, position);
+
+	value.data = (const char*)p;
+	value.size = (size_t)size;
+	position = p + size - (const uint8_t*)ptr;
+	return true;
+}
+
+inline bool TRCBORReader::ReadCBORByteArray(TRCBORBytesView& value)
+{
+	const uint8_t* p;
+	uint8_t majortype, additionaltype;
+	uint64_t size;
+	if (readtypedhead(p, majortype, additionaltype, size) == false)
+		return false;
+	if (majortype != HCBOR_BYTEARRAY)
+		return failat(HCBORERR_TYPEMISMATCH, position);
+	if (additionaltype == 31)
+		return failat(HCBORERR_UNSUPPORTED, position);
+	if (size > (uint64_t)((const uint8_t*)ptr + sizebuffer - p))
+		return failat(HCBORERR_TRUNCATED, position);
+
+	value.data = p;
+	value.size = (size_t)size;
+	position = p + size - (const uint8_t*)ptr;
+	return true;
+}
+
+inline bool TRCBORReader::EnterCBORArray(size_t& count)
+{
+	const uint8_t* p = (const uint8_t*)ptr + position;
+	if (position < sizebuffer && *p >= 0x80 && *p < 0x80 + 24) // быстрый путь: длина в заголовке
+	{
+		error = HCBORERR_OK;
+		count = *p - 0x80;
+		position++;
+		return true;
+	}
+
+	uint8_t majortype, additionaltype;
+	uint64_t value;
+	if (readtypedhead(p, majortype, additionaltype, value) == false)
+		return false;
+	if (majortype != HCBOR_ITEMSARRAY)
+		return failat(HCBORERR_TYPEMISMATCH, position);
+	if (additionaltype != 31 && value > (uint64_t)((const uint8_t*)ptr + sizebuffer - p)) // каждый элемент - минимум байт
+		return failat(HCBORERR_TRUNCATED, position);
+
+	count = additionaltype == 31 ? HCBOROUT_INDEFINITE_SIZE : (size_t)value;
+	position = p - (const uint8_t*)ptr;
+	return true;
+}
+
+inline bool TRCBORReader::EnterCBORMap(size_t& count)
+{
+	const uint8_t* p = (const uint8_t*)ptr + position;
+	if (position < sizebuffer && *p >= 0xa0 && *p < 0xa0 + 24) // быстрый путь: длина в заголовке
+	{
+		error = HCBORERR_OK;
+		count = *p - 0xa0;
+		position++;
+		return true;
+	}
+
+	uint8_t majortype, additionaltype;
+	uint64_t value;
+	if (readtypedhead(p, majortype, additionaltype, value) == false)
+		return false;
+	if (majortype != HCBOR_PAIRSARRAY)
+		return failat(HCBORERR_TYPEMISMATCH, position);
+	if (additionaltype != 31 && value > (uint64_t)((const uint8_t*)ptr + sizebuffer - p) / 2)
+		return failat(HCBORERR_TRUNCATED, position);
+
+	count = additionaltype == 31 ? HCBOROUT_INDEFINITE_SIZE : (size_t)value;
+	position = p - (const uint8_t*)ptr;
+	return true;
+}
+
+inline bool TRCBORReader::ReadCBORStopArrayMarker(void)
+{
+	error = HCBORERR_OK;
+	if (position >= sizebuffer || ((const uint8_t*)ptr)[position] != 0xff)
+		return false;
+
+	position++;
+	return true;
+}
+
+template <class Visitor> bool TRCBORReader::Parse(Visitor& visitor)
+{
+	uint64_t remaining[HCBOR_MAX_NESTING_DEPTH]; // оставшееся количество элементов (не пар) на каждом уровне
+	bool ismap[HCBOR_MAX_NESTING_DEPTH];
+	size_t depth = 0;
+	bool started = false; // начат элемент верхнего уровня (не тег)
+
+	const uint8_t* begin = (const uint8_t*)ptr;
+	const uint8_t* end = begin + sizebuffer;
+	const uint8_t* p = begin + position;
+
+	error = HCBORERR_OK;
+	if (p >= end)
+		return false;
+
+	while (true)
+	{
+		// закрытие заполненных контейнеров определенной длины
+		while (depth > 0 && remaining[depth - 1] == 0)
+		{
+			depth--;
+			if ((ismap[depth] ? visitor.OnMapEnd() : visitor.OnArrayEnd()) == false)
+				return failat(HCBORERR_STOPPED, (size_t)(p - begin));
+		}
+		if (depth == 0 && started)
+			break;
+
+		const uint8_t* head = p;
+		uint8_t majortype, additionaltype;
+		uint64_t value;
+
+		if (p >= end)
+			return failat(HCBORERR_TRUNCATED, (size_t)(head - begin));
+		if (cbordecodehead(p, end, majortype, additionaltype, value) == false)
+			return failat(additionaltype < 28 ? HCBORERR_TRUNCATED : HCBORERR_INVALIDHEAD, (size_t)(head - begin));
+
+		bool indefinite = additionaltype == 31;
+		if (majortype == HCBOR_TAGVALUE)
+		{
+			if (visitor.OnTag(value) == false)
+				return failat(HCBORERR_STOPPED, (size_t)(head - begin));
+			continue;
+		}
+
+		if (indefinite && majortype == HCBOR_FLOATSIMPLE) // break
+		{
+			if (depth == 0 || remaining[depth - 1] != HCBOROUT_INDEFINITE_SIZE)
+				return failat(HCBORERR_UNEXPECTEDBREAK, (size_t)(head - begin));
+			depth--;
+			if ((ismap[depth] ? visitor.OnMapEnd() : visitor.OnArrayEnd()) == false)
+				return failat(HCBORERR_STOPPED, (size_t)(head - begin));
+			continue;
+		}
+
+		started = true;
+		if (depth > 0 && remaining[depth - 1] != HCBOROUT_INDEFINITE_SIZE)
+			remaining[depth - 1]--;
+
+		bool result = true;
+		switch (majortype)
+		{
+		case HCBOR_POSITIVEINTEGER:
+			result = visitor.OnUInt64(value);
+			break;
+		case HCBOR_NEGATIVEINTEGER:
+			if (value > (uint64_t)INT64_MAX)
+				return failat(HCBORERR_UNSUPPORTED, (size_t)(head - begin));
+			result = visitor.OnInt64(-1 - (int64_t)value);
+			break;
+		case HCBOR_BYTEARRAY:
+		case HCBOR_STRING_UTF8:
+			if (indefinite)
+				return failat(HCBORERR_UNSUPPORTED, (size_t)(head - begin));
+			if (value > (uint64_t)(end - p))
+				return failat(HCBORERR_TRUNCATED, (size_t)(head - begin));
+			if (majortype == HCBOR_STRING_UTF8)
+			{
+				TRCBORStringView view = { (const char*)p, (size_t)value };
+				result = visitor.OnString(view);
+			}
+			else
+			{
+				TRCBORBytesView view = { p, (size_t)value };
+				result = visitor.OnBytes(view);
+			}
+			p += value;
+			break;
+		case HCBOR_ITEMSARRAY:
+		case HCBOR_PAIRSARRAY:
+			{
+				bool map = majortype == HCBOR_PAIRSARRAY;
+				uint64_t count = value;
+				if (indefinite == false && (map ? value > (uint64_t)(end - p) / 2 : value > (uint64_t)(end - p))) // каждый элемент - минимум байт
+					return failat(HCBORERR_TRUNCATED, (size_t)(head - begin));
+				if (depth >= HCBOR_MAX_NESTING_DEPTH)
+					return failat(HCBORERR_TOODEEP, (size_t)(head - begin));
+
+				result = map ? visitor.OnMapBegin(indefinite ? HCBOROUT_INDEFINITE_SIZE : (size_t)count) : visitor.OnArrayBegin(indefinite ? HCBOROUT_INDEFINITE_SIZE : (size_t)count);
+				ismap[depth] = map;
+				remaining[depth] = indefinite ? HCBOROUT_INDEFINITE_SIZE : map ? count * 2 : count;
+				depth++;
+			}
+			break;
+		case HCBOR_FLOATSIMPLE:
+			switch (additionaltype)
+			{
+			case 20:
+			case 21:
+				result = visitor.OnBool(additionaltype == 21);
+				break;
+			case 22:
+				result = visitor.OnNull();
+				break;
+			case 23:
+				result = visitor.OnUndefined();
+				break;
+			case 25:
+				result = visitor.OnFloat(cborhalftofloat((uint16_t)value));
+				break;
+			case 26:
+				{
+					uint32_t bits = (uint32_t)value;
+					float f;
+					memcpy(&f, &bits, sizeof(f));
+					result = visitor.OnFloat(f);
+				}
+				break;
+			case 27:
+				{
+					double d;
+					memcpy(&d, &value, sizeof(d));
+					result = visitor.OnDouble(d);
+				}
+				break;
+			default: // simple value
+				return failat(additionaltype == 24 && value < 32 ? HCBORERR_INVALIDHEAD : HCBORERR_UNSUPPORTED, (size_t)(head - begin));
+			}
+			break;
+		}
+
+		if (result == false)
+			return failat(HCBORERR_STOPPED, (size_t)(head - begin));
+	}
+
+	position = (size_t)(p - begin);
+	return true;
+}
+
+// результат TRCBORPushParser::Next
+enum TRHCBORPushStatus
+{
+	HCBORPUSH_VALUE = 0,     // элемент целиком (как ParseCBOR). для строки - последний кусок
+	HCBORPUSH_PARTIAL,       // кусок строки/массива байт, не последний. указатель - внутрь переданного куска данных
+	HCBORPUSH_NEEDMOREDATA,  // текущий кусок разобран полностью, нужен следующий (Feed)
+	HCBORPUSH_ERROR          // GetError/GetErrorOffset
+};
+
+// потоковый (push) разбор: данные подаются кусками по мере поступления (из сокета), разбор продолжается с места остановки
+// состояние - стек вложенности, байты недочитанного заголовка и остаток строки. сообщение целиком не буферизуется
+// строка, не поместившаяся в кусок, отдается частями (HCBORPUSH_PARTIAL ... HCBORPUSH_VALUE) без копирования
+class TRCBORPushParser
+{
+private:
+	const uint8_t* chunk;
+	size_t chunksize;
+	size_t chunkposition;
+	size_t consumed; // байт во всех предыдущих кусках
+
+	uint8_t head[9]; // недочитанный заголовок
+	size_t headsize;
+	size_t headposition; // смещение начала элемента (для ошибок)
+
+	uint64_t stringremaining; // остаток строки, отдаваемой частями
+	TRHCBOROutType stringtype;
+
+	struct level
+	{
+		uint64_t remaining; // остаток элементов (UINT64_MAX - неопределенная длина)
+		bool pairs;
+		bool keypending;    // map неопределенной длины: ключ прочитан, значения еще нет
+	};
+	std::vector<level> stack; // открытые контейнеры
+	bool itempending; // начат элемент (заголовок, тег или строка), но еще не отдан целиком
+	bool tagpending;  // прочитан тег, помеченный элемент еще не начат
+
+	TRHCBORError error;
+	size_t erroroffset;
+
+	void closecontainers(void);
+	TRHCBORPushStatus seterror(TRHCBORError error);
+public:
+	TRCBORPushParser();
+	virtual ~TRCBORPushParser();
+
+	void Reset(void);
+	bool Feed(const void* data, size_t size); // false - предыдущий кусок еще не разобран (не было HCBORPUSH_NEEDMOREDATA)
+	TRHCBORPushStatus Next(TRHCBOROutType& valuetype, void* outvalue, size_t& valuesize); // параметры - как в ParseCBOR
+
+	size_t GetDepth(void) const; // количество открытых контейнеров
+	bool IsComplete(void) const; // элемент верхнего уровня разобран целиком (граница сообщения)
+	uint64_t GetPartialRemaining(void) const; // сколько байт строки еще не отдано
+	TRHCBORError GetError(void) const;
+	size_t GetErrorOffset(void) const; // от начала всех поданных данных
+};
+
+// последовательность элементов CBOR (RFC 8742) из файла, отображенного в память (mmap / MapViewOfFile)
+// элементы выдаются ссылками внутрь отображения без копирования. границы - пропуском элементов, без разбора значений
+// ссылки действительны до Close/Open/SetBuffer/деструктора
+class TRCBORSequenceReader
+{
+private:
+	const uint8_t* data;
+	size_t size;
+	size_t position;
+	bool mapped; // false - буфер вызывающего (SetBuffer)
+#ifdef _WIN32
+	void* filehandle;
+	void* mappinghandle;
+#endif
+
+	TRHCBORError error;
+	size_t erroroffset;
+public:
+	TRCBORSequenceReader();
+	virtual ~TRCBORSequenceReader();
+
+	bool Open(const char* filename); // false - файл не открыт или не отображен в память
+	void SetBuffer(const void* data, size_t size); // последовательность в памяти вызывающего
+	void Close(void);
+
+	// следующий элемент целиком (с вложенными). false - конец данных (GetError() == HCBORERR_OK) или ошибка
+	// CBOR не содержит маркеров синхронизации, поэтому после ошибки чтение не продолжается
+	bool Next(TRCBORBytesView& item);
+
+	const uint8_t* GetData(void) const;
+	size_t GetSize(void) const;
+	size_t GetPosition(void) const;
+	void SetPosition(size_t position); // должна быть границей элемента (например, GetPosition() ранее)
+
+	// деление на куски не меньше chunksize байт по границам элементов, от текущей позиции (позиция не меняется)
+	// boundaries - начала кусков и конец последнего. полный последовательный обход структуры всех элементов (как Validate),
+	// значения не декодируются
+	// false - ошибка в данных, куски покрывают целые элементы до нее
+	bool Split(size_t chunksize, std::vector<size_t>& boundaries);
+
+	TRHCBORError GetError(void) const;
+	size_t GetErrorOffset(void) const;
+};
+
+// обработчик элемента для TRCBORParallelProcessor. вызывается из рабочих потоков, одновременно для разных кусков
+// элементы одного куска - по порядку в одном потоке. false - остановить обработку (HCBORERR_STOPPED)
+typedef bool (*TRCBORItemFunc)(void* userdata, size_t chunkindex, const TRCBORBytesView& item);
+// объединение результата куска для TRCBORParallelProcessor. вызывается после всех элементов куска,
+// строго по порядку номеров кусков (0, 1, 2...) и не одновременно. false - остановить обработку (HCBORERR_STOPPED)
+typedef bool (*TRCBORChunkFunc)(void* userdata, size_t chunkindex);
+
+// параллельная обработка последовательности по кускам (TRCBORSequenceReader::Split)
+// куски зависят только от данных и chunksize, а не от количества потоков, поэтому результаты,
+// накопленные по chunkindex и объединенные обработчиком reduce (по порядку номеров кусков), детерминированы
+class TRCBORParallelProcessor
+{
+private:
+	size_t threadscount;
+	const uint8_t* data;
+	std::vector<size_t> boundaries;
+
+	TRHCBORError error;
+	size_t erroroffset;
+public:
+	TRCBORParallelProcessor(size_t threadscount = 0); // 0 - по количеству ядер
+	virtual ~TRCBORParallelProcessor();
+
+	// деление на куски (TRCBORSequenceReader::Split) - последовательный обход структуры всех данных в одном потоке
+	// данные sequence должны быть живы до окончания Process. false - ошибка в данных, обрабатываться будут целые элементы до нее
+	bool Prepare(TRCBORSequenceReader& sequence, size_t chunksize);
+	size_t GetChunksCount(void) const; // размер массива результатов по кускам
+
+	// обработка всех кусков (можно повторять). reduce (может быть nullptr) - объединение результатов кусков по порядку
+	// false - остановка обработчиком (HCBORERR_STOPPED), reduce к тому времени вызван для первых кусков подряд
+	bool Process(TRCBORItemFunc func, void* userdata, TRCBORChunkFunc reduce = nullptr);
+
+	TRHCBORError GetError(void) const;
+	size_t GetErrorOffset(void) const;
+};
+
+// запись структурного индекса. заполняется одним проходом по буферу
+struct TRCBORTapeEntry
+{
+	size_t offset;          // смещение первого байта элемента в буфере
+	size_t next;            // индекс записи сразу за элементом (со всеми вложенными) - следующий соседний элемент
+	uint64_t value;         // аргумент заголовка: число, длина строки, количество элементов/пар, номер тега, биты float
+	size_t childs;          // массив определенной длины - начало индексов вложенных записей в таблице индекса, иначе SIZE_MAX
+	uint8_t majortype;
+	uint8_t additionaltype; // 31 - неопределенная длина
+};
+
+// структурный индекс (tape) закодированного буфера: элементы в порядке следования, контейнеры знают свой конец
+// переход к соседнему элементу - O(1), к элементу массива определенной длины - O(1), без рекурсии
+// вложенные элементы map - ключ и значение подряд. тег и строка из кусков - контейнеры (помеченный элемент, куски)
+// память записей переиспользуется между вызовами Build. буфер должен жить, пока используется индекс
+class TRCBORTape
+{
+private:
+	std::vector<TRCBORTapeEntry> entries;
+	std::vector<size_t> childs; // индексы вложенных записей массивов определенной длины
+	const uint8_t* buffer;
+	size_t sizebuffer;
+
+	TRHCBORError error;
+	size_t erroroffset;
+public:
+	TRCBORTape();
+	virtual ~TRCBORTape();
+
+	bool Build(const void* ptr, size_t sizebuffer); // false - данные некорректны (GetError/GetErrorOffset)
+	TRHCBORError GetError(void) const;
+	size_t GetErrorOffset(void) const;
+
+	size_t GetCount(void) const;
+	const TRCBORTapeEntry& GetEntry(size_t index) const;
+	const void* GetValuePointer(size_t index) const; // данные строки/массива байт (сразу за заголовком)
+
+	size_t GetChildsCount(size_t index) const; // для неопределенной длины - проход по соседям
+	size_t GetChild(size_t index, size_t childindex) const; // индекс записи вложенного элемента. SIZE_MAX - нет такого
+	size_t Find(const TRCBORPath& path, size_t index = 0) const; // поиск по пути от записи index. SIZE_MAX - не найден
 };
 
 enum TRHCBORObjectType
@@ -141,18 +1301,85 @@ enum TRHCBORObjectType
 	HOBJTYPE_PAIRSARRAY,
 };
 
+// функция освобождения ресурсов объекта, размещенного в арене (деструктор)
+typedef void (*TRCBORArenaCleanup)(void* ptr);
+
+// монотонный распределитель: память выдается из больших блоков подряд и освобождается только целиком
+// деструкторы размещенных объектов не вызываются - для объектов с ресурсами есть AddCleanup
+class TRCBORArena
+{
+private:
+	struct cleanupentry
+	{
+		TRCBORArenaCleanup func;
+		void* ptr;
+		cleanupentry* next;
+	};
+
+	TRCBORAllocator allocator;
+	size_t blocksize;
+
+	std::vector<void*> blocks;      // блоки одного размера, после Reset используются повторно
+	std::vector<void*> largeblocks; // отдельные блоки для больших размеров, освобождаются при Reset
+	size_t blockindex;              // текущий блок
+	uint8_t* pointer;               // свободное место в текущем блоке
+	uint8_t* blockend;
+	cleanupentry* cleanups;
+
+	void* allocateslow(size_t size);
+	void runcleanups(void);
+public:
+	TRCBORArena(size_t blocksize = 64 * 1024);
+	TRCBORArena(const TRCBORAllocator& allocator, size_t blocksize = 64 * 1024);
+	virtual ~TRCBORArena();
+
+	inline void* Allocate(size_t size); // выравнивание 8 байт. распределитель вернул nullptr - std::bad_alloc (как у std::vector)
+	void AddCleanup(TRCBORArenaCleanup func, void* ptr); // вызывается при Reset/Clear/деструкторе (в обратном порядке)
+
+	void Reset(void); // освобождение всего выделенного разом. блоки остаются для следующего документа
+	void Clear(void); // как Reset, но блоки возвращаются распределителю
+	size_t GetBlocksSize(void) const; // память, занятая блоками
+};
+
+inline void* TRCBORArena::Allocate(size_t size)
+{
+	size = (size + 7) & ~(size_t)7;
+	if ((size_t)(blockend - pointer) < size)
+		return allocateslow(size);
+
+	void* result = pointer;
+	pointer += size;
+	return result;
+}
+
 class TRCBORObject
 {
 	friend class TRCBORObjectModel;
 private:
-	std::vector<TRCBORObject*> Childs;
+	// все объекты модели, списки вложенных и байты строк размещаются в арене модели
+	TRCBORObject** Childs;
+	size_t ChildsCount;
 
+	uint8_t buffervalue[8]; // выровнен на 8 (читается как int64_t/double)
 	TRHCBORObjectType ObjectType;
+	bool largeunsigned; // HOBJTYPE_INT64 больше INT64_MAX: в buffervalue биты uint64_t (для Serialize)
 
-	uint8_t buffervalue[8];
-	std::string Utf8Value;
-	void* bytearray;
+	// индекс ключей map для GetMember: хэши ключей по порядку пар, у больших map - еще таблица открытой адресации
+	struct TRCBORMemberIndex
+	{
+		uint32_t* hashes;
+		uint32_t* slots; // номер пары + 1, 0 - пусто. nullptr - поиск перебором хэшей
+		uint32_t mask;
+	};
+
+	union
+	{
+		void* bytearray;                 // байтовый массив (в исходном буфере) или строка (в арене или в исходном буфере)
+		TRCBORMemberIndex* memberindex;  // map - создается при первом GetMember
+	};
 	size_t bytearraysize;
+	std::string* Utf8Value; // создается при первом AsString, дальше значение строки берется из него
+	TRCBORArena* arena;     // nullptr - объект вне модели
 public:
 	TRCBORObject();
 	virtual ~TRCBORObject();	
@@ -160,7 +1387,8 @@ public:
 	size_t GetChildsCount(void);
 	TRCBORObject* GetChild(size_t index);
 
-	std::string& AsString(void);
+	std::string& AsString(void); // изменяемая копия строки
+	TRCBORStringView AsStringView(void); // без копирования (в арене или в исходном буфере). действительна до повторного разбора модели
 	int32_t AsInt32(void);
 	int64_t AsInt64(void);
 	float AsFloat(void);
@@ -169,26 +1397,200 @@ public:
 
 	bool GetByteArray(void **ptr, size_t &size);
 
+	// значение map по ключу (строковому или целому). nullptr - ключа нет или объект не map
+	// при первом поиске строится индекс хэшей ключей. ключи, измененные через AsString после этого, не находятся
+	TRCBORObject* GetMember(const char* key);
+	TRCBORObject* GetMember(const char* key, size_t keysize);
+	TRCBORObject* GetMember(int64_t key);
+	TRCBORObject* GetMember(int32_t key);
+
 	TRHCBORObjectType GetType(void);
+
+	size_t GetCBORSize(void); // точный размер объекта (с вложенными) в CBOR
+	void Serialize(TRCBORWriter& writer); // запись объекта (с вложенными) в CBOR. память выделяется один раз
+private:
+	uint8_t* encodeCBOR(uint8_t* p); // запись без проверок памяти
+	TRCBORMemberIndex* buildmemberindex(void);
+	bool matchkey(size_t pairindex, const char* key, size_t keysize, int64_t intkey);
+	TRCBORObject* findmember(uint32_t hash, const char* key, size_t keysize, int64_t intkey); // key == nullptr - целый ключ
 };
 
 class TRCBORObjectModel
 {
 private:
 	TRCBORReader reader;
+	std::shared_ptr<const void> bufferhandle; // исходный буфер, если модель его удерживает
+	bool zerocopy; // строки - ссылки в исходный буфер, без копирования в арену
+	TRCBORArena arena; // объекты документа. освобождаются разом при повторном разборе и в деструкторе
 	std::vector<TRCBORObject*> Childs;
-	
-	void Parse(std::vector<TRCBORObject*> &Childs, int32_t waitcount);
+	std::vector<TRCBORObject*> parsestack; // вложенные объекты незакрытых массивов при разборе
+
+	TRHCBORError error;
+	size_t erroroffset;
+
+	TRCBORObject* newobject(TRHCBORObjectType objecttype);
+	bool Parse(TRCBORObject** &childs, size_t &childscount, size_t waitcount, size_t depth, bool pairs);
+	bool fail(TRHCBORError error, size_t offset);
 public:
 	TRCBORObjectModel();
 	virtual ~TRCBORObjectModel();
 
-	void SetBuffer(void* ptr, size_t sizebuffer);
+	// буфер вызывающего. zerocopy - строки без копирования, буфер должен быть жив, пока используются объекты
+	void SetBuffer(void* ptr, size_t sizebuffer, bool zerocopy = false);
+	// буфер с подсчетом ссылок (можно передать владение: std::shared_ptr<const void>(ptr, free))
+	// модель удерживает буфер до следующего SetBuffer/деструктора, строки - без копирования
+	void SetBuffer(const std::shared_ptr<const void>& buffer, size_t sizebuffer);
+	std::shared_ptr<const void> GetBufferHandle(void) const; // продлить жизнь буфера (для ссылок на строки и массивы)
 
-	void Parse(void);
+	bool Parse(void); // объекты предыдущего разбора освобождаются. false - ошибка в данных, массивы содержат объекты до нее
 
 	size_t GetChildsCount(void);
 	TRCBORObject* GetChild(size_t index);
+
+	size_t GetCBORSize(void); // точный размер всех объектов в CBOR
+	void Serialize(TRCBORWriter& writer); // запись всех объектов в CBOR. память выделяется один раз
+
+	TRHCBORError GetError(void) const;
+	size_t GetErrorOffset(void) const;
+};
+
+
+// узел компактной модели - 16 байт. вложенные узлы контейнера лежат подряд в общем массиве модели
+// строки и байтовые массивы не копируются - ссылки в исходный буфер (буфер должен быть жив)
+class TRCBORFlatObject
+{
+	friend class TRCBORFlatModel;
+	friend class TRCBORLazyModel;
+private:
+	uint64_t value;  // число, биты float, указатель на строку/массив, у контейнера - смещение первого вложенного от себя (в узлах)
+	uint32_t size;   // длина строки/массива, количество вложенных (для map - ключи и значения)
+	uint8_t type;    // TRHCBORObjectType
+	uint8_t reserved[3];
+
+	bool setvalue(TRHCBOROutType valuetype, uint64_t outvalue, size_t valuesize); // значение не контейнера из ParseCBOR
+public:
+	size_t GetChildsCount(void) const;
+	const TRCBORFlatObject* GetChild(size_t index) const;
+
+	std::string AsString(void) const;
+	TRCBORStringView AsStringView(void) const;
+	int32_t AsInt32(void) const;
+	int64_t AsInt64(void) const;
+	float AsFloat(void) const;
+	double AsDouble(void) const;
+	bool AsBool(void) const;
+
+	bool GetByteArray(const void** ptr, size_t& size) const;
+
+	TRHCBORObjectType GetType(void) const;
+};
+
+// компактная объектная модель: все узлы документа в одном массиве по 16 байт (без указателей между узлами)
+// только для чтения. строки и массивы - до 4 Гб, элементов в контейнере - до 2^32
+class TRCBORFlatModel
+{
+private:
+	TRCBORReader reader;
+	std::shared_ptr<const void> bufferhandle; // исходный буфер, если модель его удерживает
+	std::vector<TRCBORFlatObject> nodes;
+	std::vector<TRCBORFlatObject> parsestack; // вложенные узлы незакрытых контейнеров при разборе
+	size_t rootindex;
+	size_t rootcount;
+
+	TRHCBORError error;
+	size_t erroroffset;
+
+	bool Parse(size_t waitcount, size_t depth, bool pairs, size_t& first, size_t& count);
+	bool fail(TRHCBORError error, size_t offset);
+public:
+	TRCBORFlatModel();
+	virtual ~TRCBORFlatModel();
+
+	void SetBuffer(void* ptr, size_t sizebuffer); // буфер должен быть жив, пока используются узлы
+	void SetBuffer(const std::shared_ptr<const void>& buffer, size_t sizebuffer); // буфер удерживается моделью
+	std::shared_ptr<const void> GetBufferHandle(void) const;
+
+	bool Parse(void); // узлы предыдущего разбора освобождаются. false - ошибка в данных, контейнеры содержат узлы до нее
+
+	size_t GetChildsCount(void) const;
+	const TRCBORFlatObject* GetChild(size_t index) const; // действителен до следующего разбора
+	size_t GetNodesCount(void) const; // всего узлов (с вложенными)
+
+	TRHCBORError GetError(void) const;
+	size_t GetErrorOffset(void) const;
+};
+
+class TRCBORLazyModel;
+
+// узел ленивой модели. вложенные элементы контейнера разбираются по мере обращения (до нужного индекса)
+class TRCBORLazyObject
+{
+	friend class TRCBORLazyModel;
+private:
+	TRCBORFlatObject scalar;   // значение (у контейнера - только тип)
+	TRCBORLazyModel* model;
+	TRCBORLazyObject** Childs; // разобранные вложенные
+	size_t capacity;
+	size_t parsedcount;
+	size_t ChildsCount;        // из заголовка (для map - ключи и значения), HCBOROUT_INDEFINITE_SIZE - до break
+	size_t position;           // смещение следующего вложенного, при skippending - начало последнего разобранного контейнера
+	bool skippending;          // конец последнего разобранного вложенного контейнера еще не найден
+	bool complete;             // разобраны все вложенные, position - конец контейнера
+	bool failed;               // ошибка в данных - вложенные только до нее
+public:
+	size_t GetChildsCount(void); // у контейнера определенной длины - из заголовка, без разбора
+	TRCBORLazyObject* GetChild(size_t index); // nullptr - нет элемента или ошибка в данных до него
+	bool IsComplete(void) const; // разобраны все вложенные (у не контейнера - всегда true)
+
+	std::string AsString(void) const;
+	TRCBORStringView AsStringView(void) const;
+	int32_t AsInt32(void) const;
+	int64_t AsInt64(void) const;
+	float AsFloat(void) const;
+	double AsDouble(void) const;
+	bool AsBool(void) const;
+
+	bool GetByteArray(const void** ptr, size_t& size) const;
+
+	TRHCBORObjectType GetType(void) const;
+};
+
+// ленивая объектная модель: Parse ничего не разбирает, у контейнера запоминается только начало вложенных
+// вложенные разбираются при обращении, вложенные контейнеры до нужного элемента пропускаются (SkipValue)
+// стоимость разбора - по объему пройденных данных, а не всего документа. только для чтения
+// проверяются тоже только пройденные данные: ошибка в непросмотренной части не обнаруживается
+class TRCBORLazyModel
+{
+	friend class TRCBORLazyObject;
+private:
+	TRCBORReader reader;
+	std::shared_ptr<const void> bufferhandle; // исходный буфер, если модель его удерживает
+	TRCBORArena arena; // узлы и массивы вложенных
+	TRCBORLazyObject root; // элементы верхнего уровня
+	size_t nodescount;
+
+	TRHCBORError error;
+	size_t erroroffset;
+
+	bool parsechild(TRCBORLazyObject* object);
+	bool fail(TRCBORLazyObject* object, TRHCBORError error, size_t offset);
+public:
+	TRCBORLazyModel();
+	virtual ~TRCBORLazyModel();
+
+	void SetBuffer(void* ptr, size_t sizebuffer); // буфер должен быть жив, пока используются узлы
+	void SetBuffer(const std::shared_ptr<const void>& buffer, size_t sizebuffer); // буфер удерживается моделью
+	std::shared_ptr<const void> GetBufferHandle(void) const;
+
+	void Parse(void); // узлы предыдущего разбора освобождаются. сам разбор - при обращении к узлам
+
+	size_t GetChildsCount(void);
+	TRCBORLazyObject* GetChild(size_t index); // действителен до следующего разбора
+	size_t GetNodesCount(void) const; // разобрано узлов (с вложенными) - растет по мере обращений
+
+	// первая ошибка в данных при разборе (с Parse). контейнер с ошибкой содержит элементы до нее
+	TRHCBORError GetError(void) const;
+	size_t GetErrorOffset(void) const;
 };
 
 
@@ -1,4 +1,17 @@
 #include <gtest/gtest.h>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#endif
 
 #include "stdafx.h"
 
@@ -45,7 +58,7 @@ TEST(TRCBORWriter, Write16U)
 
 	writer.Write16U(0xFA73);
 
-	uint16_t value = *(uint16_t*)p;
+	uint16_t value = cborload16(p); // big endian
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 2);
 	ASSERT_EQ(writer.Size() - s, 2);
@@ -59,10 +72,11 @@ TEST(TRCBORWriter, Write32U)
 
 	writer.Write32U(0xE4589A73);
 
-	uint32_t value = *(uint32_t*)p;
+	uint32_t value = cborload32(p); // big endian
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 4);
 	ASSERT_EQ(writer.Size() - s, 4);
+	ASSERT_EQ(((uint8_t*)p)[0], 0xE4);
 	ASSERT_EQ(value, 0xE4589A73);
 }
 
@@ -73,7 +87,7 @@ TEST(TRCBORWriter, Write64U)
 
 	writer.Write64U(0xE4589A73A9E4E721);
 
-	uint64_t value = *(uint64_t*)p;
+	uint64_t value = cborload64(p); // big endian
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 8);
 	ASSERT_EQ(writer.Size() - s, 8);
@@ -106,7 +120,7 @@ TEST(TRCBORWriter, Write16I)
 
 	writer.Write16I(-31789);
 
-	int16_t value = *(int16_t*)p;
+	int16_t value = (int16_t)cborload16(p);
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 2);
 	ASSERT_EQ(writer.Size() - s, 2);
@@ -120,7 +134,7 @@ TEST(TRCBORWriter, Write32I)
 
 	writer.Write32I(-1948179606);
 
-	uint32_t value = *(uint32_t*)p;
+	uint32_t value = cborload32(p);
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 4);
 	ASSERT_EQ(writer.Size() - s, 4);
@@ -134,7 +148,7 @@ TEST(TRCBORWriter, Write64I)
 
 	writer.Write64I(-8750173327307698552);
 
-	uint64_t value = *(uint64_t*)p;
+	uint64_t value = cborload64(p); // big endian
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 8);
 	ASSERT_EQ(writer.Size() - s, 8);
@@ -148,7 +162,9 @@ TEST(TRCBORWriter, Write32F)
 
 	writer.Write32F(-0.44567342f);
 
-	float value = *(float*)p;
+	uint32_t bits = cborload32(p);
+	float value;
+	memcpy(&value, &bits, 4);
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 4);
 	ASSERT_EQ(writer.Size() - s, 4);
@@ -162,7 +178,9 @@ TEST(TRCBORWriter, Write64F)
 
 	writer.Write64F(-0.44567342);
 
-	double value = *(double*)p;
+	uint64_t bits = cborload64(p);
+	double value;
+	memcpy(&value, &bits, 8);
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 8);
 	ASSERT_EQ(writer.Size() - s, 8);
@@ -234,29 +252,31 @@ TEST(TRCBORWriter, WriteCBORValue32)
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 2);
 	ASSERT_EQ(writer.Size() - s, 2);
-	ASSERT_EQ(value16, 0x7018); // 0x70 -  0x18 -  uint8_t
+	ASSERT_EQ(value16, 0x7018); // 0x70 - число 0x18 - тип uint8_t
 
 	p = writer.GetCurrentPointer();
 	s = writer.Size();
 
 	writer.WriteCBORValue(0x7090);
 
-	uint32_t value32 = ((uint8_t*)p)[0] | ((uint8_t*)p)[1] << 8 | ((uint8_t*)p)[2] << 16;
+	uint32_t value32 = ((uint8_t*)p)[0] << 16 | ((uint8_t*)p)[1] << 8 | ((uint8_t*)p)[2];
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 3);
 	ASSERT_EQ(writer.Size() - s, 3);
-	ASSERT_EQ(value32, 0x709019); // 0x9070 -  0x19 -  uint16_t
+	ASSERT_EQ(value32, 0x197090); // 0x19 - тип uint16_t, 0x7090 - число (big endian)
 
 	p = writer.GetCurrentPointer();
 	s = writer.Size();
 
 	writer.WriteCBORValue(-4577834);
 
-	uint64_t value64 = *(uint32_t*)p | (uint64_t)(((uint8_t*)p)[4]) << 32;
+	uint8_t valuesign = *(uint8_t*)p;
+	uint64_t value64 = cborload32((uint8_t*)p + 1);
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 5);
 	ASSERT_EQ(writer.Size() - s, 5);
-	ASSERT_EQ(value64, 0x45DA293a); // 0x45DA29 -  0x3a -  uint16_t   
+	ASSERT_EQ(valuesign, 0x3a); // 0x3a - тип uint32_t И отрицательный знак
+	ASSERT_EQ(value64, 0x45DA29); // 0x45DA29 - число (-1 - n)
 }
 
 TEST(TRCBORWriter, WriteCBORValue64)
@@ -281,37 +301,39 @@ TEST(TRCBORWriter, WriteCBORValue64)
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 2);
 	ASSERT_EQ(writer.Size() - s, 2);
-	ASSERT_EQ(value16, 0x5518); // 0x55 -  0x18 -  uint8_t
+	ASSERT_EQ(value16, 0x5518); // 0x55 - число 0x18 - тип uint8_t
 
 	p = writer.GetCurrentPointer();
 	s = writer.Size();
 
 	writer.WriteCBORValue(0x7495);
 
-	uint32_t value32 = ((uint8_t*)p)[0] | ((uint8_t*)p)[1] << 8 | ((uint8_t*)p)[2] << 16;
+	uint32_t value32 = ((uint8_t*)p)[0] << 16 | ((uint8_t*)p)[1] << 8 | ((uint8_t*)p)[2];
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 3);
 	ASSERT_EQ(writer.Size() - s, 3);
-	ASSERT_EQ(value32, 0x749519); // 0x9574 -  0x19 -  uint16_t
+	ASSERT_EQ(value32, 0x197495); // 0x19 - тип uint16_t, 0x7495 - число (big endian)
 
 	p = writer.GetCurrentPointer();
 	s = writer.Size();
 
 	writer.WriteCBORValue(-4577834);
 
-	uint64_t value64 = *(uint32_t*)p | (uint64_t)(((uint8_t*)p)[4]) << 32;
+	uint8_t valuesign = *(uint8_t*)p;
+	uint64_t value64 = cborload32((uint8_t*)p + 1);
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 5);
 	ASSERT_EQ(writer.Size() - s, 5);
-	ASSERT_EQ(value64, 0x45DA293a); // 0x45DA29 -  0x3a -  uint16_t   
+	ASSERT_EQ(valuesign, 0x3a); // 0x3a - тип uint32_t И отрицательный знак
+	ASSERT_EQ(value64, 0x45DA29); // 0x45DA29 - число (-1 - n)
 
 	p = writer.GetCurrentPointer();
 	s = writer.Size();
 
 	writer.WriteCBORValue(0x1122334455667788);
 
-	uint8_t valuesign = *(uint8_t*)p;
-	value64 = *(uint64_t*)((uint8_t*)p + 1);
+	valuesign = *(uint8_t*)p;
+	value64 = cborload64((uint8_t*)p + 1);
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 9);
 	ASSERT_EQ(writer.Size() - s, 9);
@@ -376,7 +398,7 @@ TEST(TRCBORWriter, WriteCBORWString)
 	void *p = writer.GetCurrentPointer();
 	uint32_t s = writer.Size();
 
-	std::wstring test = L" ";
+	std::wstring test = L"Тестовая строка";
 	writer.WriteCBORString(test);
 
 	uint16_t valuesign = *(uint16_t*)p;
@@ -400,7 +422,9 @@ TEST(TRCBORWriter, WriteCBORFloat32)
 	writer.WriteCBORFloat(104.5623344f);
 
 	uint8_t valuesign = *(uint8_t*)p;
-	float value32 = *(float*)((uint8_t*)p + 1);
+	uint32_t bits32 = cborload32((uint8_t*)p + 1);
+	float value32;
+	memcpy(&value32, &bits32, 4);
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 5);
 	ASSERT_EQ(writer.Size() - s, 5);
@@ -416,7 +440,9 @@ TEST(TRCBORWriter, WriteCBORFloat64)
 	writer.WriteCBORFloat(10445645624.56423423423344);
 
 	uint8_t valuesign = *(uint8_t*)p;
-	double value64 = *(double*)((uint8_t*)p + 1);
+	uint64_t bits64 = cborload64((uint8_t*)p + 1);
+	double value64;
+	memcpy(&value64, &bits64, 8);
 
 	ASSERT_EQ((uint8_t*)writer.GetCurrentPointer() - (uint8_t*)p, 9);
 	ASSERT_EQ(writer.Size() - s, 9);
@@ -506,6 +532,21 @@ TEST(TRCBORWriter, WriteCBORPairsArrayMarker)
 	ASSERT_EQ(value, 0xA4);
 }
 
+TEST(TRCBORWriter, LargeArrayMarker)
+{
+	TRCBORWriter localwriter;
+
+	// количество - полные 64 бита, неопределенная длина - только без параметра
+	localwriter.WriteCBORItemsArrayMarker(UINT32_MAX);
+	localwriter.WriteCBORPairsArrayMarker((uint64_t)UINT32_MAX + 1);
+	localwriter.WriteCBORItemsArrayMarker();
+	localwriter.WriteCBORPairsArrayMarker();
+
+	const uint8_t expected[] = { 0x9a, 0xff, 0xff, 0xff, 0xff, 0xbb, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x9f, 0xbf };
+	ASSERT_EQ(localwriter.Size(), sizeof(expected));
+	ASSERT_TRUE(0 == std::memcmp(localwriter.Pointer(), expected, sizeof(expected)));
+}
+
 TEST(TRCBORWriter, WriteCBORStopArrayMarker)
 {
 	void *p = writer.GetCurrentPointer();
@@ -520,6 +561,675 @@ TEST(TRCBORWriter, WriteCBORStopArrayMarker)
 	ASSERT_EQ(value, 0xff);
 }
 
+TEST(TRCBORWriter, WriteCBORArray)
+{
+	int32_t values32[] = { 0, 1, 23, 24, 255, 256, 65535, 65536, INT32_MAX, -1, -24, -25, -256, -257, -65536, -65537, INT32_MIN };
+	int64_t values64[] = { 0, 23, 24, 65536, 0xffffffff, 0x100000000, INT64_MAX, -1, -25, -0x100000000, -0x100000001, INT64_MIN };
+	float valuesf[] = { 0.0f, -1.5f, 3.25e10f };
+	double valuesd[] = { 0.0, -1.5, 3.25e100 };
+
+	TRCBORWriter bulkwriter, itemwriter;
+
+	bulkwriter.WriteCBORArray(values32, sizeof(values32) / sizeof(int32_t));
+	bulkwriter.WriteCBORArray(values64, sizeof(values64) / sizeof(int64_t));
+	bulkwriter.WriteCBORArray(valuesf, sizeof(valuesf) / sizeof(float));
+	bulkwriter.WriteCBORArray(valuesd, sizeof(valuesd) / sizeof(double));
+
+	itemwriter.WriteCBORItemsArrayMarker(sizeof(values32) / sizeof(int32_t));
+	for (auto& it : values32)
+		itemwriter.WriteCBORValue(it);
+	itemwriter.WriteCBORItemsArrayMarker(sizeof(values64) / sizeof(int64_t));
+	for (auto& it : values64)
+		itemwriter.WriteCBORValue(it);
+	itemwriter.WriteCBORItemsArrayMarker(sizeof(valuesf) / sizeof(float));
+	for (auto& it : valuesf)
+		itemwriter.WriteCBORFloat(it);
+	itemwriter.WriteCBORItemsArrayMarker(sizeof(valuesd) / sizeof(double));
+	for (auto& it : valuesd)
+		itemwriter.WriteCBORFloat(it);
+
+	ASSERT_EQ(bulkwriter.Size(), itemwriter.Size());
+	ASSERT_TRUE(0 == std::memcmp(bulkwriter.Pointer(), itemwriter.Pointer(), bulkwriter.Size()));
+
+	// больше одного блока
+	std::vector<int32_t> bigarray(5000);
+	for (size_t i = 0; i < bigarray.size(); ++i)
+		bigarray[i] = (int32_t)(i * i) - 100000;
+
+	bulkwriter.Clear();
+	bulkwriter.WriteCBORArray(bigarray.data(), bigarray.size());
+
+	TRCBORObjectModel CBOR;
+	CBOR.SetBuffer(bulkwriter.Pointer(), bulkwriter.Size());
+	CBOR.Parse();
+
+	TRCBORObject* Object = CBOR.GetChild(0);
+	ASSERT_EQ(Object->GetChildsCount(), bigarray.size());
+	for (size_t i = 0; i < bigarray.size(); ++i)
+		ASSERT_EQ(Object->GetChild(i)->AsInt32(), bigarray[i]);
+}
+
+TEST(TRCBORWriter, WriteCBORShortestFloat)
+{
+	TRCBORWriter localwriter;
+	localwriter.SetShortestFloat(true);
+
+	struct
+	{
+		double value;
+		size_t size;
+	} samples[] = {
+		{ 0.0, 3 }, { -0.0, 3 }, { 1.5, 3 }, { -2.0, 3 }, { 65504.0, 3 }, { 5.960464477539063e-8, 3 }, { 0.00006103515625, 3 },
+		{ 65520.0, 5 }, { 100000.0, 5 }, { 0.1f, 5 }, { 3.4028234663852886e+38, 5 }, { 1.401298464324817e-45, 5 },
+		{ 0.1, 9 }, { 1.0e300, 9 }, { 1.0e-300, 9 }, { INFINITY, 3 }, { -INFINITY, 3 }
+	};
+
+	for (auto& it : samples)
+	{
+		localwriter.Clear();
+		localwriter.WriteCBORFloat(it.value);
+		ASSERT_EQ(localwriter.Size(), it.size) << it.value;
+
+		TRCBORObjectModel CBOR;
+		CBOR.SetBuffer(localwriter.Pointer(), localwriter.Size());
+		CBOR.Parse();
+		ASSERT_EQ(CBOR.GetChild(0)->AsDouble(), it.value);
+		ASSERT_EQ(std::signbit(CBOR.GetChild(0)->AsDouble()), std::signbit(it.value));
+	}
+
+	localwriter.Clear();
+	localwriter.WriteCBORFloat(1.5f);
+	uint8_t f16sample[] = { 0xf9, 0x3e, 0x00 }; // 1.5, big endian
+	ASSERT_TRUE(0 == std::memcmp(localwriter.Pointer(), f16sample, sizeof(f16sample)));
+
+	localwriter.Clear();
+	localwriter.WriteCBORFloat(NAN);
+	ASSERT_EQ(localwriter.Size(), 3);
+
+	TRCBORObjectModel CBOR;
+	CBOR.SetBuffer(localwriter.Pointer(), localwriter.Size());
+	CBOR.Parse();
+	ASSERT_TRUE(std::isnan(CBOR.GetChild(0)->AsFloat()));
+}
+
+TEST(TRCBORWriter, HalfToFloat)
+{
+	std::vector<uint16_t> halfs;
+	for (uint32_t i = 0; i < 0x10000; ++i)
+		halfs.push_back((uint16_t)i);
+
+	std::vector<float> floats(halfs.size());
+	cborhalftofloat(halfs.data(), floats.data(), halfs.size());
+
+	for (size_t i = 0; i < halfs.size(); ++i)
+	{
+		float value = cborhalftofloat(halfs[i]);
+		if (value != value)
+		{
+			ASSERT_TRUE(floats[i] != floats[i]);
+			continue;
+		}
+		ASSERT_EQ(value, floats[i]);
+
+		uint16_t half;
+		ASSERT_TRUE(cborfloattohalf(value, half));
+		ASSERT_EQ(half, halfs[i]);
+	}
+}
+
+TEST(TRCBORWriter, Deterministic)
+{
+	TRCBORWriter writer1, writer2;
+
+	// пример из RFC 8949 4.2.1 - ключи разных типов
+	writer1.WriteCBORPairsArrayMarker(8);
+		writer1.WriteCBORBool(false);
+		writer1.WriteCBORValue(8);
+		writer1.WriteCBORItemsArrayMarker(1);
+			writer1.WriteCBORValue(-1);
+		writer1.WriteCBORValue(7);
+		writer1.WriteCBORItemsArrayMarker(1);
+			writer1.WriteCBORValue(100);
+		writer1.WriteCBORValue(6);
+		writer1.WriteCBORString("aa");
+		writer1.WriteCBORValue(5);
+		writer1.WriteCBORString("z");
+		writer1.WriteCBORValue(4);
+		writer1.WriteCBORValue(-1);
+		writer1.WriteCBORValue(3);
+		writer1.WriteCBORValue(100);
+		writer1.WriteCBORValue(2);
+		writer1.WriteCBORValue(10);
+		writer1.WriteCBORFloat(1.5); // float 64-bit
+
+	// то же самое в другом порядке, неопределенной длины и с неминимальными заголовками
+	writer2.WriteCBORPairsArrayMarker();
+		writer2.WriteCBORValue(10);
+		writer2.WriteCBORFloat(1.5f);
+		writer2.WriteCBORString("z");
+		writer2.Write8U(0x18); // 4 в виде uint8_t
+		writer2.Write8U(4);
+		writer2.WriteCBORItemsArrayMarker();
+			writer2.WriteCBORValue(100);
+		writer2.WriteCBORStopArrayMarker();
+		writer2.WriteCBORValue(6);
+		writer2.WriteCBORValue(100);
+		writer2.WriteCBORValue(2);
+		writer2.WriteCBORValue(-1);
+		writer2.WriteCBORValue(3);
+		writer2.WriteCBORString("aa");
+		writer2.WriteCBORValue(5);
+		writer2.WriteCBORItemsArrayMarker(1);
+			writer2.WriteCBORValue(-1);
+		writer2.WriteCBORValue(7);
+		writer2.WriteCBORBool(false);
+		writer2.WriteCBORValue(8);
+	writer2.WriteCBORStopArrayMarker();
+
+	ASSERT_TRUE(writer1.MakeDeterministic());
+	ASSERT_TRUE(writer2.MakeDeterministic());
+
+	uint8_t eqsample[] = { 0xa8,
+		0x0a, 0xf9, 0x3e, 0x00, // 10: 1.5 (float 16-bit)
+		0x18, 0x64, 0x02,       // 100: 2
+		0x20, 0x03,             // -1: 3
+		0x61, 0x7a, 0x04,       // "z": 4
+		0x62, 0x61, 0x61, 0x05, // "aa": 5
+		0x81, 0x18, 0x64, 0x06, // [100]: 6
+		0x81, 0x20, 0x07,       // [-1]: 7
+		0xf4, 0x08 };           // false: 8
+
+	ASSERT_EQ(writer1.Size(), sizeof(eqsample));
+	ASSERT_TRUE(0 == std::memcmp(writer1.Pointer(), eqsample, sizeof(eqsample)));
+	ASSERT_EQ(writer2.Size(), writer1.Size());
+	ASSERT_TRUE(0 == std::memcmp(writer1.Pointer(), writer2.Pointer(), writer1.Size()));
+
+	// повторяющиеся ключи
+	writer1.Clear();
+	writer1.WriteCBORPairsArrayMarker(2);
+		writer1.WriteCBORString("a");
+		writer1.WriteCBORValue(1);
+		writer1.WriteCBORString("a");
+		writer1.WriteCBORValue(2);
+	ASSERT_FALSE(writer1.MakeDeterministic());
+
+	// обрезанные данные
+	writer1.Clear();
+	writer1.WriteCBORItemsArrayMarker(3);
+		writer1.WriteCBORValue(1);
+	ASSERT_FALSE(writer1.MakeDeterministic());
+
+	// простое значение меньше 32 в двухбайтовой форме недопустимо
+	uint8_t badsimple[] = { 0x81, 0xf8, 0x10 };
+	writer1.Clear();
+	ASSERT_FALSE(writer1.WriteCBORDeterministic(badsimple, sizeof(badsimple)));
+	ASSERT_EQ(writer1.Size(), 0);
+
+	// вложенные map и строки из кусков: {"b": {2: 0, 1: 0}, "a": (_ h'01', h'0203')}
+	uint8_t nested[] = { 0xa2,
+		0x61, 0x62, 0xa2, 0x02, 0x00, 0x01, 0x00,
+		0x61, 0x61, 0x5f, 0x41, 0x01, 0x42, 0x02, 0x03, 0xff };
+	uint8_t nestedsample[] = { 0xa2,
+		0x61, 0x61, 0x43, 0x01, 0x02, 0x03,
+		0x61, 0x62, 0xa2, 0x01, 0x00, 0x02, 0x00 };
+	ASSERT_TRUE(writer1.WriteCBORDeterministic(nested, sizeof(nested)));
+	ASSERT_EQ(writer1.Size(), sizeof(nestedsample));
+	ASSERT_TRUE(0 == std::memcmp(writer1.Pointer(), nestedsample, sizeof(nestedsample)));
+
+	// повторяющийся ключ во вложенной map откатывает запись
+	uint8_t nestedduplicate[] = { 0xa1, 0x01, 0xa2, 0x02, 0x00, 0x02, 0x01 };
+	ASSERT_FALSE(writer1.WriteCBORDeterministic(nestedduplicate, sizeof(nestedduplicate)));
+	ASSERT_EQ(writer1.Size(), sizeof(nestedsample));
+
+	// сегментированный писатель: запись поддерживается, преобразование записанного - нет
+	TRCBORSegmentedWriter segwriter(1024, 256);
+	ASSERT_TRUE(segwriter.WriteCBORDeterministic(nested, sizeof(nested)));
+	ASSERT_FALSE(segwriter.MakeDeterministic());
+
+	size_t count;
+	const TRCBORSegment* segments = segwriter.GetSegments(count);
+	ASSERT_EQ(count, 1);
+	ASSERT_EQ(segments[0].size, sizeof(nestedsample));
+	ASSERT_TRUE(0 == std::memcmp(segments[0].data, nestedsample, sizeof(nestedsample)));
+}
+
+TEST(TRCBORWriter, BeginEndCBORArray)
+{
+	TRCBORWriter scopewriter, countwriter;
+
+	size_t counts[] = { 0, 5, 23, 24, 300, 70000 };
+
+	for (auto& count : counts)
+	{
+		size_t position = scopewriter.BeginCBORPairsArray();
+		countwriter.WriteCBORPairsArrayMarker(2);
+
+		scopewriter.WriteCBORString("items");
+		countwriter.WriteCBORString("items");
+		{
+			TRCBORArrayScope array(scopewriter);
+			countwriter.WriteCBORItemsArrayMarker(count);
+			for (size_t i = 0; i < count; ++i)
+			{
+				scopewriter.WriteCBORValue((int32_t)i);
+				countwriter.WriteCBORValue((int32_t)i);
+				array.Add();
+			}
+		}
+
+		scopewriter.WriteCBORString("known");
+		countwriter.WriteCBORString("known");
+		size_t knownposition = scopewriter.BeginCBORItemsArray();
+		countwriter.WriteCBORItemsArrayMarker(2);
+			scopewriter.WriteCBORNull();
+			countwriter.WriteCBORNull();
+			scopewriter.WriteCBORBool(true);
+			countwriter.WriteCBORBool(true);
+		ASSERT_TRUE(scopewriter.EndCBORArray(knownposition, 2));
+
+		ASSERT_TRUE(scopewriter.EndCBORArray(position, 2));
+	}
+
+	ASSERT_EQ(scopewriter.Size(), countwriter.Size());
+	ASSERT_TRUE(0 == std::memcmp(scopewriter.Pointer(), countwriter.Pointer(), scopewriter.Size()));
+
+	// неверная позиция
+	ASSERT_FALSE(scopewriter.EndCBORArray(scopewriter.Size() - 3, 1));
+	ASSERT_FALSE(scopewriter.EndCBORArray(SIZE_MAX, 1));
+
+	// позиция внутри данных, повторное завершение и закрытие не в том порядке
+	scopewriter.Clear();
+	size_t outer = scopewriter.BeginCBORItemsArray();
+	scopewriter.WriteCBORString("0123456789");
+	size_t inner = scopewriter.BeginCBORItemsArray();
+	scopewriter.WriteCBORValue(1);
+	ASSERT_FALSE(scopewriter.EndCBORArray(outer + 9, 1));
+	ASSERT_TRUE(scopewriter.EndCBORArray(outer, 2)); // внешний раньше вложенного - вложенный сдвинут
+	ASSERT_FALSE(scopewriter.EndCBORArray(inner, 1));
+	ASSERT_FALSE(scopewriter.EndCBORArray(outer, 2));
+}
+
+TEST(TRCBORWriter, ArrayScope)
+{
+	TRCBORWriter scopewriter, countwriter;
+
+	// вложенные области: map из массивов, в каждом массиве - map
+	{
+		TRCBORArrayScope root(scopewriter, true);
+		countwriter.WriteCBORPairsArrayMarker(3);
+		for (int i = 0; i < 3; ++i)
+		{
+			scopewriter.WriteCBORValue(i);
+			countwriter.WriteCBORValue(i);
+			{
+				TRCBORArrayScope items(scopewriter);
+				countwriter.WriteCBORItemsArrayMarker(i * 20);
+				for (int j = 0; j < i * 20; ++j)
+				{
+					TRCBORArrayScope pairs(scopewriter, true);
+					countwriter.WriteCBORPairsArrayMarker(1);
+					scopewriter.WriteCBORString("j");
+					countwriter.WriteCBORString("j");
+					scopewriter.WriteCBORValue(j);
+					countwriter.WriteCBORValue(j);
+					pairs.Add();
+					items.Add();
+				}
+				ASSERT_EQ(items.GetCount(), (uint64_t)(i * 20));
+			}
+			root.Add();
+		}
+
+		// досрочное завершение, повторное - ошибка
+		TRCBORWriter emptywriter;
+		TRCBORArrayScope empty(emptywriter);
+		ASSERT_TRUE(empty.End());
+		ASSERT_FALSE(empty.End());
+		ASSERT_EQ(emptywriter.Size(), 1);
+		ASSERT_EQ(*(uint8_t*)emptywriter.Pointer(), 0x80);
+	}
+
+	ASSERT_EQ(scopewriter.Size(), countwriter.Size());
+	ASSERT_TRUE(0 == std::memcmp(scopewriter.Pointer(), countwriter.Pointer(), scopewriter.Size()));
+
+	// сегментированный писатель: резервирование заголовка не поддерживается
+	TRCBORSegmentedWriter segwriter(1024, 256);
+	ASSERT_EQ(segwriter.BeginCBORItemsArray(), SIZE_MAX);
+	ASSERT_EQ(segwriter.Size(), 0);
+	{
+		TRCBORArrayScope array(segwriter);
+		segwriter.WriteCBORValue(1);
+		array.Add();
+		ASSERT_FALSE(array.End());
+	}
+	ASSERT_EQ(segwriter.Size(), 1);
+	ASSERT_FALSE(segwriter.EndCBORArray(0, 1));
+}
+
+TEST(TRCBORWriter, Reserve)
+{
+	TRCBORWriter localwriter;
+
+	localwriter.Reserve(100000);
+	ASSERT_GE(localwriter.Capacity(), 100000);
+
+	void *p = localwriter.Pointer();
+	for (int i = 0; i < 100000; ++i)
+		localwriter.Write8U(i & 0xff);
+
+	ASSERT_EQ(localwriter.Pointer(), p);
+	ASSERT_EQ(localwriter.Size(), 100000);
+}
+
+struct TestAllocatorStat
+{
+	int reallocs;
+	int frees;
+};
+
+static void* testrealloc(void* userdata, void* ptr, size_t size)
+{
+	((TestAllocatorStat*)userdata)->reallocs++;
+	return realloc(ptr, size);
+}
+
+static void testfree(void* userdata, void* ptr)
+{
+	((TestAllocatorStat*)userdata)->frees++;
+	free(ptr);
+}
+
+TEST(TRCBORWriter, Allocator)
+{
+	TestAllocatorStat stat = { 0, 0 };
+	TRCBORAllocator allocator = { testrealloc, testfree, &stat };
+
+	{
+		TRCBORWriter localwriter(allocator);
+
+		for (int i = 0; i < 1000000; ++i)
+			localwriter.WriteCBORValue(1000);
+
+		ASSERT_EQ(localwriter.Size(), 3000000);
+		ASSERT_LT(stat.reallocs, 50); // рост буфера геометрический
+	}
+
+	ASSERT_EQ(stat.frees, 1);
+}
+
+TEST(TRCBORWriter, RetainSize)
+{
+	TRCBORWriter localwriter;
+
+	localwriter.Reserve(1024 * 100);
+	localwriter.Clear();
+	ASSERT_EQ(localwriter.Capacity(), 1024 * 10);
+
+	localwriter.SetRetainSize(SIZE_MAX);
+	localwriter.Reserve(1024 * 100);
+	localwriter.Clear();
+	ASSERT_EQ(localwriter.Capacity(), 1024 * 100);
+	ASSERT_EQ(localwriter.Size(), 0);
+}
+
+TEST(TRCBORSegmentedWriter, Segments)
+{
+	TRCBORSegmentedWriter segwriter(1024, 256);
+	TRCBORWriter flatwriter;
+
+	std::vector<uint8_t> blob(100000);
+	for (size_t i = 0; i < blob.size(); ++i)
+		blob[i] = (uint8_t)(i * 7);
+
+	uint8_t smallblob[] = { 1, 2, 3, 4, 5 };
+
+	for (int i = 0; i < 3; ++i)
+	{
+		segwriter.WriteCBORItemsArrayMarker(3);
+		flatwriter.WriteCBORItemsArrayMarker(3);
+		for (int j = 0; j < 500; ++j)
+		{
+			segwriter.WriteCBORValue(j * 1000);
+			flatwriter.WriteCBORValue(j * 1000);
+		}
+		segwriter.WriteCBORByteArrayRef(blob.data(), blob.size());
+		flatwriter.WriteCBORByteArray(blob.data(), blob.size());
+		segwriter.WriteCBORByteArrayRef(smallblob, sizeof(smallblob));
+		flatwriter.WriteCBORByteArray(smallblob, sizeof(smallblob));
+	}
+
+	ASSERT_EQ(segwriter.Size(), flatwriter.Size());
+
+	size_t count;
+	const TRCBORSegment* segments = segwriter.GetSegments(count);
+
+	size_t total = 0;
+	int external = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		ASSERT_TRUE(0 == std::memcmp(segments[i].data, (uint8_t*)flatwriter.Pointer() + total, segments[i].size));
+		if (segments[i].data == blob.data())
+			external++;
+		total += segments[i].size;
+	}
+	ASSERT_EQ(total, flatwriter.Size());
+	ASSERT_EQ(external, 3); // большой буфер не копировался
+
+	std::vector<uint8_t> copy(segwriter.Size());
+	segwriter.CopyTo(copy.data());
+	ASSERT_TRUE(0 == std::memcmp(copy.data(), flatwriter.Pointer(), copy.size()));
+
+	segwriter.Clear();
+	ASSERT_EQ(segwriter.Size(), 0);
+	segments = segwriter.GetSegments(count);
+	ASSERT_EQ(count, 0);
+}
+
+static bool testsink(void* userdata, const void* data, size_t size)
+{
+	std::vector<uint8_t>* out = (std::vector<uint8_t>*)userdata;
+	out->insert(out->end(), (const uint8_t*)data, (const uint8_t*)data + size);
+	return true;
+}
+
+TEST(TRCBORStreamWriter, Callback)
+{
+	std::vector<uint8_t> out;
+	TRCBORWriter flatwriter;
+
+	{
+		TRCBORStreamWriter streamwriter(testsink, &out, 1024);
+
+		std::string bigstring(5000, 'a');
+
+		streamwriter.WriteCBORItemsArrayMarker();
+		flatwriter.WriteCBORItemsArrayMarker();
+		for (int i = 0; i < 100000; ++i)
+		{
+			streamwriter.WriteCBORValue(i);
+			flatwriter.WriteCBORValue(i);
+			ASSERT_LE(streamwriter.Capacity(), 1024);
+		}
+		streamwriter.WriteCBORString(bigstring);
+		flatwriter.WriteCBORString(bigstring);
+		streamwriter.WriteCBORValue(1);
+		flatwriter.WriteCBORValue(1);
+		streamwriter.WriteCBORStopArrayMarker();
+		flatwriter.WriteCBORStopArrayMarker();
+
+		ASSERT_EQ(streamwriter.Size(), flatwriter.Size());
+		ASSERT_TRUE(streamwriter.Flush());
+		ASSERT_LE(streamwriter.Capacity(), 1024);
+	}
+
+	ASSERT_EQ(out.size(), flatwriter.Size());
+	ASSERT_TRUE(0 == std::memcmp(out.data(), flatwriter.Pointer(), out.size()));
+}
+
+// массив чисел и больших строк (больше буфера потокового писателя и буфера канала)
+static void writestreamitems(TRCBORWriter& localwriter, int count)
+{
+	std::string bigstring(200000, 'b');
+
+	localwriter.WriteCBORItemsArrayMarker();
+	for (int i = 0; i < count; ++i)
+	{
+		localwriter.WriteCBORValue(i);
+		if (i % 10000 == 0)
+			localwriter.WriteCBORString(bigstring);
+	}
+	localwriter.WriteCBORStopArrayMarker();
+}
+
+static int openstreamfile(const char* filename, bool readonly)
+{
+#ifdef _WIN32
+	return readonly ? _open(filename, _O_RDONLY | _O_BINARY) : _open(filename, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	return readonly ? open(filename, O_RDONLY) : open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+}
+
+static void closestreamfile(int fd)
+{
+#ifdef _WIN32
+	_close(fd);
+#else
+	close(fd);
+#endif
+}
+
+TEST(TRCBORStreamWriter, File)
+{
+	const char* filename = "cborstream.tmp";
+	TRCBORWriter flatwriter;
+	writestreamitems(flatwriter, 100000);
+
+	int fd = openstreamfile(filename, false);
+	ASSERT_GE(fd, 0);
+	{
+		TRCBORStreamWriter streamwriter(fd, 1024);
+		writestreamitems(streamwriter, 100000);
+		ASSERT_EQ(streamwriter.Size(), flatwriter.Size());
+		ASSERT_TRUE(streamwriter.Flush());
+		ASSERT_FALSE(streamwriter.IsError());
+	}
+	closestreamfile(fd);
+
+	std::vector<uint8_t> out(flatwriter.Size() + 1);
+	FILE* file = fopen(filename, "rb");
+	ASSERT_NE(file, nullptr);
+	size_t readsize = fread(out.data(), 1, out.size(), file);
+	fclose(file);
+	remove(filename);
+
+	ASSERT_EQ(readsize, flatwriter.Size());
+	ASSERT_TRUE(0 == std::memcmp(out.data(), flatwriter.Pointer(), readsize));
+}
+
+TEST(TRCBORStreamWriter, FileError)
+{
+	const char* filename = "cborstream.tmp";
+
+	FILE* file = fopen(filename, "wb");
+	ASSERT_NE(file, nullptr);
+	fclose(file);
+
+	// запись в дескриптор только для чтения - ошибка при первом сбросе
+	int fd = openstreamfile(filename, true);
+	ASSERT_GE(fd, 0);
+	{
+		TRCBORStreamWriter streamwriter(fd, 64);
+		for (int i = 0; i < 2000; ++i)
+			streamwriter.WriteCBORValue(1000000);
+		ASSERT_TRUE(streamwriter.IsError());
+		ASSERT_FALSE(streamwriter.Flush());
+		ASSERT_EQ(streamwriter.Size(), 10000); // данные после ошибки отбрасываются, но учитываются в размере
+
+		// Clear сбрасывает ошибку, повторная ошибка - снова при сбросе
+		streamwriter.Clear();
+		ASSERT_FALSE(streamwriter.IsError());
+		streamwriter.WriteCBORValue(1);
+		ASSERT_FALSE(streamwriter.Flush());
+	}
+	closestreamfile(fd);
+	remove(filename);
+}
+
+#ifndef _WIN32
+static volatile sig_atomic_t alarmscount = 0;
+
+static void onstreamalarm(int)
+{
+	alarmscount = alarmscount + 1;
+}
+
+TEST(TRCBORStreamWriter, PipeInterrupted)
+{
+	int fds[2];
+	ASSERT_EQ(pipe(fds), 0);
+
+	TRCBORWriter flatwriter;
+	writestreamitems(flatwriter, 100000);
+
+	// сигнал без SA_RESTART прерывает заблокированный write: частичная запись или EINTR
+	struct sigaction action, oldaction;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = onstreamalarm;
+	sigemptyset(&action.sa_mask);
+	ASSERT_EQ(sigaction(SIGALRM, &action, &oldaction), 0);
+
+	// читатель медленный (канал заполнен, запись блокируется) и сигнал не получает
+	sigset_t alarmset, oldset;
+	sigemptyset(&alarmset);
+	sigaddset(&alarmset, SIGALRM);
+	pthread_sigmask(SIG_BLOCK, &alarmset, &oldset);
+
+	std::vector<uint8_t> out;
+	std::thread readerthread([&]()
+	{
+		uint8_t buffer[4096];
+		while (true)
+		{
+			ssize_t res = read(fds[0], buffer, sizeof(buffer));
+			if (res < 0 && errno == EINTR)
+				continue;
+			if (res <= 0)
+				break;
+			out.insert(out.end(), buffer, buffer + res);
+			std::this_thread::sleep_for(std::chrono::microseconds(20));
+		}
+	});
+	pthread_sigmask(SIG_SETMASK, &oldset, nullptr);
+
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 500;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_REAL, &timer, nullptr);
+
+	bool flushed;
+	{
+		TRCBORStreamWriter streamwriter(fds[1], 256 * 1024);
+		writestreamitems(streamwriter, 100000);
+		flushed = streamwriter.Flush();
+	}
+
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_REAL, &timer, nullptr);
+	sigaction(SIGALRM, &oldaction, nullptr);
+
+	close(fds[1]);
+	readerthread.join();
+	close(fds[0]);
+
+	ASSERT_TRUE(flushed);
+	ASSERT_GT(alarmscount, 0);
+	ASSERT_EQ(out.size(), flatwriter.Size());
+	ASSERT_TRUE(0 == std::memcmp(out.data(), flatwriter.Pointer(), out.size()));
+}
+#endif
+
 //////////////////////////////////////////////////////////////////////////////
 // Test TRCBORReader
 
@@ -528,15 +1238,15 @@ TEST(TRCBORReader, ReadStream)
 /*
 	create JSON stream
 	{
-		Name: Adolf
-		Age : 44
-		Data :
+		“Name”: “Adolf”
+		“Age” : 44
+		“Data” :
 		{
-			Subdata1: kikoz1,
-			Subdata2 : kikoz2,
-			Subdata3 : 88
+			“Subdata1”: “kikoz1”,
+			“Subdata2” : “kikoz2”,
+			“Subdata3” : 88
 		}
-		Array: [10, 20, 30, false, true]
+		“Array”: [10, 20, 30, false, true]
 	}
 */
 	writer.Clear();
@@ -573,7 +1283,7 @@ TEST(TRCBORReader, ReadStream)
 	// read stream
 	TRHCBOROutType valuetype;
 	uint64_t outvalue;
-	uint32_t valuesize;
+	size_t valuesize;
 
 	int nestinglevel = 0;
 	int pairnumber = 0, subpairnumber = 0;
@@ -631,7 +1341,7 @@ TEST(TRCBORReader, ReadStream)
 		case HCBOROUT_BYTEARRAY:
 			break;
 		case HCBOROUT_STRING_UTF8:
-			utf8str = std::string((char*)(outvalue & 0xffffffff), valuesize);
+			utf8str = std::string((char*)(uintptr_t)outvalue, valuesize);
 			if (nestinglevel == 1)
 			{
 				if (pairnumber == 0)
@@ -737,86 +1447,1330 @@ TEST(TRCBORReader, ReadStream)
 		case HCBOROUT_ENDARRAY_MARKER:
 			nestinglevel--;
 			break;
+		default:
+			break;
 		}
 	}
 }
 
 
-//////////////////////////////////////////////////////////////////////////////
-// Test TRCBORObjectModel
+TEST(TRCBORReader, Truncated)
+{
+	TRCBORReader localreader;
+	TRHCBOROutType valuetype;
+	uint64_t outvalue;
+	size_t valuesize;
+
+	// строка длиной 10, в буфере только 3 байта
+	uint8_t shortstring[] = { 0x01, 0x6a, 'a', 'b', 'c' };
+	localreader.SetBuffer(shortstring, sizeof(shortstring));
+	ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_FALSE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_TRUNCATED);
+	ASSERT_EQ(localreader.GetErrorOffset(), 1);
+	ASSERT_EQ(localreader.GetPosition(), 1);
+
+	// заголовок uint32_t обрезан
+	uint8_t shorthead[] = { 0x1a, 0x00, 0x01 };
+	localreader.SetBuffer(shorthead, sizeof(shorthead));
+	ASSERT_FALSE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_TRUNCATED);
+	ASSERT_EQ(localreader.GetErrorOffset(), 0);
+
+	// массив на 1000 элементов в 3 байтах
+	uint8_t bigarray[] = { 0x99, 0x03, 0xe8 };
+	localreader.SetBuffer(bigarray, sizeof(bigarray));
+	ASSERT_FALSE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_TRUNCATED);
+
+	// зарезервированный additional type
+	uint8_t reserved[] = { 0x1c };
+	localreader.SetBuffer(reserved, sizeof(reserved));
+	ASSERT_FALSE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_INVALIDHEAD);
+
+	// отрицательное меньше -2^63 не помещается в int64_t, -2^63 - граница
+	uint8_t negative[] = { 0x3b, 0x7f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0x3b, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+	localreader.SetBuffer(negative, sizeof(negative));
+	ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(valuetype, HCBOROUT_INT64);
+	ASSERT_EQ((int64_t)outvalue, INT64_MIN);
+	ASSERT_FALSE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_UNSUPPORTED);
+	ASSERT_EQ(localreader.GetErrorOffset(), 9);
+
+	// тег без обработчика - маркер перед элементом, конец данных - не ошибка
+	uint8_t tagged[] = { 0xc1, 0x1a, 0x5f, 0x5e, 0x10, 0x00 };
+	localreader.SetBuffer(tagged, sizeof(tagged));
+	ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(valuetype, HCBOROUT_TAG_MARKER);
+	ASSERT_EQ(outvalue, 1);
+	ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(valuetype, HCBOROUT_INT);
+	ASSERT_EQ(outvalue & 0xffffffff, 0x5f5e1000);
+	ASSERT_FALSE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_OK);
+
+	// тег без элемента
+	localreader.SetBuffer(tagged, 1);
+	ASSERT_FALSE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_TRUNCATED);
+}
 
-TEST(TRCBORObjectModel, Strings)
+// пользовательский обработчик: тег 40000 - массив [x, y] в одно число x * 1000 + y
+static bool pointtaghandler(TRCBORReader& reader, uint64_t /*tag*/, TRHCBOROutType& valuetype, void* outvalue, size_t& valuesize, void* userdata)
 {
-	writer.Clear();
+	uint64_t item;
+	int32_t values[2];
 
-	char* strarr[] = { "Name", "Adolf", "Age", "Data", "Subdata1", "kikoz1", "Subdata2", "kikoz2", "Subdata3", "Array" };
-	
-	for (int i = 0; i < sizeof(strarr)/sizeof(char*); ++i)	
-	{ 
-		writer.WriteCBORString(strarr[i]);
+	(*(int*)userdata)++;
+	if (reader.ParseCBOR(valuetype, &item, valuesize) == false || valuetype != HCBOROUT_ITEMSARRAY_MARKER || valuesize != 2)
+		return false;
+	for (auto& it : values)
+	{
+		if (reader.ParseCBOR(valuetype, &item, valuesize) == false || valuetype != HCBOROUT_INT)
+			return false;
+		it = (int32_t)item;
 	}
-	
-	TRCBORObjectModel CBOR;
-	CBOR.SetBuffer(writer.Pointer(), writer.Size());
-	CBOR.Parse();
 
-	TRCBORObject* Object;
+	*(int32_t*)outvalue = values[0] * 1000 + values[1];
+	valuesize = 4;
+	valuetype = HCBOROUT_INT;
+	return true;
+}
 
-	size_t count = CBOR.GetChildsCount();
-	ASSERT_EQ(count, sizeof(strarr)/sizeof(char*));
+TEST(TRCBORReader, Tags)
+{
+	TRCBORReader localreader;
+	TRHCBOROutType valuetype;
+	uint64_t outvalue;
+	size_t valuesize;
+	uint8_t bignum[] = { 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }; // 2^64
+	uint8_t embedded[] = { 0x82, 0x01, 0x02 };
 
-	for (size_t i = 0; i < count; ++i)
+	writer.Clear();
+	writer.WriteCBORTag(0);
+	writer.WriteCBORString("2013-03-21T20:04:00Z");
+	writer.WriteCBORTag(0);
+	writer.WriteCBORString("2013-03-21T22:04:00.5+02:00");
+	writer.WriteCBORTag(1);
+	writer.WriteCBORValue(1363896240);
+	writer.WriteCBORTag(1);
+	writer.WriteCBORFloat(1363896240.5);
+	writer.WriteCBORTag(1);
+	writer.WriteCBORValue((int64_t)-5000000000);
+	writer.WriteCBORTag(2);
+	writer.WriteCBORByteArray(bignum, sizeof(bignum));
+	writer.WriteCBORTag(3);
+	writer.WriteCBORByteArray(bignum, sizeof(bignum));
+	writer.WriteCBORTag(24);
+	writer.WriteCBORByteArray(embedded, sizeof(embedded));
+	writer.WriteCBORTag(40000);
+	writer.WriteCBORItemsArrayMarker(2);
+		writer.WriteCBORValue(12);
+		writer.WriteCBORValue(34);
+	writer.WriteCBORTag(55799); // без обработчика
+	writer.WriteCBORNull();
+
+	int pointcalls = 0;
+	localreader.RegisterStandardTagHandlers();
+	localreader.RegisterTagHandler(40000, pointtaghandler, &pointcalls);
+	localreader.SetBuffer(writer.Pointer(), writer.Size());
+
+	double expected[] = { 1363896240.0, 1363896240.5, 1363896240.0, 1363896240.5, -5000000000.0 };
+	double seconds;
+	for (auto& it : expected)
 	{
-		Object = CBOR.GetChild(i);
+		ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+		ASSERT_EQ(valuetype, HCBOROUT_DATETIME);
+		memcpy(&seconds, &outvalue, 8);
+		ASSERT_EQ(seconds, it);
+	}
 
-		ASSERT_EQ(strarr[i], Object->AsString());
+	ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(valuetype, HCBOROUT_BIGNUM);
+	ASSERT_EQ(valuesize, sizeof(bignum));
+	ASSERT_TRUE(0 == memcmp((void*)(uintptr_t)outvalue, bignum, sizeof(bignum)));
+	ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(valuetype, HCBOROUT_NEGATIVEBIGNUM);
+
+	// вложенный CBOR разбирается отдельным читателем
+	ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(valuetype, HCBOROUT_EMBEDDED_CBOR);
+	TRCBORReader embeddedreader;
+	embeddedreader.SetBuffer((void*)(uintptr_t)outvalue, valuesize);
+	ASSERT_TRUE(embeddedreader.Validate());
+	ASSERT_TRUE(embeddedreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(valuetype, HCBOROUT_ITEMSARRAY_MARKER);
+
+	ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(valuetype, HCBOROUT_INT);
+	ASSERT_EQ(outvalue & 0xffffffff, 12034);
+	ASSERT_EQ(pointcalls, 1);
+
+	ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(valuetype, HCBOROUT_TAG_MARKER);
+	ASSERT_EQ(outvalue, 55799);
+	ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(valuetype, HCBOROUT_NULL);
+	ASSERT_FALSE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_OK);
+
+	// содержимое не подходит обработчику - позиция на теге
+	uint8_t baddate[] = { 0xc0, 0x63, 'a', 'b', 'c' };
+	localreader.SetBuffer(baddate, sizeof(baddate));
+	ASSERT_FALSE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_INVALIDTAG);
+	ASSERT_EQ(localreader.GetPosition(), 0);
+
+	// длина месяца с учетом високосного года
+	TRCBORWriter datewriter;
+	const char* baddates[] = { "2024-02-31T00:00:00Z", "2023-02-29T00:00:00Z", "1900-02-29T00:00:00Z", "2024-04-31T00:00:00Z" };
+	for (auto& it : baddates)
+	{
+		datewriter.Clear();
+		datewriter.WriteCBORTag(0);
+		datewriter.WriteCBORString(it);
+		localreader.SetBuffer(datewriter.Pointer(), datewriter.Size());
+		ASSERT_FALSE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+		ASSERT_EQ(localreader.GetError(), HCBORERR_INVALIDTAG);
 	}
-	
+	datewriter.Clear();
+	datewriter.WriteCBORTag(0);
+	datewriter.WriteCBORString("2000-02-29T00:00:00Z");
+	localreader.SetBuffer(datewriter.Pointer(), datewriter.Size());
+	ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	memcpy(&seconds, &outvalue, 8);
+	ASSERT_EQ(seconds, 951782400.0);
+
+	// цепочка тегов 24 ограничена по вложенности
+	std::vector<uint8_t> chain;
+	for (int i = 0; i < 2000; ++i)
+	{
+		chain.push_back(0xd8);
+		chain.push_back(24);
+	}
+	chain.push_back(0x40);
+	localreader.SetBuffer(chain.data(), chain.size());
+	ASSERT_FALSE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_TOODEEP);
+
+	// обработчик удаляется
+	localreader.RegisterTagHandler(40000, nullptr);
+	localreader.RegisterTagHandler(0, nullptr);
+	localreader.SetBuffer(writer.Pointer(), writer.Size());
+	ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(valuetype, HCBOROUT_TAG_MARKER);
 }
 
-TEST(TRCBORObjectModel, Integers)
+TEST(TRCBORReader, Validate)
 {
+	TRCBORReader localreader;
+	uint8_t bytes[] = { 1, 2, 3 };
+
 	writer.Clear();
+	writer.WriteCBORPairsArrayMarker();
+		writer.WriteCBORString("a");
+		writer.WriteCBORItemsArrayMarker(2);
+			writer.WriteCBORFloat(1.5);
+			writer.WriteCBORString("bc");
+		writer.WriteCBORString("d");
+		writer.WriteCBORByteArray(bytes, sizeof(bytes));
+	writer.WriteCBORStopArrayMarker();
+	writer.WriteCBORValue(-1000); // второй элемент последовательности
 
-	int values[] = { -10, -20, -30, 10, 20, 30 };
+	localreader.SetBuffer(writer.Pointer(), writer.Size());
+	ASSERT_TRUE(localreader.Validate());
+	ASSERT_EQ(localreader.GetPosition(), 0);
 
-	for (int i = 0; i < sizeof(values)/sizeof(int); ++i)
+	// любая обрезка - ошибка
+	for (size_t size = 1; size < writer.Size() - 3; ++size)
 	{
-		writer.WriteCBORValue(values[i]);
+		localreader.SetBuffer(writer.Pointer(), size);
+		ASSERT_FALSE(localreader.Validate());
+		ASSERT_EQ(localreader.GetError(), HCBORERR_TRUNCATED);
 	}
 
-	TRCBORObjectModel CBOR;
-	CBOR.SetBuffer(writer.Pointer(), writer.Size());
-	CBOR.Parse();
-
-	TRCBORObject* Object;
+	// строка из кусков
+	uint8_t chunks[] = { 0x7f, 0x61, 'a', 0x62, 'b', 'c', 0xff };
+	localreader.SetBuffer(chunks, sizeof(chunks));
+	ASSERT_TRUE(localreader.Validate());
+
+	uint8_t badchunk[] = { 0x7f, 0x61, 'a', 0x41, 'b', 0xff };
+	localreader.SetBuffer(badchunk, sizeof(badchunk));
+	ASSERT_FALSE(localreader.Validate());
+	ASSERT_EQ(localreader.GetError(), HCBORERR_INVALIDCHUNK);
+	ASSERT_EQ(localreader.GetErrorOffset(), 3);
+
+	// break посреди пары
+	uint8_t oddmap[] = { 0xbf, 0x01, 0x02, 0x03, 0xff };
+	localreader.SetBuffer(oddmap, sizeof(oddmap));
+	ASSERT_FALSE(localreader.Validate());
+	ASSERT_EQ(localreader.GetError(), HCBORERR_UNEXPECTEDBREAK);
+	ASSERT_EQ(localreader.GetErrorOffset(), 4);
+
+	// break вне контейнера неопределенной длины
+	uint8_t straybreak[] = { 0x81, 0xff };
+	localreader.SetBuffer(straybreak, sizeof(straybreak));
+	ASSERT_FALSE(localreader.Validate());
+	ASSERT_EQ(localreader.GetError(), HCBORERR_UNEXPECTEDBREAK);
+
+	// simple value < 32 в двух байтах
+	uint8_t badsimple[] = { 0xf8, 0x10 };
+	localreader.SetBuffer(badsimple, sizeof(badsimple));
+	ASSERT_FALSE(localreader.Validate());
+	ASSERT_EQ(localreader.GetError(), HCBORERR_INVALIDHEAD);
+
+	// слишком глубокая вложенность
+	std::vector<uint8_t> deep(100000, 0x81);
+	deep.push_back(0x00);
+	localreader.SetBuffer(deep.data(), deep.size());
+	ASSERT_FALSE(localreader.Validate());
+	ASSERT_EQ(localreader.GetError(), HCBORERR_TOODEEP);
+}
 
-	size_t count = CBOR.GetChildsCount();
-	ASSERT_EQ(count, sizeof(values) / sizeof(int));
+TEST(TRCBORReader, SkipValue)
+{
+	TRCBORReader localreader;
+	TRHCBOROutType valuetype;
+	uint64_t outvalue;
+	size_t valuesize;
+	uint8_t bytes[1000] = { 0 };
 
-	for (size_t i = 0; i < count; ++i)
+	writer.Clear();
+	writer.WriteCBORPairsArrayMarker(5);
+		writer.WriteCBORString("nested");
+		writer.WriteCBORPairsArrayMarker(2);
+			writer.WriteCBORString("a");
+			writer.WriteCBORItemsArrayMarker(3);
+				writer.WriteCBORValue(1);
+				writer.WriteCBORFloat(2.5);
+				writer.WriteCBORString("three");
+			writer.WriteCBORString("b");
+			writer.WriteCBORBool(true);
+		writer.WriteCBORString("bytes");
+		writer.WriteCBORByteArray(bytes, sizeof(bytes));
+		writer.WriteCBORString("indefinite");
+		writer.WriteCBORItemsArrayMarker();
+			writer.WriteCBORPairsArrayMarker();
+				writer.WriteCBORValue(1);
+				writer.WriteCBORValue(2);
+			writer.WriteCBORStopArrayMarker();
+			writer.WriteCBORValue(-100000);
+		writer.WriteCBORStopArrayMarker();
+		writer.WriteCBORString("want");
+		writer.WriteCBORValue(42);
+		writer.WriteCBORString("last");
+		writer.WriteCBORNull();
+
+	localreader.SetBuffer(writer.Pointer(), writer.Size());
+	ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_EQ(valuetype, HCBOROUT_PAIRSARRAY_MARKER);
+	ASSERT_EQ(valuesize, 5);
+
+	int found = 0;
+	for (size_t i = 0; i < 5; ++i)
 	{
-		Object = CBOR.GetChild(i);
-
-		int32_t v = Object->AsInt32();
-
-		ASSERT_EQ(values[i], v);
+		ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+		ASSERT_EQ(valuetype, HCBOROUT_STRING_UTF8);
+		if (std::string((char*)(uintptr_t)outvalue, valuesize) == "want")
+		{
+			ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+			ASSERT_EQ(valuetype, HCBOROUT_INT);
+			ASSERT_EQ(outvalue & 0xffffffff, 42);
+			found++;
+		}
+		else
+			ASSERT_TRUE(localreader.SkipValue());
+	}
+	ASSERT_EQ(found, 1);
+	ASSERT_EQ(localreader.GetPosition(), writer.Size());
+	ASSERT_FALSE(localreader.SkipValue());
+	ASSERT_EQ(localreader.GetError(), HCBORERR_OK);
+
+	// обрезанный вложенный элемент - позиция не меняется
+	localreader.SetBuffer(writer.Pointer(), 20);
+	ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+	size_t position = localreader.GetPosition();
+	ASSERT_FALSE(localreader.SkipValue());
+	ASSERT_EQ(localreader.GetError(), HCBORERR_TRUNCATED);
+	ASSERT_EQ(localreader.GetPosition(), position);
+	ASSERT_GT(localreader.GetErrorOffset(), position);
+
+	// скаляры и строки: обрезанная строка, simple value < 32 в двух байтах, зарезервированный заголовок, break
+	uint8_t scalars[] = { 0x1b, 0, 0, 0, 0, 0, 0, 0, 1, 0x62, 0x61, 0x62, 0xf8, 0x20, 0xf9, 0x3c, 0x00 };
+	localreader.SetBuffer(scalars, sizeof(scalars));
+	for (int i = 0; i < 4; ++i)
+		ASSERT_TRUE(localreader.SkipValue());
+	ASSERT_EQ(localreader.GetPosition(), sizeof(scalars));
+
+	uint8_t badscalars[][3] = { { 0x63, 0x61, 0x62 }, { 0xf8, 0x10, 0x00 }, { 0x1c, 0x00, 0x00 }, { 0xff, 0x00, 0x00 } };
+	TRHCBORError baderrors[] = { HCBORERR_TRUNCATED, HCBORERR_INVALIDHEAD, HCBORERR_INVALIDHEAD, HCBORERR_UNEXPECTEDBREAK };
+	for (int i = 0; i < 4; ++i)
+	{
+		localreader.SetBuffer(badscalars[i], sizeof(badscalars[i]));
+		ASSERT_FALSE(localreader.SkipValue());
+		ASSERT_EQ(localreader.GetError(), baderrors[i]);
+		ASSERT_EQ(localreader.GetPosition(), 0);
 	}
-
 }
 
-TEST(TRCBORObjectModel, Integers64)
+// {"device": {"name": "sensor", "readings": [{"value": 0.0}, ... {"value": 2.5 * i}], "a/b": 7, 10: "ten"}}
+static void writedevice(TRCBORWriter& localwriter, size_t readingscount, bool indefinite)
 {
-	writer.Clear();
-
-	int64_t values[] = { -1088, -2560, -343630, 13540, 435620, 45630 };
-
-	for (int i = 0; i < sizeof(values) / sizeof(int64_t); ++i)
+	localwriter.WriteCBORPairsArrayMarker(1);
+	localwriter.WriteCBORString("device");
+	if (indefinite)
+		localwriter.WriteCBORPairsArrayMarker();
+	else
+		localwriter.WriteCBORPairsArrayMarker(4);
+	localwriter.WriteCBORString("name");
+	localwriter.WriteCBORString("sensor");
+	localwriter.WriteCBORString("readings");
+	if (indefinite)
+		localwriter.WriteCBORItemsArrayMarker();
+	else
+		localwriter.WriteCBORItemsArrayMarker(readingscount);
+	for (size_t i = 0; i < readingscount; ++i)
 	{
-		writer.WriteCBORValue(values[i]);
+		localwriter.WriteCBORPairsArrayMarker(1);
+		localwriter.WriteCBORString("value");
+		localwriter.WriteCBORFloat(2.5 * i);
 	}
+	if (indefinite)
+		localwriter.WriteCBORStopArrayMarker();
+	localwriter.WriteCBORString("a/b");
+	localwriter.WriteCBORValue(7);
+	localwriter.WriteCBORValue(10);
+	localwriter.WriteCBORString("ten");
+	if (indefinite)
+		localwriter.WriteCBORStopArrayMarker();
+}
 
-	TRCBORObjectModel CBOR;
+TEST(TRCBORPath, Compile)
+{
+	TRCBORPath path;
+	ASSERT_FALSE(path.IsValid());
+
+	ASSERT_TRUE(path.Compile("/device/readings/3/value"));
+	ASSERT_TRUE(path.IsValid());
+	ASSERT_EQ(path.GetCount(), 4);
+
+	ASSERT_TRUE(path.Compile(""));
+	ASSERT_EQ(path.GetCount(), 0);
+
+	ASSERT_TRUE(path.Compile("/a~1b/~0"));
+	ASSERT_EQ(path.GetCount(), 2);
+
+	ASSERT_FALSE(path.Compile("device"));
+	ASSERT_FALSE(path.Compile("/bad~2escape"));
+	ASSERT_FALSE(path.IsValid());
+}
+
+TEST(TRCBORReader, Find)
+{
+	TRCBORReader localreader;
+	TRHCBOROutType valuetype;
+	uint64_t outvalue;
+	double floatvalue;
+	size_t valuesize;
+
+	TRCBORPath value3("/device/readings/3/value");
+	TRCBORPath name("/device/name");
+
+	for (int indefinite = 0; indefinite < 2; ++indefinite)
+	{
+		TRCBORWriter localwriter;
+		writedevice(localwriter, 5, indefinite != 0);
+
+		localreader.SetBuffer(localwriter.Pointer(), localwriter.Size());
+		ASSERT_TRUE(localreader.Find(value3));
+		ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+		ASSERT_EQ(valuetype, HCBOROUT_FLOAT64);
+		memcpy(&floatvalue, &outvalue, 8);
+		ASSERT_EQ(floatvalue, 7.5);
+
+		localreader.SetBuffer(localwriter.Pointer(), localwriter.Size());
+		ASSERT_TRUE(localreader.Find(name));
+		ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+		ASSERT_EQ(std::string((char*)(uintptr_t)outvalue, valuesize), "sensor");
+
+		// экранирование и целый ключ
+		localreader.SetBuffer(localwriter.Pointer(), localwriter.Size());
+		ASSERT_TRUE(localreader.Find("/device/a~1b"));
+		ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+		ASSERT_EQ(outvalue & 0xffffffff, 7);
+
+		localreader.SetBuffer(localwriter.Pointer(), localwriter.Size());
+		ASSERT_TRUE(localreader.Find("/device/10"));
+		ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+		ASSERT_EQ(std::string((char*)(uintptr_t)outvalue, valuesize), "ten");
+
+		// поиск от найденного элемента
+		localreader.SetBuffer(localwriter.Pointer(), localwriter.Size());
+		ASSERT_TRUE(localreader.Find("/device/readings"));
+		ASSERT_TRUE(localreader.Find("/4/value"));
+		ASSERT_TRUE(localreader.ParseCBOR(valuetype, &outvalue, valuesize));
+		memcpy(&floatvalue, &outvalue, 8);
+		ASSERT_EQ(floatvalue, 10.0);
+
+		// не найдено - позиция не меняется
+		const char* missing[] = { "/device/readings/5/value", "/device/nothing", "/device/name/x", "/device/readings/x" };
+		for (auto& it : missing)
+		{
+			localreader.SetBuffer(localwriter.Pointer(), localwriter.Size());
+			ASSERT_FALSE(localreader.Find(it));
+			ASSERT_EQ(localreader.GetError(), HCBORERR_OK);
+			ASSERT_EQ(localreader.GetPosition(), 0);
+		}
+
+		// обрезанные данные
+		localreader.SetBuffer(localwriter.Pointer(), localwriter.Size() / 2);
+		ASSERT_FALSE(localreader.Find("/device/a~1b"));
+		ASSERT_EQ(localreader.GetError(), HCBORERR_TRUNCATED);
+	}
+}
+
+// запись событий TRCBORReader::Parse в текст
+struct TRCBORTraceVisitor : public TRCBORVisitor
+{
+	std::string trace;
+	size_t stopafter = SIZE_MAX; // остановка после заданного количества событий
+
+	bool add(const std::string& event) { trace += event + " "; return --stopafter != 0; }
+
+	bool OnUInt64(uint64_t value) { return add(std::to_string(value)); }
+	bool OnInt64(int64_t value) { return add(std::to_string(value)); }
+	bool OnFloat(float value) { return add("f" + std::to_string(value)); }
+	bool OnDouble(double value) { return add("d" + std::to_string(value)); }
+	bool OnBool(bool value) { return add(value ? "true" : "false"); }
+	bool OnNull(void) { return add("null"); }
+	bool OnString(const TRCBORStringView& value) { return add("'" + value.ToString() + "'"); }
+	bool OnBytes(const TRCBORBytesView& value) { return add("h" + std::to_string(value.size)); }
+	bool OnArrayBegin(size_t count) { return add(count == HCBOROUT_INDEFINITE_SIZE ? "[_" : "[" + std::to_string(count)); }
+	bool OnArrayEnd(void) { return add("]"); }
+	bool OnMapBegin(size_t count) { return add(count == HCBOROUT_INDEFINITE_SIZE ? "{_" : "{" + std::to_string(count)); }
+	bool OnMapEnd(void) { return add("}"); }
+	bool OnTag(uint64_t tag) { return add("#" + std::to_string(tag)); }
+};
+
+TEST(TRCBORReader, Parse)
+{
+	TRCBORWriter localwriter;
+	uint8_t bytes[3] = { 1, 2, 3 };
+
+	localwriter.WriteCBORPairsArrayMarker(3);
+		localwriter.WriteCBORString("a");
+		localwriter.WriteCBORItemsArrayMarker(4);
+			localwriter.WriteCBORValue(1);
+			localwriter.WriteCBORValue(-5);
+			localwriter.WriteCBORValue((int64_t)0x123456789LL);
+			localwriter.WriteCBORItemsArrayMarker(0);
+		localwriter.WriteCBORString("b");
+		localwriter.WriteCBORItemsArrayMarker();
+			localwriter.WriteCBORFloat(1.5f);
+			localwriter.WriteCBORFloat(0.1);
+			localwriter.WriteCBORBool(true);
+			localwriter.WriteCBORNull();
+			localwriter.WriteCBORByteArray(bytes, sizeof(bytes));
+		localwriter.WriteCBORStopArrayMarker();
+		localwriter.WriteCBORValue(7);
+		localwriter.WriteCBORTag(1);
+		localwriter.WriteCBORValue(1000);
+	localwriter.WriteCBORString("next");
+
+	TRCBORReader localreader;
+	localreader.SetBuffer(localwriter.Pointer(), localwriter.Size());
+
+	TRCBORTraceVisitor visitor;
+	ASSERT_TRUE(localreader.Parse(visitor));
+	ASSERT_EQ(visitor.trace, "{3 'a' [4 1 -5 4886718345 [0 ] ] 'b' [_ f1.500000 d0.100000 true null h3 ] 7 #1 1000 } ");
+
+	// последовательность - следующий элемент с позиции за первым
+	visitor.trace.clear();
+	ASSERT_TRUE(localreader.Parse(visitor));
+	ASSERT_EQ(visitor.trace, "'next' ");
+	ASSERT_FALSE(localreader.Parse(visitor));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_OK);
+
+	// остановка обработчиком - позиция не меняется
+	localreader.SetBuffer(localwriter.Pointer(), localwriter.Size());
+	visitor.trace.clear();
+	visitor.stopafter = 4;
+	ASSERT_FALSE(localreader.Parse(visitor));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_STOPPED);
+	ASSERT_EQ(localreader.GetPosition(), 0);
+	ASSERT_EQ(visitor.trace, "{3 'a' [4 1 ");
+
+	// обрезанные данные
+	visitor.stopafter = SIZE_MAX;
+	for (size_t size = 1; size < localwriter.Size() - 5; ++size)
+	{
+		localreader.SetBuffer(localwriter.Pointer(), size);
+		ASSERT_FALSE(localreader.Parse(visitor));
+		ASSERT_EQ(localreader.GetError(), HCBORERR_TRUNCATED);
+		ASSERT_EQ(localreader.GetPosition(), 0);
+	}
+
+	// break вне контейнера, зарезервированный заголовок
+	const uint8_t invalid[][2] = { { 0xff, 0 }, { 0x1c, 0 }, { 0x81, 0xff } };
+	const TRHCBORError errors[] = { HCBORERR_UNEXPECTEDBREAK, HCBORERR_INVALIDHEAD, HCBORERR_UNEXPECTEDBREAK };
+	for (size_t i = 0; i < 3; ++i)
+	{
+		localreader.SetBuffer((void*)invalid[i], 2);
+		ASSERT_FALSE(localreader.Parse(visitor));
+		ASSERT_EQ(localreader.GetError(), errors[i]);
+	}
+}
+
+TEST(TRCBORReader, TypedRead)
+{
+	TRCBORWriter localwriter;
+	uint8_t bytes[3] = { 1, 2, 3 };
+
+	localwriter.WriteCBORPairsArrayMarker(2);
+		localwriter.WriteCBORString("values");
+		localwriter.WriteCBORItemsArrayMarker(6);
+			localwriter.WriteCBORValue(5);
+			localwriter.WriteCBORValue(-100000);
+			localwriter.WriteCBORValue((int64_t)INT64_MIN);
+			localwriter.WriteCBORValue((int64_t)INT64_MAX);
+			localwriter.WriteCBORFloat(0.25f);
+			localwriter.WriteCBORFloat(0.1);
+		localwriter.WriteCBORString("rest");
+		localwriter.WriteCBORItemsArrayMarker();
+			localwriter.WriteCBORBool(true);
+			localwriter.WriteCBORByteArray(bytes, sizeof(bytes));
+		localwriter.WriteCBORStopArrayMarker();
+	// uint64_t больше INT64_MAX
+	const uint8_t uint64max[] = { 0x1b, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+	localwriter.WriteBuffer((void*)uint64max, sizeof(uint64max));
+
+	TRCBORReader localreader;
+	localreader.SetBuffer(localwriter.Pointer(), localwriter.Size());
+
+	size_t count;
+	TRCBORStringView key;
+	int64_t i64;
+	uint64_t u64;
+	double d;
+	bool b;
+	TRCBORBytesView view;
+
+	ASSERT_TRUE(localreader.EnterCBORMap(count));
+	ASSERT_EQ(count, 2);
+	ASSERT_TRUE(localreader.ReadCBORString(key));
+	ASSERT_TRUE(key.Equals("values"));
+	ASSERT_TRUE(localreader.EnterCBORArray(count));
+	ASSERT_EQ(count, 6);
+	ASSERT_TRUE(localreader.ReadCBORUInt64(u64));
+	ASSERT_EQ(u64, 5);
+	ASSERT_TRUE(localreader.ReadCBORInt64(i64));
+	ASSERT_EQ(i64, -100000);
+	// отрицательное в uint64_t - несоответствие типа, позиция не меняется
+	size_t position = localreader.GetPosition();
+	ASSERT_FALSE(localreader.ReadCBORUInt64(u64));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_TYPEMISMATCH);
+	ASSERT_EQ(localreader.GetPosition(), position);
+	ASSERT_TRUE(localreader.ReadCBORInt64(i64));
+	ASSERT_EQ(i64, INT64_MIN);
+	ASSERT_TRUE(localreader.ReadCBORInt64(i64));
+	ASSERT_EQ(i64, INT64_MAX);
+	ASSERT_FALSE(localreader.ReadCBORInt64(i64));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_TYPEMISMATCH);
+	ASSERT_TRUE(localreader.ReadCBORDouble(d));
+	ASSERT_EQ(d, 0.25);
+	ASSERT_TRUE(localreader.ReadCBORDouble(d));
+	ASSERT_EQ(d, 0.1);
+
+	ASSERT_TRUE(localreader.ReadCBORString(key));
+	ASSERT_EQ(key.ToString(), "rest");
+	ASSERT_TRUE(localreader.EnterCBORArray(count));
+	ASSERT_EQ(count, HCBOROUT_INDEFINITE_SIZE);
+	ASSERT_FALSE(localreader.ReadCBORStopArrayMarker());
+	ASSERT_EQ(localreader.GetError(), HCBORERR_OK);
+	ASSERT_TRUE(localreader.ReadCBORBool(b));
+	ASSERT_TRUE(b);
+	ASSERT_FALSE(localreader.ReadCBORString(key));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_TYPEMISMATCH);
+	ASSERT_TRUE(localreader.ReadCBORByteArray(view));
+	ASSERT_EQ(view.size, 3);
+	ASSERT_EQ(memcmp(view.data, bytes, 3), 0);
+	ASSERT_TRUE(localreader.ReadCBORStopArrayMarker());
+
+	ASSERT_FALSE(localreader.ReadCBORInt64(i64));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_TYPEMISMATCH);
+	ASSERT_TRUE(localreader.ReadCBORUInt64(u64));
+	ASSERT_EQ(u64, UINT64_MAX);
+
+	// конец данных
+	ASSERT_FALSE(localreader.ReadCBORUInt64(u64));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_OK);
+
+	// обрезанные данные
+	localreader.SetBuffer((void*)uint64max, 5);
+	ASSERT_FALSE(localreader.ReadCBORUInt64(u64));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_TRUNCATED);
+	ASSERT_EQ(localreader.GetPosition(), 0);
+
+	const uint8_t shortstring[] = { 0x65, 'a', 'b' };
+	localreader.SetBuffer((void*)shortstring, sizeof(shortstring));
+	ASSERT_FALSE(localreader.ReadCBORString(key));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_TRUNCATED);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Test TRCBORPushParser
+
+// событие разбора: тип + значение (байты числа, содержимое строки, размер массива)
+static std::string pushevent(TRHCBOROutType valuetype, uint64_t outvalue, size_t valuesize)
+{
+	std::string event(1, (char)valuetype);
+	if (valuetype == HCBOROUT_STRING_UTF8 || valuetype == HCBOROUT_BYTEARRAY)
+		event.append((const char*)(uintptr_t)outvalue, valuesize);
+	else
+	if (valuetype == HCBOROUT_ITEMSARRAY_MARKER || valuetype == HCBOROUT_PAIRSARRAY_MARKER)
+		event.append((const char*)&valuesize, sizeof(valuesize));
+	else
+		event.append((const char*)&outvalue, valuesize);
+	return event;
+}
+
+TEST(TRCBORPushParser, Chunks)
+{
+	TRCBORWriter localwriter;
+	std::string longstring(300, 'x');
+	uint8_t bytes[] = { 1, 2, 3, 4, 5 };
+
+	localwriter.WriteCBORPairsArrayMarker(4);
+		localwriter.WriteCBORString("long");
+		localwriter.WriteCBORString(longstring);
+		localwriter.WriteCBORString("numbers");
+		localwriter.WriteCBORItemsArrayMarker();
+			localwriter.WriteCBORValue((int64_t)0x123456789);
+			localwriter.WriteCBORValue(-1000);
+			localwriter.WriteCBORFloat(1.25f);
+			localwriter.WriteCBORFloat(-2.5);
+			localwriter.WriteCBORString("");
+		localwriter.WriteCBORStopArrayMarker();
+		localwriter.Write8U(0xc1); // тег 1
+		localwriter.WriteCBORValue(1500000000);
+		localwriter.WriteCBORByteArray(bytes, sizeof(bytes));
+		localwriter.WriteCBORItemsArrayMarker(0);
+		localwriter.WriteCBORNull();
+
+	// эталон - разбор целого буфера
+	std::vector<std::string> expected;
+	TRCBORReader localreader;
+	TRHCBOROutType valuetype;
+	uint64_t outvalue;
+	size_t valuesize;
+	localreader.SetBuffer(localwriter.Pointer(), localwriter.Size());
+	while (localreader.ParseCBOR(valuetype, &outvalue, valuesize) == true)
+		expected.push_back(pushevent(valuetype, outvalue, valuesize));
+	ASSERT_EQ(localreader.GetError(), HCBORERR_OK);
+
+	size_t chunksizes[] = { 1, 2, 3, 7, 64, localwriter.Size() };
+	for (auto& chunksize : chunksizes)
+	{
+		TRCBORPushParser parser;
+		std::vector<std::string> events;
+		std::string partial;
+		const uint8_t* data = (const uint8_t*)localwriter.Pointer();
+
+		for (size_t offset = 0; offset < localwriter.Size(); offset += chunksize)
+		{
+			ASSERT_TRUE(parser.Feed(data + offset, std::min(chunksize, localwriter.Size() - offset)));
+			ASSERT_FALSE(parser.IsComplete() == true && offset > 0);
+
+			TRHCBORPushStatus status;
+			while ((status = parser.Next(valuetype, &outvalue, valuesize)) != HCBORPUSH_NEEDMOREDATA)
+			{
+				ASSERT_NE(status, HCBORPUSH_ERROR);
+				if (status == HCBORPUSH_PARTIAL)
+				{
+					partial.append((const char*)(uintptr_t)outvalue, valuesize);
+					continue;
+				}
+
+				if (partial.empty() == false)
+				{
+					partial.append((const char*)(uintptr_t)outvalue, valuesize);
+					outvalue = (uintptr_t)partial.data();
+					valuesize = partial.size();
+				}
+				events.push_back(pushevent(valuetype, outvalue, valuesize));
+				partial.clear();
+			}
+		}
+
+		ASSERT_TRUE(parser.IsComplete());
+		ASSERT_EQ(parser.GetDepth(), 0);
+		ASSERT_TRUE(events == expected);
+	}
+}
+
+TEST(TRCBORPushParser, Errors)
+{
+	TRCBORPushParser parser;
+	TRHCBOROutType valuetype;
+	uint64_t outvalue;
+	size_t valuesize;
+
+	// заголовок разрезан между кусками, затем зарезервированный additional type
+	uint8_t chunk1[] = { 0x82, 0x19, 0x01 };
+	uint8_t chunk2[] = { 0x00, 0x1c };
+
+	ASSERT_TRUE(parser.Feed(chunk1, sizeof(chunk1)));
+	ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_VALUE);
+	ASSERT_EQ(valuetype, HCBOROUT_ITEMSARRAY_MARKER);
+	ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_NEEDMOREDATA);
+	ASSERT_FALSE(parser.IsComplete());
+
+	ASSERT_TRUE(parser.Feed(chunk2, sizeof(chunk2)));
+	ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_VALUE);
+	ASSERT_EQ(outvalue & 0xffffffff, 0x100);
+	ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_ERROR);
+	ASSERT_EQ(parser.GetError(), HCBORERR_INVALIDHEAD);
+	ASSERT_EQ(parser.GetErrorOffset(), 4);
+
+	// кусок нельзя заменить, пока он не разобран
+	parser.Reset();
+	uint8_t twovalues[] = { 0x01, 0x02 };
+	ASSERT_TRUE(parser.Feed(twovalues, sizeof(twovalues)));
+	ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_VALUE);
+	ASSERT_TRUE(parser.IsComplete());
+	ASSERT_FALSE(parser.Feed(twovalues, sizeof(twovalues)));
+
+	// break вне контейнера неопределенной длины
+	parser.Reset();
+	uint8_t straybreak[] = { 0x81, 0xff };
+	ASSERT_TRUE(parser.Feed(straybreak, sizeof(straybreak)));
+	ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_VALUE);
+	ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_ERROR);
+	ASSERT_EQ(parser.GetError(), HCBORERR_UNEXPECTEDBREAK);
+
+	// break после ключа без значения в map неопределенной длины: {_ 1: 2, 3 }
+	parser.Reset();
+	uint8_t oddmap[] = { 0xbf, 0x01, 0x02, 0x03, 0xff };
+	ASSERT_TRUE(parser.Feed(oddmap, sizeof(oddmap)));
+	for (int i = 0; i < 4; ++i)
+		ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_VALUE);
+	ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_ERROR);
+	ASSERT_EQ(parser.GetError(), HCBORERR_UNEXPECTEDBREAK);
+	ASSERT_EQ(parser.GetErrorOffset(), 4);
+
+	// четность считается для каждого уровня: {_ 1: [_ 2], 3: 4 }
+	parser.Reset();
+	uint8_t nestedmap[] = { 0xbf, 0x01, 0x9f, 0x02, 0xff, 0x03, 0x04, 0xff };
+	ASSERT_TRUE(parser.Feed(nestedmap, sizeof(nestedmap)));
+	for (int i = 0; i < 8; ++i)
+		ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_VALUE);
+	ASSERT_TRUE(parser.IsComplete());
+
+	// break сразу после тега: [_ 1(break)]
+	parser.Reset();
+	uint8_t tagbreak[] = { 0x9f, 0xc1, 0xff };
+	ASSERT_TRUE(parser.Feed(tagbreak, sizeof(tagbreak)));
+	ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_VALUE);
+	ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_VALUE);
+	ASSERT_EQ(valuetype, HCBOROUT_TAG_MARKER);
+	ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_ERROR);
+	ASSERT_EQ(parser.GetError(), HCBORERR_UNEXPECTEDBREAK);
+
+	// отрицательные числа на границах int32_t/int64_t, меньше -2^63 - ошибка
+	parser.Reset();
+	uint8_t negative[] = { 0x3a, 0x7f, 0xff, 0xff, 0xff,
+		0x3b, 0x7f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0x3b, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	ASSERT_TRUE(parser.Feed(negative, sizeof(negative)));
+	ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_VALUE);
+	ASSERT_EQ(valuetype, HCBOROUT_INT);
+	ASSERT_EQ((int32_t)(outvalue & 0xffffffff), INT32_MIN);
+	ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_VALUE);
+	ASSERT_EQ(valuetype, HCBOROUT_INT64);
+	ASSERT_EQ((int64_t)outvalue, INT64_MIN);
+	ASSERT_EQ(parser.Next(valuetype, &outvalue, valuesize), HCBORPUSH_ERROR);
+	ASSERT_EQ(parser.GetError(), HCBORERR_UNSUPPORTED);
+	ASSERT_EQ(parser.GetErrorOffset(), 14);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Test TRCBORSequenceReader
+
+TEST(TRCBORSequenceReader, File)
+{
+	const char* filename = "cborsequence.tmp";
+
+	// журнал - 100 записей подряд + обрезанная последняя
+	TRCBORWriter localwriter;
+	std::vector<size_t> offsets;
+	for (size_t i = 0; i < 100; ++i)
+	{
+		offsets.push_back(localwriter.Size());
+		writedevice(localwriter, i % 5, i % 2 != 0);
+	}
+	size_t completesize = localwriter.Size();
+	localwriter.WriteCBORItemsArrayMarker(3);
+	localwriter.WriteCBORValue(1);
+
+	FILE* file = fopen(filename, "wb");
+	ASSERT_NE(file, nullptr);
+	ASSERT_EQ(fwrite(localwriter.Pointer(), 1, localwriter.Size(), file), localwriter.Size());
+	fclose(file);
+
+	TRCBORSequenceReader sequence;
+	ASSERT_TRUE(sequence.Open(filename));
+	ASSERT_EQ(sequence.GetSize(), localwriter.Size());
+
+	TRCBORBytesView item;
+	TRCBORReader localreader;
+	size_t count = 0;
+	while (sequence.Next(item) == true)
+	{
+		// ссылка внутрь отображения, без копирования
+		ASSERT_EQ(item.data, sequence.GetData() + offsets[count]);
+		ASSERT_EQ(memcmp(item.data, (uint8_t*)localwriter.Pointer() + offsets[count], item.size), 0);
+
+		localreader.SetBuffer((void*)item.data, item.size);
+		ASSERT_TRUE(localreader.Find("/device/name"));
+		count++;
+	}
+	ASSERT_EQ(count, 100);
+	ASSERT_EQ(sequence.GetError(), HCBORERR_TRUNCATED);
+	ASSERT_EQ(sequence.GetErrorOffset(), completesize); // начало обрезанного элемента
+	ASSERT_EQ(sequence.GetPosition(), completesize);
+	ASSERT_FALSE(sequence.Next(item));
+
+	// повтор с середины
+	sequence.SetPosition(offsets[98]);
+	ASSERT_TRUE(sequence.Next(item));
+	ASSERT_TRUE(sequence.Next(item));
+	ASSERT_FALSE(sequence.Next(item));
+
+	sequence.Close();
+	ASSERT_EQ(remove(filename), 0);
+
+	// нет файла, пустой файл
+	ASSERT_FALSE(sequence.Open(filename));
+	file = fopen(filename, "wb");
+	fclose(file);
+	ASSERT_TRUE(sequence.Open(filename));
+	ASSERT_FALSE(sequence.Next(item));
+	ASSERT_EQ(sequence.GetError(), HCBORERR_OK);
+	sequence.Close();
+	remove(filename);
+}
+
+// сумма значений "/device/readings/N/value" по кускам
+struct TRCBORChunkSums
+{
+	std::vector<double> sums;
+	size_t stopchunk = SIZE_MAX;
+
+	std::vector<size_t> reduced; // порядок вызовов reducesums
+	double total = 0;
+	size_t stopreduce = SIZE_MAX;
+};
+
+// сумма всех чисел с плавающей точкой элемента
+struct TRCBORFloatSumVisitor : public TRCBORVisitor
+{
+	double sum = 0;
+
+	bool OnFloat(float value) { sum += value; return true; }
+	bool OnDouble(double value) { sum += value; return true; }
+};
+
+static bool sumreadings(void* userdata, size_t chunkindex, const TRCBORBytesView& item)
+{
+	TRCBORChunkSums* result = (TRCBORChunkSums*)userdata;
+	if (chunkindex == result->stopchunk)
+		return false;
+
+	TRCBORReader localreader;
+	TRCBORFloatSumVisitor visitor;
+	localreader.SetBuffer((void*)item.data, item.size);
+	if (localreader.Parse(visitor) == false)
+		return false;
+
+	result->sums[chunkindex] += visitor.sum;
+	return true;
+}
+
+static bool reducesums(void* userdata, size_t chunkindex)
+{
+	TRCBORChunkSums* result = (TRCBORChunkSums*)userdata;
+	if (chunkindex == result->stopreduce)
+		return false;
+
+	result->reduced.push_back(chunkindex);
+	result->total += result->sums[chunkindex];
+	return true;
+}
+
+TEST(TRCBORParallelProcessor, Process)
+{
+	TRCBORWriter localwriter;
+	double expected = 0;
+	for (size_t i = 0; i < 1000; ++i)
+	{
+		size_t readingscount = i % 7;
+		writedevice(localwriter, readingscount, i % 2 != 0);
+		for (size_t j = 0; j < readingscount; ++j)
+			expected += j * 2.5;
+	}
+
+	TRCBORSequenceReader sequence;
+	sequence.SetBuffer(localwriter.Pointer(), localwriter.Size());
+
+	// границы кусков - только по границам элементов
+	std::vector<size_t> boundaries;
+	ASSERT_TRUE(sequence.Split(4096, boundaries));
+	ASSERT_GT(boundaries.size(), 10);
+	ASSERT_EQ(boundaries.front(), 0);
+	ASSERT_EQ(boundaries.back(), localwriter.Size());
+	for (size_t i = 1; i + 1 < boundaries.size(); ++i)
+	{
+		ASSERT_GE(boundaries[i] - boundaries[i - 1], 4096);
+		ASSERT_EQ(sequence.GetData()[boundaries[i]], 0xa1); // каждый элемент - {"device": ...}
+	}
+
+	// результат не зависит от количества потоков
+	std::vector<double> reference;
+	for (size_t threads = 1; threads <= 8; threads *= 2)
+	{
+		TRCBORParallelProcessor processor(threads);
+		sequence.SetPosition(0);
+		ASSERT_TRUE(processor.Prepare(sequence, 4096));
+		ASSERT_EQ(processor.GetChunksCount(), boundaries.size() - 1);
+
+		TRCBORChunkSums result;
+		result.sums.resize(processor.GetChunksCount());
+		ASSERT_TRUE(processor.Process(sumreadings, &result));
+
+		double total = 0;
+		for (auto& it : result.sums)
+			total += it;
+		ASSERT_EQ(total, expected);
+
+		if (reference.empty())
+			reference = result.sums;
+		ASSERT_EQ(result.sums, reference);
+
+		// объединение по порядку кусков
+		TRCBORChunkSums reduced;
+		reduced.sums.resize(processor.GetChunksCount());
+		ASSERT_TRUE(processor.Process(sumreadings, &reduced, reducesums));
+		ASSERT_EQ(reduced.reduced.size(), processor.GetChunksCount());
+		for (size_t i = 0; i < reduced.reduced.size(); ++i)
+			ASSERT_EQ(reduced.reduced[i], i);
+		ASSERT_EQ(reduced.total, total);
+
+		// остановка обработчиком
+		result.stopchunk = 3;
+		ASSERT_FALSE(processor.Process(sumreadings, &result));
+		ASSERT_EQ(processor.GetError(), HCBORERR_STOPPED);
+
+		// остановка при объединении - объединены только куски до него
+		TRCBORChunkSums stopped;
+		stopped.sums.resize(processor.GetChunksCount());
+		stopped.stopreduce = 5;
+		ASSERT_FALSE(processor.Process(sumreadings, &stopped, reducesums));
+		ASSERT_EQ(processor.GetError(), HCBORERR_STOPPED);
+		ASSERT_EQ(stopped.reduced.size(), 5);
+		ASSERT_EQ(stopped.reduced.back(), 4);
+	}
+
+	// обрезанный хвост - целые элементы обрабатываются
+	sequence.SetBuffer(localwriter.Pointer(), localwriter.Size() - 1);
+	TRCBORParallelProcessor processor(4);
+	ASSERT_FALSE(processor.Prepare(sequence, 4096));
+	ASSERT_EQ(processor.GetError(), HCBORERR_TRUNCATED);
+	TRCBORChunkSums result;
+	result.sums.resize(processor.GetChunksCount());
+	ASSERT_TRUE(processor.Process(sumreadings, &result));
+	double total = 0;
+	for (auto& it : result.sums)
+		total += it;
+	ASSERT_LT(total, expected);
+	ASSERT_GT(total, 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Test TRCBORTape
+
+TEST(TRCBORTape, Build)
+{
+	TRCBORTape tape;
+	TRCBORPath value3("/device/readings/3/value");
+
+	for (int indefinite = 0; indefinite < 2; ++indefinite)
+	{
+		TRCBORWriter localwriter;
+		writedevice(localwriter, 5, indefinite != 0);
+		localwriter.WriteCBORValue(99); // второй элемент последовательности
+
+		ASSERT_TRUE(tape.Build(localwriter.Pointer(), localwriter.Size()));
+		// корень, "device", map, 2 + (1 + 1 + 5 * 3) + 2 + 2, 99
+		ASSERT_EQ(tape.GetCount(), 27);
+
+		// соседний элемент верхнего уровня
+		size_t second = tape.GetEntry(0).next;
+		ASSERT_EQ(second, 26);
+		ASSERT_EQ(tape.GetEntry(second).majortype, HCBOR_POSITIVEINTEGER);
+		ASSERT_EQ(tape.GetEntry(second).value, 99);
+		ASSERT_EQ(tape.GetEntry(second).next, tape.GetCount());
+
+		size_t device = tape.GetChild(0, 1);
+		ASSERT_EQ(device, 2);
+		ASSERT_EQ(tape.GetChildsCount(device), 8);
+
+		size_t name = tape.GetChild(device, 1);
+		ASSERT_EQ(tape.GetEntry(name).majortype, HCBOR_STRING_UTF8);
+		ASSERT_EQ(std::string((const char*)tape.GetValuePointer(name), (size_t)tape.GetEntry(name).value), "sensor");
+
+		size_t readings = tape.GetChild(device, 3);
+		ASSERT_EQ(tape.GetChildsCount(readings), 5);
+		ASSERT_EQ(tape.GetChild(readings, 5), SIZE_MAX);
+
+		size_t value = tape.Find(value3);
+		ASSERT_EQ(value, tape.GetChild(tape.GetChild(readings, 3), 1));
+		ASSERT_EQ(tape.GetEntry(value).majortype, HCBOR_FLOATSIMPLE);
+		uint64_t bits = tape.GetEntry(value).value;
+		double floatvalue;
+		memcpy(&floatvalue, &bits, 8);
+		ASSERT_EQ(floatvalue, 7.5);
+
+		// поиск от вложенного элемента
+		ASSERT_EQ(tape.Find(TRCBORPath("/3/value"), readings), value);
+		ASSERT_EQ(tape.GetEntry(tape.Find(TRCBORPath("/device/10"))).majortype, HCBOR_STRING_UTF8);
+		ASSERT_EQ(tape.Find(TRCBORPath("/device/readings/5")), SIZE_MAX);
+		ASSERT_EQ(tape.Find(TRCBORPath("/device/name/x")), SIZE_MAX);
+
+		// обрезанные данные
+		ASSERT_FALSE(tape.Build(localwriter.Pointer(), localwriter.Size() - 3));
+		ASSERT_EQ(tape.GetError(), HCBORERR_TRUNCATED);
+		ASSERT_EQ(tape.GetCount(), 0);
+	}
+}
+
+TEST(TRCBORTape, ScalarArray)
+{
+	TRCBORWriter localwriter;
+	std::vector<int32_t> values(1000);
+	for (size_t i = 0; i < values.size(); ++i)
+		values[i] = (int32_t)(i * 1000) - 100000;
+	localwriter.WriteCBORArray(values.data(), values.size());
+
+	TRCBORTape tape;
+	ASSERT_TRUE(tape.Build(localwriter.Pointer(), localwriter.Size()));
+	ASSERT_EQ(tape.GetCount(), 1001);
+	ASSERT_EQ(tape.GetChildsCount(0), 1000);
+
+	// прямой доступ к элементам
+	size_t child = tape.GetChild(0, 777);
+	ASSERT_EQ(child, 778);
+	ASSERT_EQ(tape.GetEntry(child).majortype, HCBOR_POSITIVEINTEGER);
+	ASSERT_EQ(tape.GetEntry(child).value, 777000 - 100000);
+	ASSERT_EQ(tape.GetEntry(tape.GetChild(0, 1)).majortype, HCBOR_NEGATIVEINTEGER);
+	ASSERT_EQ(tape.GetEntry(tape.GetChild(0, 1)).value, 98999);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Test TRCBORArena
+
+static void arenacleanup(void* ptr)
+{
+	(*(int*)ptr)++;
+}
+
+TEST(TRCBORArena, Allocate)
+{
+	TRCBORArena arena(1024);
+
+	uint8_t* first = (uint8_t*)arena.Allocate(3);
+	uint8_t* second = (uint8_t*)arena.Allocate(8);
+	ASSERT_EQ(second - first, 8); // выравнивание 8 байт, подряд в одном блоке
+	ASSERT_EQ(arena.GetBlocksSize(), 1024);
+
+	// большой размер - отдельный блок, текущий не меняется
+	ASSERT_NE(arena.Allocate(4096), nullptr);
+	ASSERT_EQ((uint8_t*)arena.Allocate(8) - second, 8);
+
+	for (int i = 0; i < 200; ++i)
+		arena.Allocate(16);
+	ASSERT_EQ(arena.GetBlocksSize(), 4 * 1024);
+
+	int cleanups = 0;
+	arena.AddCleanup(arenacleanup, &cleanups);
+	arena.AddCleanup(arenacleanup, &cleanups);
+
+	// после Reset блоки используются повторно
+	arena.Reset();
+	ASSERT_EQ(cleanups, 2);
+	ASSERT_EQ(arena.Allocate(8), first);
+	for (int i = 0; i < 200; ++i)
+		arena.Allocate(16);
+	ASSERT_EQ(arena.GetBlocksSize(), 4 * 1024);
+
+	arena.AddCleanup(arenacleanup, &cleanups);
+	arena.Clear();
+	ASSERT_EQ(cleanups, 3);
+	ASSERT_EQ(arena.GetBlocksSize(), 0);
+}
+
+// выделяет не больше *userdata блоков
+static void* limitedrealloc(void* userdata, void* ptr, size_t size)
+{
+	int& limit = *(int*)userdata;
+	if (limit == 0)
+		return nullptr;
+	limit--;
+	return realloc(ptr, size);
+}
+
+static void limitedfree(void* /*userdata*/, void* ptr)
+{
+	free(ptr);
+}
+
+TEST(TRCBORArena, OutOfMemory)
+{
+	int limit = 0;
+	TRCBORAllocator allocator = { limitedrealloc, limitedfree, &limit };
+	TRCBORArena arena(allocator, 1024);
+
+	// ни блока, ни отдельного большого блока - исключение вместо nullptr
+	ASSERT_THROW(arena.Allocate(8), std::bad_alloc);
+	ASSERT_THROW(arena.Allocate(4096), std::bad_alloc);
+	ASSERT_EQ(arena.GetBlocksSize(), 0);
+
+	// после ошибки арена остается рабочей
+	limit = 1;
+	uint8_t* first = (uint8_t*)arena.Allocate(200);
+	for (int i = 0; i < 4; ++i)
+		arena.Allocate(200); // 1000 байт из 1024
+	ASSERT_THROW(arena.Allocate(200), std::bad_alloc);
+	ASSERT_THROW(arena.Allocate(200), std::bad_alloc);
+	limit = 1;
+	ASSERT_NE(arena.Allocate(200), nullptr);
+	ASSERT_EQ(arena.GetBlocksSize(), 2 * 1024);
+
+	arena.Reset();
+	ASSERT_EQ(arena.Allocate(8), first);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Test TRCBORObjectModel
+
+TEST(TRCBORObjectModel, Reparse)
+{
+	TRCBORWriter localwriter;
+	localwriter.WriteCBORItemsArrayMarker(3);
+		localwriter.WriteCBORItemsArrayMarker(0);
+		localwriter.WriteCBORPairsArrayMarker(0);
+		localwriter.WriteCBORString("after empty arrays");
+	localwriter.WriteCBORString("second");
+
+	TRCBORObjectModel model;
+	for (int i = 0; i < 3; ++i)
+	{
+		model.SetBuffer(localwriter.Pointer(), localwriter.Size());
+		model.Parse();
+
+		// пустые массивы определенной длины не забирают следующие элементы
+		ASSERT_EQ(model.GetChildsCount(), 2);
+		TRCBORObject* Object = model.GetChild(0);
+		ASSERT_EQ(Object->GetChildsCount(), 3);
+		ASSERT_EQ(Object->GetChild(0)->GetChildsCount(), 0);
+		ASSERT_EQ(Object->GetChild(1)->GetType(), HOBJTYPE_PAIRSARRAY);
+		ASSERT_EQ(Object->GetChild(1)->GetChildsCount(), 0);
+		ASSERT_TRUE(Object->GetChild(2)->AsStringView().Equals("after empty arrays"));
+		ASSERT_EQ(model.GetChild(1)->AsString(), "second");
+
+		// измененная строка видна через AsStringView и сериализуется
+		model.GetChild(1)->AsString() = "changed";
+		ASSERT_TRUE(model.GetChild(1)->AsStringView().Equals("changed"));
+		ASSERT_EQ(model.GetCBORSize(), localwriter.Size() + 1);
+	}
+}
+
+
+TEST(TRCBORObjectModel, Strings)
+{
+	writer.Clear();
+
+	char* strarr[] = { "Name", "Adolf", "Age", "Data", "Subdata1", "kikoz1", "Subdata2", "kikoz2", "Subdata3", "Array" };
+	
+	for (int i = 0; i < sizeof(strarr)/sizeof(char*); ++i)	
+	{ 
+		writer.WriteCBORString(strarr[i]);
+	}
+	
+	TRCBORObjectModel CBOR;
+	CBOR.SetBuffer(writer.Pointer(), writer.Size());
+	CBOR.Parse();
+
+	TRCBORObject* Object;
+
+	size_t count = CBOR.GetChildsCount();
+	ASSERT_EQ(count, sizeof(strarr)/sizeof(char*));
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		Object = CBOR.GetChild(i);
+
+		ASSERT_EQ(strarr[i], Object->AsString());
+	}
+	
+}
+
+TEST(TRCBORObjectModel, Integers)
+{
+	writer.Clear();
+
+	int values[] = { -10, -20, -30, 10, 20, 30 };
+
+	for (int i = 0; i < sizeof(values)/sizeof(int); ++i)
+	{
+		writer.WriteCBORValue(values[i]);
+	}
+
+	TRCBORObjectModel CBOR;
+	CBOR.SetBuffer(writer.Pointer(), writer.Size());
+	CBOR.Parse();
+
+	TRCBORObject* Object;
+
+	size_t count = CBOR.GetChildsCount();
+	ASSERT_EQ(count, sizeof(values) / sizeof(int));
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		Object = CBOR.GetChild(i);
+
+		int32_t v = Object->AsInt32();
+
+		ASSERT_EQ(values[i], v);
+	}
+
+}
+
+TEST(TRCBORObjectModel, Integers64)
+{
+	writer.Clear();
+
+	int64_t values[] = { -1088, -2560, -343630, 13540, 435620, 45630 };
+
+	for (int i = 0; i < sizeof(values) / sizeof(int64_t); ++i)
+	{
+		writer.WriteCBORValue(values[i]);
+	}
+
+	TRCBORObjectModel CBOR;
 	CBOR.SetBuffer(writer.Pointer(), writer.Size());
 	CBOR.Parse();
 
@@ -992,6 +2946,67 @@ TEST(TRCBORObjectModel, PairsArray)
 	}
 }
 
+TEST(TRCBORObjectModel, GetMember)
+{
+	writer.Clear();
+
+	writer.WriteCBORPairsArrayMarker(6);
+		writer.WriteCBORString("name");
+		writer.WriteCBORString("sensor");
+		writer.WriteCBORValue(0);
+		writer.WriteCBORValue(100);
+		writer.WriteCBORValue(-7);
+		writer.WriteCBORValue(107);
+		writer.WriteCBORString("value");
+		writer.WriteCBORValue(1);
+		writer.WriteCBORString("value"); // повтор - находится первый
+		writer.WriteCBORValue(2);
+		writer.WriteCBORString("1");
+		writer.WriteCBORValue(3);
+	writer.WriteCBORPairsArrayMarker(200);
+	char key[16];
+	for (int i = 0; i < 200; ++i)
+	{
+		sprintf(key, "rule%d", i);
+		writer.WriteCBORString(key);
+		writer.WriteCBORValue(i);
+	}
+
+	TRCBORObjectModel CBOR;
+	CBOR.SetBuffer(writer.Pointer(), writer.Size());
+	CBOR.Parse();
+	ASSERT_EQ(CBOR.GetChildsCount(), 2);
+
+	TRCBORObject* Small = CBOR.GetChild(0);
+	ASSERT_EQ(Small->GetMember("name")->AsString(), "sensor");
+	ASSERT_EQ(Small->GetMember(0)->AsInt32(), 100);
+	ASSERT_EQ(Small->GetMember(-7)->AsInt32(), 107);
+	ASSERT_EQ(Small->GetMember("value")->AsInt32(), 1);
+	ASSERT_EQ(Small->GetMember("1")->AsInt32(), 3);
+	ASSERT_EQ(Small->GetMember("valu", 4), nullptr);
+	ASSERT_EQ(Small->GetMember(1), nullptr); // строка "1" не целый ключ
+	ASSERT_EQ(Small->GetMember("missing"), nullptr);
+
+	TRCBORObject* Large = CBOR.GetChild(1);
+	for (int i = 0; i < 200; ++i)
+	{
+		sprintf(key, "rule%d", i);
+		TRCBORObject* Member = Large->GetMember(key);
+		ASSERT_NE(Member, nullptr);
+		ASSERT_EQ(Member->AsInt32(), i);
+	}
+	ASSERT_EQ(Large->GetMember("rule200"), nullptr);
+	ASSERT_EQ(Large->GetMember(5), nullptr);
+
+	// не map
+	ASSERT_EQ(Small->GetMember("name")->GetMember("name"), nullptr);
+
+	// повторный разбор - индекс создается заново
+	CBOR.SetBuffer(writer.Pointer(), writer.Size());
+	CBOR.Parse();
+	ASSERT_EQ(CBOR.GetChild(1)->GetMember("rule199")->AsInt32(), 199);
+}
+
 TEST(TRCBORObjectModel, ByteArray)
 {
 	writer.Clear();
@@ -1018,4 +3033,565 @@ TEST(TRCBORObjectModel, ByteArray)
 		ASSERT_TRUE(0 == std::memcmp(bytearrayptr, buff, bytearraysize));
 	}
 
-}
\ No newline at end of file
+}
+
+TEST(TRCBORObjectModel, Tags)
+{
+	// HCBOROUT_TAG_MARKER - не элемент: модель пропускает теги, помеченные значения - обычные элементы
+	// [1(5), 2(h'01'), 24(1(2))] и еще 1(3) на верхнем уровне
+	uint8_t tagged[] = { 0x83, 0xc1, 0x05, 0xc2, 0x41, 0x01, 0xd8, 0x18, 0xc1, 0x02, 0xc1, 0x03 };
+
+	TRCBORObjectModel CBOR;
+	CBOR.SetBuffer(tagged, sizeof(tagged));
+	CBOR.Parse();
+
+	ASSERT_EQ(CBOR.GetChildsCount(), 2);
+	TRCBORObject* Array = CBOR.GetChild(0);
+	ASSERT_EQ(Array->GetType(), HOBJTYPE_ITEMSARRAY);
+	ASSERT_EQ(Array->GetChildsCount(), 3);
+	ASSERT_EQ(Array->GetChild(0)->AsInt32(), 5);
+	ASSERT_EQ(Array->GetChild(1)->GetType(), HOBJTYPE_BYTEARRAY);
+	ASSERT_EQ(Array->GetChild(2)->AsInt32(), 2);
+	ASSERT_EQ(CBOR.GetChild(1)->AsInt32(), 3);
+}
+
+TEST(TRCBORObjectModel, Serialize)
+{
+	writer.Clear();
+
+	uint8_t buff[] = { 00, 11, 22, 33, 44, 55, 66, 77 };
+	std::string longstring(300, 'x');
+
+	writer.WriteCBORValue(-5);
+	writer.WriteCBORPairsArrayMarker(5);
+		writer.WriteCBORString("int");
+		writer.WriteCBORValue(100000);
+		writer.WriteCBORString("uint32");
+		writer.WriteCBORValue((int64_t)3000000000);
+		writer.WriteCBORString("float");
+		writer.WriteCBORFloat(1.25f);
+		writer.WriteCBORString("array");
+		writer.WriteCBORItemsArrayMarker(4);
+			writer.WriteCBORFloat(2.5);
+			writer.WriteCBORBool(true);
+			writer.WriteCBORNull();
+			writer.WriteCBORByteArray(buff, sizeof(buff));
+		writer.WriteCBORString(longstring);
+		writer.WriteCBORUndefined();
+
+	TRCBORObjectModel CBOR;
+	CBOR.SetBuffer(writer.Pointer(), writer.Size());
+	CBOR.Parse();
+
+	ASSERT_EQ(CBOR.GetCBORSize(), writer.Size());
+
+	TRCBORWriter localwriter;
+	localwriter.WriteCBORValue(1);
+	CBOR.Serialize(localwriter);
+
+	ASSERT_EQ(localwriter.Size(), writer.Size() + 1);
+	ASSERT_TRUE(0 == std::memcmp((uint8_t*)localwriter.Pointer() + 1, writer.Pointer(), writer.Size()));
+
+	// изменение и повторная запись поддерева
+	TRCBORObject* Object = CBOR.GetChild(1)->GetChild(1);
+	Object->AsString() = "changed";
+
+	localwriter.Clear();
+	CBOR.GetChild(1)->Serialize(localwriter);
+	ASSERT_EQ(localwriter.Size(), CBOR.GetChild(1)->GetCBORSize());
+
+	// массивы неопределенной длины записываются с длиной
+	writer.Clear();
+	writer.WriteCBORItemsArrayMarker();
+		writer.WriteCBORValue(1);
+		writer.WriteCBORValue(2);
+	writer.WriteCBORStopArrayMarker();
+
+	CBOR.SetBuffer(writer.Pointer(), writer.Size());
+	CBOR.Parse();
+
+	localwriter.Clear();
+	CBOR.Serialize(localwriter);
+
+	uint8_t eqsample[] = { 0x82, 0x01, 0x02 };
+	ASSERT_EQ(localwriter.Size(), sizeof(eqsample));
+	ASSERT_TRUE(0 == std::memcmp(localwriter.Pointer(), eqsample, sizeof(eqsample)));
+
+	// целые на границах int64_t/uint64_t сохраняют знак: 2^63, 2^64-1, -2^63, -1
+	uint8_t integers[] = { 0x84,
+		0x1b, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x1b, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0x3b, 0x7f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0x20 };
+	CBOR.SetBuffer(integers, sizeof(integers));
+	CBOR.Parse();
+
+	localwriter.Clear();
+	CBOR.Serialize(localwriter);
+	ASSERT_EQ(localwriter.Size(), sizeof(integers));
+	ASSERT_TRUE(0 == std::memcmp(localwriter.Pointer(), integers, sizeof(integers)));
+}
+
+TEST(TRCBORObjectModel, ZeroCopy)
+{
+	TRCBORWriter localwriter;
+	localwriter.WriteCBORItemsArrayMarker(2);
+		localwriter.WriteCBORString("first string");
+		localwriter.WriteCBORString("second string");
+
+	// буфер передается модели во владение
+	void* buffer = malloc(localwriter.Size());
+	memcpy(buffer, localwriter.Pointer(), localwriter.Size());
+	const char* begin = (const char*)buffer;
+	const char* end = begin + localwriter.Size();
+
+	std::shared_ptr<const void> handle;
+	{
+		TRCBORObjectModel model;
+		model.SetBuffer(std::shared_ptr<const void>(buffer, free), localwriter.Size());
+		model.Parse();
+
+		TRCBORStringView view = model.GetChild(0)->GetChild(0)->AsStringView();
+		ASSERT_TRUE(view.data > begin && view.data < end); // ссылка в исходный буфер
+		ASSERT_TRUE(view.Equals("first string"));
+
+		// изменение - в копии, исходный буфер не меняется
+		model.GetChild(0)->GetChild(1)->AsString() = "changed";
+		ASSERT_TRUE(model.GetChild(0)->GetChild(1)->AsStringView().Equals("changed"));
+		TRCBORWriter serialized;
+		model.Serialize(serialized);
+		ASSERT_EQ(serialized.Size(), localwriter.Size() - 6);
+
+		handle = model.GetBufferHandle();
+		ASSERT_EQ(handle.use_count(), 2);
+	}
+
+	// модели уже нет - буфер жив, пока есть ссылка
+	ASSERT_EQ(handle.use_count(), 1);
+	ASSERT_EQ(memcmp(handle.get(), localwriter.Pointer(), localwriter.Size()), 0);
+
+	// буфер вызывающего: по умолчанию строки копируются, с zerocopy - нет
+	TRCBORObjectModel model;
+	model.SetBuffer(localwriter.Pointer(), localwriter.Size());
+	model.Parse();
+	const char* data = model.GetChild(0)->GetChild(0)->AsStringView().data;
+	ASSERT_TRUE(data < (char*)localwriter.Pointer() || data >= (char*)localwriter.Pointer() + localwriter.Size());
+	ASSERT_EQ(model.GetBufferHandle(), nullptr);
+
+	model.SetBuffer(localwriter.Pointer(), localwriter.Size(), true);
+	model.Parse();
+	ASSERT_EQ(model.GetChild(0)->GetChild(0)->AsStringView().data, (char*)localwriter.Pointer() + 2);
+
+	// компактная модель тоже может удерживать буфер
+	TRCBORFlatModel flatmodel;
+	flatmodel.SetBuffer(handle, localwriter.Size());
+	handle.reset();
+	flatmodel.Parse();
+	ASSERT_EQ(flatmodel.GetChild(0)->GetChild(1)->AsString(), "second string");
+}
+
+TEST(TRCBORObjectModel, Errors)
+{
+	TRCBORObjectModel model;
+
+	uint8_t valid[] = { 0x82, 0x01, 0xbf, 0x01, 0x02, 0xff };
+	model.SetBuffer(valid, sizeof(valid));
+	ASSERT_TRUE(model.Parse());
+	ASSERT_EQ(model.GetError(), HCBORERR_OK);
+
+	// конец данных внутри массива: [1, [_ 2, ... - объекты до ошибки остаются
+	uint8_t truncatednested[] = { 0x83, 0x01, 0x9f, 0x02 };
+	model.SetBuffer(truncatednested, sizeof(truncatednested));
+	ASSERT_FALSE(model.Parse());
+	ASSERT_EQ(model.GetError(), HCBORERR_TRUNCATED);
+	ASSERT_EQ(model.GetErrorOffset(), 4);
+	ASSERT_EQ(model.GetChildsCount(), 1);
+	ASSERT_EQ(model.GetChild(0)->GetChildsCount(), 2);
+	ASSERT_EQ(model.GetChild(0)->GetChild(1)->GetChild(0)->AsInt32(), 2);
+
+	// вложенность ограничена HCBOR_MAX_NESTING_DEPTH, без переполнения стека
+	std::vector<uint8_t> deep(100000, 0x81);
+	model.SetBuffer(deep.data(), deep.size());
+	ASSERT_FALSE(model.Parse());
+	ASSERT_EQ(model.GetError(), HCBORERR_TOODEEP);
+	ASSERT_EQ(model.GetErrorOffset(), HCBOR_MAX_NESTING_DEPTH);
+
+	deep.resize(HCBOR_MAX_NESTING_DEPTH + 1);
+	deep.back() = 0x00;
+	model.SetBuffer(deep.data(), deep.size());
+	ASSERT_TRUE(model.Parse());
+	ASSERT_EQ(model.GetError(), HCBORERR_OK);
+
+	// break после тега, посреди пары и вне массива неопределенной длины
+	uint8_t tagbreak[] = { 0x9f, 0xc1, 0xff };
+	uint8_t oddmap[] = { 0xbf, 0x01, 0x02, 0x03, 0xff };
+	uint8_t definitebreak[] = { 0x82, 0x01, 0xff };
+	uint8_t straybreak[] = { 0x01, 0xff };
+	uint8_t* breaks[] = { tagbreak, oddmap, definitebreak, straybreak };
+	size_t breaksizes[] = { sizeof(tagbreak), sizeof(oddmap), sizeof(definitebreak), sizeof(straybreak) };
+	for (size_t i = 0; i < 4; ++i)
+	{
+		model.SetBuffer(breaks[i], breaksizes[i]);
+		ASSERT_FALSE(model.Parse());
+		ASSERT_EQ(model.GetError(), HCBORERR_UNEXPECTEDBREAK);
+		ASSERT_EQ(model.GetErrorOffset(), breaksizes[i] - 1);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Test TRCBORFlatModel
+
+// рекурсивное сравнение компактной модели с TRCBORObjectModel
+// сравнение узлов компактной или ленивой модели с обычной объектной моделью
+template <class T> static void compareflat(TRCBORObject* Object, T* Flat)
+{
+	ASSERT_NE(Flat, nullptr);
+	ASSERT_EQ(Flat->GetType(), Object->GetType());
+	ASSERT_EQ(Flat->GetChildsCount(), Object->GetChildsCount());
+	ASSERT_EQ(Flat->AsInt64(), Object->AsInt64());
+	ASSERT_EQ(Flat->AsDouble(), Object->AsDouble());
+	ASSERT_EQ(Flat->AsBool(), Object->AsBool());
+	ASSERT_EQ(Flat->AsString(), Object->AsString());
+
+	void* bytes;
+	const void* flatbytes;
+	size_t size, flatsize;
+	ASSERT_EQ(Flat->GetByteArray(&flatbytes, flatsize), Object->GetByteArray(&bytes, size));
+	if (Object->GetType() == HOBJTYPE_BYTEARRAY)
+	{
+		ASSERT_EQ(flatbytes, bytes);
+		ASSERT_EQ(flatsize, size);
+	}
+
+	for (size_t i = 0; i < Object->GetChildsCount(); ++i)
+		compareflat(Object->GetChild(i), Flat->GetChild(i));
+	ASSERT_EQ(Flat->GetChild(Object->GetChildsCount()), nullptr);
+}
+
+static void writemodeldocument(TRCBORWriter& localwriter)
+{
+	uint8_t bytes[5] = { 1, 2, 3, 4, 5 };
+
+	localwriter.WriteCBORPairsArrayMarker(4);
+		localwriter.WriteCBORString("ints");
+		localwriter.WriteCBORItemsArrayMarker(5);
+			localwriter.WriteCBORValue(-7);
+			localwriter.WriteCBORValue(100000);
+			localwriter.WriteCBORValue((int64_t)-5000000000LL);
+			localwriter.WriteCBORItemsArrayMarker(0);
+			localwriter.WriteCBORValue(3);
+		localwriter.WriteCBORString("floats");
+		localwriter.WriteCBORItemsArrayMarker();
+			localwriter.WriteCBORFloat(1.25f);
+			localwriter.WriteCBORFloat(0.1);
+			localwriter.WriteCBORPairsArrayMarker(1);
+				localwriter.WriteCBORString("nested");
+				localwriter.WriteCBORBool(true);
+		localwriter.WriteCBORStopArrayMarker();
+		localwriter.WriteCBORString("bytes");
+		localwriter.WriteCBORByteArray(bytes, sizeof(bytes));
+		localwriter.WriteCBORString("other");
+		localwriter.WriteCBORItemsArrayMarker(3);
+			localwriter.WriteCBORNull();
+			localwriter.WriteCBORUndefined();
+			localwriter.WriteCBORBool(false);
+	localwriter.WriteCBORString("second document item");
+}
+
+TEST(TRCBORFlatModel, Parse)
+{
+	TRCBORWriter localwriter;
+	writemodeldocument(localwriter);
+
+	TRCBORObjectModel model;
+	model.SetBuffer(localwriter.Pointer(), localwriter.Size());
+	model.Parse();
+
+	TRCBORFlatModel flatmodel;
+	for (int i = 0; i < 2; ++i) // повторный разбор
+	{
+		flatmodel.SetBuffer(localwriter.Pointer(), localwriter.Size());
+		flatmodel.Parse();
+
+		ASSERT_EQ(flatmodel.GetChildsCount(), model.GetChildsCount());
+		for (size_t j = 0; j < model.GetChildsCount(); ++j)
+			compareflat(model.GetChild(j), flatmodel.GetChild(j));
+		ASSERT_EQ(flatmodel.GetChild(2), nullptr);
+		ASSERT_EQ(flatmodel.GetNodesCount(), 23);
+	}
+
+	// строки - ссылки в исходный буфер
+	TRCBORStringView key = flatmodel.GetChild(0)->GetChild(0)->AsStringView();
+	ASSERT_TRUE(key.data > (char*)localwriter.Pointer() && key.data < (char*)localwriter.Pointer() + localwriter.Size());
+	ASSERT_EQ(flatmodel.GetChild(0)->GetChild(1)->GetChild(2)->AsInt64(), -5000000000LL);
+	ASSERT_EQ(flatmodel.GetError(), HCBORERR_OK);
+}
+
+TEST(TRCBORFlatModel, Errors)
+{
+	TRCBORFlatModel flatmodel;
+
+	// обрезанный массив из 3 элементов: количество не помещается в остаток буфера
+	uint8_t truncated[] = { 0x83, 0x01 };
+	flatmodel.SetBuffer(truncated, sizeof(truncated));
+	ASSERT_FALSE(flatmodel.Parse());
+	ASSERT_EQ(flatmodel.GetError(), HCBORERR_TRUNCATED);
+	ASSERT_EQ(flatmodel.GetErrorOffset(), 0);
+	ASSERT_EQ(flatmodel.GetChildsCount(), 0);
+
+	// конец данных внутри контейнера: [1, [_ 2, ... - узлы до ошибки остаются
+	uint8_t truncatednested[] = { 0x83, 0x01, 0x9f, 0x02 };
+	flatmodel.SetBuffer(truncatednested, sizeof(truncatednested));
+	ASSERT_FALSE(flatmodel.Parse());
+	ASSERT_EQ(flatmodel.GetError(), HCBORERR_TRUNCATED);
+	ASSERT_EQ(flatmodel.GetErrorOffset(), 4);
+	ASSERT_EQ(flatmodel.GetChildsCount(), 1);
+	ASSERT_EQ(flatmodel.GetChild(0)->GetChildsCount(), 2);
+	ASSERT_EQ(flatmodel.GetChild(0)->GetChild(0)->AsInt32(), 1);
+	ASSERT_EQ(flatmodel.GetChild(0)->GetChild(1)->GetChild(0)->AsInt32(), 2);
+
+	// вложенность ограничена HCBOR_MAX_NESTING_DEPTH, без переполнения стека
+	std::vector<uint8_t> deep(100000, 0x81);
+	flatmodel.SetBuffer(deep.data(), deep.size());
+	ASSERT_FALSE(flatmodel.Parse());
+	ASSERT_EQ(flatmodel.GetError(), HCBORERR_TOODEEP);
+	ASSERT_EQ(flatmodel.GetErrorOffset(), HCBOR_MAX_NESTING_DEPTH);
+
+	deep.resize(HCBOR_MAX_NESTING_DEPTH + 1);
+	deep.back() = 0x00;
+	flatmodel.SetBuffer(deep.data(), deep.size());
+	ASSERT_TRUE(flatmodel.Parse());
+	ASSERT_EQ(flatmodel.GetNodesCount(), deep.size());
+
+	// break после тега, посреди пары и вне массива неопределенной длины
+	uint8_t tagbreak[] = { 0x9f, 0xc1, 0xff };
+	uint8_t oddmap[] = { 0xbf, 0x01, 0x02, 0x03, 0xff };
+	uint8_t definitebreak[] = { 0x82, 0x01, 0xff };
+	uint8_t straybreak[] = { 0x01, 0xff };
+	const uint8_t* breaks[] = { tagbreak, oddmap, definitebreak, straybreak };
+	size_t breaksizes[] = { sizeof(tagbreak), sizeof(oddmap), sizeof(definitebreak), sizeof(straybreak) };
+	for (size_t i = 0; i < 4; ++i)
+	{
+		flatmodel.SetBuffer((void*)breaks[i], breaksizes[i]);
+		ASSERT_FALSE(flatmodel.Parse());
+		ASSERT_EQ(flatmodel.GetError(), HCBORERR_UNEXPECTEDBREAK);
+		ASSERT_EQ(flatmodel.GetErrorOffset(), breaksizes[i] - 1);
+	}
+
+	// тег перед массивом и map неопределенной длины из четного количества - без ошибок
+	uint8_t tagged[] = { 0xc1, 0xbf, 0x01, 0x9f, 0xff, 0xff };
+	flatmodel.SetBuffer(tagged, sizeof(tagged));
+	ASSERT_TRUE(flatmodel.Parse());
+	ASSERT_EQ(flatmodel.GetChild(0)->GetChildsCount(), 2);
+
+	// строка больше 4 Гб: данные строки не читаются, достаточно заголовка и размера буфера
+	if (sizeof(size_t) > 4)
+	{
+		uint8_t hugestring[] = { 0x81, 0x5b, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00 };
+		flatmodel.SetBuffer(hugestring, sizeof(hugestring) + ((size_t)UINT32_MAX + 1));
+		ASSERT_FALSE(flatmodel.Parse());
+		ASSERT_EQ(flatmodel.GetError(), HCBORERR_UNSUPPORTED);
+		ASSERT_EQ(flatmodel.GetErrorOffset(), 1);
+	}
+}
+
+TEST(TRCBORLazyModel, Parse)
+{
+	TRCBORWriter localwriter;
+	writemodeldocument(localwriter);
+
+	TRCBORObjectModel model;
+	model.SetBuffer(localwriter.Pointer(), localwriter.Size());
+	model.Parse();
+
+	TRCBORLazyModel lazymodel;
+	for (int i = 0; i < 2; ++i) // повторный разбор
+	{
+		lazymodel.SetBuffer(localwriter.Pointer(), localwriter.Size());
+		lazymodel.Parse();
+		ASSERT_EQ(lazymodel.GetNodesCount(), 0);
+
+		// разбирается только пройденное
+		TRCBORLazyObject* Root = lazymodel.GetChild(0);
+		ASSERT_EQ(lazymodel.GetNodesCount(), 1);
+		ASSERT_EQ(Root->GetChildsCount(), 8); // из заголовка
+		ASSERT_EQ(lazymodel.GetNodesCount(), 1);
+		ASSERT_EQ(Root->GetChild(0)->AsString(), "ints");
+		ASSERT_EQ(Root->GetChild(1)->GetChild(1)->AsInt32(), 100000);
+		ASSERT_EQ(lazymodel.GetNodesCount(), 5);
+		ASSERT_FALSE(Root->GetChild(1)->IsComplete());
+
+		// массив "floats" неопределенной длины - количество только после разбора до break
+		TRCBORLazyObject* Floats = Root->GetChild(3);
+		ASSERT_EQ(lazymodel.GetNodesCount(), 7);
+		ASSERT_EQ(Floats->GetChildsCount(), 3);
+		ASSERT_TRUE(Floats->IsComplete());
+		ASSERT_EQ(Floats->GetChild(2)->GetChild(0)->AsString(), "nested");
+		ASSERT_EQ(Root->GetChild(6)->AsString(), "other");
+		ASSERT_EQ(lazymodel.GetNodesCount(), 14);
+
+		ASSERT_EQ(lazymodel.GetChildsCount(), 2);
+		for (size_t j = 0; j < model.GetChildsCount(); ++j)
+			compareflat(model.GetChild(j), lazymodel.GetChild(j));
+		ASSERT_EQ(lazymodel.GetChild(2), nullptr);
+		ASSERT_EQ(lazymodel.GetNodesCount(), 23);
+		ASSERT_EQ(lazymodel.GetError(), HCBORERR_OK);
+	}
+
+	// второй элемент обрезан - ошибка при разборе верхнего уровня, первый доступен
+	size_t firstsize = localwriter.Size() - 21; // строка "second document item" - 1 + 20 байт
+	lazymodel.SetBuffer(localwriter.Pointer(), localwriter.Size() - 5);
+	lazymodel.Parse();
+	ASSERT_EQ(lazymodel.GetChildsCount(), 1);
+	ASSERT_EQ(lazymodel.GetError(), HCBORERR_TRUNCATED);
+	ASSERT_EQ(lazymodel.GetErrorOffset(), firstsize);
+	ASSERT_EQ(lazymodel.GetChild(0)->GetChild(1)->GetChild(2)->AsInt64(), -5000000000LL);
+
+	// обрезан последний вложенный массив: данные до него доступны, ошибка - при обращении к обрезанному
+	lazymodel.SetBuffer(localwriter.Pointer(), firstsize - 1);
+	lazymodel.Parse();
+	TRCBORLazyObject* Root = lazymodel.GetChild(0);
+	ASSERT_EQ(Root->GetChild(1)->GetChild(2)->AsInt64(), -5000000000LL);
+	ASSERT_EQ(Root->GetChild(6)->AsString(), "other");
+	ASSERT_EQ(lazymodel.GetError(), HCBORERR_OK);
+	ASSERT_EQ(Root->GetChild(7), nullptr);
+	ASSERT_EQ(Root->GetChildsCount(), 7);
+	ASSERT_EQ(lazymodel.GetError(), HCBORERR_TRUNCATED);
+	ASSERT_EQ(lazymodel.GetErrorOffset(), firstsize - 4); // заголовок массива из 3 элементов
+
+	// на верхнем уровне конец первого элемента ищется пропуском
+	ASSERT_EQ(lazymodel.GetChildsCount(), 1);
+
+	// тег перед break: [_ 1(break)] - ошибка, а не пустой массив
+	uint8_t tagbreak[] = { 0x9f, 0xc1, 0xff };
+	lazymodel.SetBuffer(tagbreak, sizeof(tagbreak));
+	lazymodel.Parse();
+	ASSERT_EQ(lazymodel.GetChild(0)->GetChildsCount(), 0);
+	ASSERT_EQ(lazymodel.GetError(), HCBORERR_UNEXPECTEDBREAK);
+	ASSERT_EQ(lazymodel.GetErrorOffset(), 2);
+
+	// тег в конце данных
+	uint8_t tagend[] = { 0x01, 0xc1 };
+	lazymodel.SetBuffer(tagend, sizeof(tagend));
+	lazymodel.Parse();
+	ASSERT_EQ(lazymodel.GetChildsCount(), 1);
+	ASSERT_EQ(lazymodel.GetError(), HCBORERR_TRUNCATED);
+	ASSERT_EQ(lazymodel.GetErrorOffset(), 1);
+
+	// помеченные значения - обычные элементы
+	uint8_t tagged[] = { 0x82, 0xc1, 0x05, 0xd8, 0x18, 0xc1, 0x06 };
+	lazymodel.SetBuffer(tagged, sizeof(tagged));
+	lazymodel.Parse();
+	ASSERT_EQ(lazymodel.GetChild(0)->GetChild(1)->AsInt32(), 6);
+	ASSERT_EQ(lazymodel.GetChild(0)->GetChildsCount(), 2);
+	ASSERT_EQ(lazymodel.GetError(), HCBORERR_OK);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Benchmarks (время на один элемент выводится в консоль)
+// собираются только с CBOR_BENCHMARKS, в обычный прогон тестов не входят
+
+#ifdef CBOR_BENCHMARKS
+
+template <class F> double benchmarkns(size_t itemscount, F func)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	func();
+	auto stop = std::chrono::high_resolution_clock::now();
+
+	return std::chrono::duration<double, std::nano>(stop - start).count() / itemscount;
+}
+
+TEST(TRCBORBenchmark, SmallIntegers)
+{
+	TRCBORWriter localwriter;
+	localwriter.Reserve(1000 * 9);
+
+	double ns = benchmarkns(10000 * 1000, [&]()
+	{
+		for (int i = 0; i < 10000; ++i)
+		{
+			localwriter.Clear();
+			for (int j = 0; j < 1000; ++j)
+				localwriter.WriteCBORValue(j - 500);
+		}
+	});
+
+	printf("WriteCBORValue(int32_t), small values: %.2f ns per item\n", ns);
+	ASSERT_GT(localwriter.Size(), 0);
+}
+
+TEST(TRCBORBenchmark, ShortStrings)
+{
+	TRCBORWriter localwriter;
+	localwriter.Reserve(1000 * 32);
+
+	std::string strarr[] = { "id", "name", "value", "timestamp", "a much longer key name" };
+
+	double ns = benchmarkns(10000 * 1000, [&]()
+	{
+		for (int i = 0; i < 10000; ++i)
+		{
+			localwriter.Clear();
+			for (int j = 0; j < 1000; ++j)
+				localwriter.WriteCBORString(strarr[j % 5]);
+		}
+	});
+
+	printf("WriteCBORString(std::string), short strings: %.2f ns per item\n", ns);
+	ASSERT_GT(localwriter.Size(), 0);
+}
+
+TEST(TRCBORBenchmark, LargeIntegersAndDoubles)
+{
+	TRCBORWriter localwriter;
+	localwriter.Reserve(1000 * 9 * 2);
+
+	double ns = benchmarkns(10000 * 1000, [&]()
+	{
+		for (int i = 0; i < 10000; ++i)
+		{
+			localwriter.Clear();
+			for (int j = 0; j < 1000; ++j)
+			{
+				localwriter.WriteCBORValue((int64_t)j * 0x10000001);
+				localwriter.WriteCBORFloat(j * 0.1);
+			}
+		}
+	});
+
+	printf("WriteCBORValue(int64_t) + WriteCBORFloat(double): %.2f ns per pair\n", ns);
+	ASSERT_GT(localwriter.Size(), 0);
+}
+
+TEST(TRCBORBenchmark, ReadIntegersAndDoubles)
+{
+	TRCBORWriter localwriter;
+
+	for (int j = 0; j < 1000; ++j)
+	{
+		localwriter.WriteCBORValue(j * 0x10001);
+		localwriter.WriteCBORFloat(j * 0.1);
+	}
+
+	TRCBORReader localreader;
+	TRHCBOROutType valuetype;
+	uint64_t outvalue;
+	size_t valuesize;
+	uint64_t sum = 0;
+
+	double ns = benchmarkns(10000 * 1000, [&]()
+	{
+		for (int i = 0; i < 10000; ++i)
+		{
+			localreader.SetBuffer(localwriter.Pointer(), localwriter.Size());
+			while (localreader.ParseCBOR(valuetype, &outvalue, valuesize) == true)
+				sum += outvalue;
+		}
+	});
+
+	printf("ParseCBOR int32_t + double: %.2f ns per pair\n", ns);
+	ASSERT_GT(sum, 0);
+}
+
+#endif // CBOR_BENCHMARKS
@@ -75,7 +75,7 @@ void utf8_decode(InIt in, const InIt end, OutIt out)
     }
 }
 
-//   wstring  utf8 string
+// коневертор из wstring в utf8 string
 std::string wstrTOutf8(const std::wstring& in)
 {
 	std::string out;
@@ -84,7 +84,7 @@ std::string wstrTOutf8(const std::wstring& in)
 	return out;
 }
 
-//   wchar  utf8 string
+// коневертор массива wchar в utf8 string
 std::string wstrTOutf8(const wchar_t* in, int sizein)
 { // sizein - symbols count
 	std::wstring in_str(in, sizein);
@@ -94,7 +94,7 @@ std::string wstrTOutf8(const wchar_t* in, int sizein)
 	return out;
 }
 
-//   utf8 string  wstring
+// коневертор из utf8 string в wstring
 std::wstring utf8TOwstr(const std::string& in)
 {
 	std::wstring out;
@@ -102,7 +102,7 @@ std::wstring utf8TOwstr(const std::string& in)
 	return out;
 }
 
-//   utf8  wstring
+// коневертор из utf8 в wstring
 std::wstring utf8TOwstr(const char* in, size_t sizein)
 { // sizein - bytes count
 	if (in == nullptr)
@@ -115,7 +115,7 @@ std::wstring utf8TOwstr(const char* in, size_t sizein)
 	return out;
 }
 
-//   2-  utf16       wchar. 2  4 .
+// конвертор массива 2-х байтовых utf16 символов в строку с размеров символа wchar. 2 или 4 байта.
 std::wstring wstrTOwstr(const unsigned short* in, size_t sizein)
 { // sizein - symbols count
 	wchar_t* ptr = new wchar_t[sizein + 1];